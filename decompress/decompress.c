@@ -0,0 +1,548 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lua streaming decompression reader implementation @file */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+
+#ifdef LUA_SANDBOX
+#include <luasandbox/heka/stream_reader.h>
+#endif
+
+static const char *mozsvc_decompress = "mozsvc.decompress";
+
+static const size_t default_chunk_size    = 64 * 1024;
+static const size_t default_max_prefetch  = 8 * 1024 * 1024;
+static const int    max_poll_readers      = 1024;
+
+typedef enum codec_type {
+  CODEC_NONE,
+  CODEC_GZIP,
+  CODEC_ZSTD
+} codec_type;
+
+static const char *codec_names[] = { "none", "gzip", "zstd", NULL };
+
+typedef enum read_status {
+  READ_ERROR = -1,
+  READ_AGAIN,
+  READ_DATA,
+  READ_EOF
+} read_status;
+
+typedef struct stream_reader
+{
+  FILE        *fp;
+  bool        is_pipe;
+  codec_type  codec;
+  bool        eof;      // no more compressed data will arrive
+  bool        more;     // the decoder may hold output without new input
+  bool        ended;    // the last gzip member/zstd frame is complete
+  bool        zinit;
+  z_stream    zs;
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zds;
+#endif
+  char        *in;      // compressed data buffer
+  size_t      in_size;
+  size_t      in_pos;
+  size_t      in_len;
+  size_t      chunk_size;
+  size_t      max_prefetch;
+  char        *out;     // scratch buffer for read()
+} stream_reader;
+
+
+static stream_reader* check_reader(lua_State *lua, int min_args, int max_args)
+{
+  stream_reader *sr = luaL_checkudata(lua, 1, mozsvc_decompress);
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= min_args && n <= max_args, 0,
+                "incorrect number of arguments");
+  if (!sr->fp) {
+    luaL_error(lua, "decompress reader is closed");
+  }
+  return sr;
+}
+
+
+static size_t check_size_option(lua_State *lua, int idx, const char *key,
+                                size_t dflt)
+{
+  lua_getfield(lua, idx, key);
+  int t = lua_type(lua, -1);
+  if (t == LUA_TNIL) {
+    lua_pop(lua, 1);
+    return dflt;
+  }
+  lua_Number n = lua_tonumber(lua, -1);
+  if (t != LUA_TNUMBER || n < 1 || n > 0x7fffffff) {
+    luaL_error(lua, "%s must be a number 1-2147483647", key);
+  }
+  lua_pop(lua, 1);
+  return (size_t)n;
+}
+
+
+static void close_reader(stream_reader *sr, int *status)
+{
+  if (sr->fp) {
+    int rv = sr->is_pipe ? pclose(sr->fp) : fclose(sr->fp);
+    if (status) {
+      if (sr->is_pipe && rv != -1 && WIFEXITED(rv)) {
+        *status = WEXITSTATUS(rv);
+      } else {
+        *status = rv;
+      }
+    }
+    sr->fp = NULL;
+  }
+  if (sr->zinit) {
+    inflateEnd(&sr->zs);
+    sr->zinit = false;
+  }
+#ifdef HAVE_ZSTD
+  if (sr->zds) {
+    ZSTD_freeDStream(sr->zds);
+    sr->zds = NULL;
+  }
+#endif
+  free(sr->in);
+  sr->in = NULL;
+  free(sr->out);
+  sr->out = NULL;
+}
+
+
+static int create_reader(lua_State *lua, bool is_pipe)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= 1 && n <= 3, 0, "incorrect number of arguments");
+  const char *source = luaL_checkstring(lua, 1);
+  codec_type codec = luaL_checkoption(lua, 2, "none", codec_names);
+#ifndef HAVE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    return luaL_error(lua, "zstd support was not compiled in");
+  }
+#endif
+
+  size_t chunk_size = default_chunk_size;
+  size_t max_prefetch = default_max_prefetch;
+  if (!lua_isnoneornil(lua, 3)) {
+    luaL_checktype(lua, 3, LUA_TTABLE);
+    chunk_size = check_size_option(lua, 3, "chunk_size", chunk_size);
+    max_prefetch = check_size_option(lua, 3, "max_prefetch", max_prefetch);
+  }
+  if (max_prefetch < chunk_size) max_prefetch = chunk_size;
+
+  stream_reader *sr = lua_newuserdata(lua, sizeof(stream_reader));
+  memset(sr, 0, sizeof(stream_reader));
+  sr->is_pipe = is_pipe;
+  sr->codec = codec;
+  sr->chunk_size = chunk_size;
+  sr->max_prefetch = max_prefetch;
+  luaL_getmetatable(lua, mozsvc_decompress);
+  lua_setmetatable(lua, -2);
+
+  sr->in_size = chunk_size;
+  sr->in = malloc(sr->in_size);
+  if (!sr->in) {
+    return luaL_error(lua, "memory allocation failed");
+  }
+
+  switch (codec) {
+  case CODEC_GZIP:
+    // 15 + 32 auto detects the zlib or gzip header
+    if (inflateInit2(&sr->zs, 15 + 32) != Z_OK) {
+      return luaL_error(lua, "inflateInit2 failed");
+    }
+    sr->zinit = true;
+    break;
+  case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+    sr->zds = ZSTD_createDStream();
+    if (!sr->zds) {
+      return luaL_error(lua, "ZSTD_createDStream failed");
+    }
+    size_t rv = ZSTD_initDStream(sr->zds);
+    if (ZSTD_isError(rv)) {
+      return luaL_error(lua, "ZSTD_initDStream failed: %s",
+                        ZSTD_getErrorName(rv));
+    }
+#endif
+    break;
+  default:
+    break;
+  }
+
+  sr->fp = is_pipe ? popen(source, "r") : fopen(source, "rb");
+  if (!sr->fp) {
+    return luaL_error(lua, "%s failed: %s %s", is_pipe ? "popen" : "fopen",
+                      source, strerror(errno));
+  }
+  int fd = fileno(sr->fp);
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return luaL_error(lua, "fcntl failed: %s", strerror(errno));
+  }
+  return 1;
+}
+
+
+static int decompress_popen(lua_State *lua)
+{
+  return create_reader(lua, true);
+}
+
+
+static int decompress_open(lua_State *lua)
+{
+  return create_reader(lua, false);
+}
+
+
+/**
+ * Reads the available compressed data into the input buffer.
+ *
+ * @param sr Stream reader
+ * @param timeout Milliseconds to wait for data (-1 blocks)
+ *
+ * @return read_status READ_DATA if data was added or the end of the source
+ *         was reached, READ_AGAIN if nothing was available (or the buffer is
+ *         full)
+ */
+static read_status fill(stream_reader *sr, int timeout)
+{
+  if (sr->eof) return READ_DATA;
+
+  if (sr->in_pos == sr->in_len) {
+    sr->in_pos = sr->in_len = 0;
+  } else if (sr->in_len == sr->in_size) {
+    if (sr->in_pos > 0) { // move the unprocessed data to the front
+      sr->in_len -= sr->in_pos;
+      memmove(sr->in, sr->in + sr->in_pos, sr->in_len);
+      sr->in_pos = 0;
+    } else if (sr->in_size < sr->max_prefetch) {
+      size_t size = sr->in_size * 2;
+      if (size > sr->max_prefetch) size = sr->max_prefetch;
+      char *in = realloc(sr->in, size);
+      if (!in) return READ_ERROR;
+      sr->in = in;
+      sr->in_size = size;
+    } else {
+      return READ_AGAIN;
+    }
+  }
+
+  int fd = fileno(sr->fp);
+  if (timeout != 0) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    int rv = poll(&pfd, 1, timeout);
+    if (rv < 0 && errno != EINTR) return READ_ERROR;
+    if (rv <= 0) return READ_AGAIN;
+  }
+
+  ssize_t len = read(fd, sr->in + sr->in_len, sr->in_size - sr->in_len);
+  if (len > 0) {
+    sr->in_len += len;
+    return READ_DATA;
+  }
+  if (len == 0) {
+    sr->eof = true;
+    return READ_DATA;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+    return READ_AGAIN;
+  }
+  return READ_ERROR;
+}
+
+
+static bool decode(stream_reader *sr, char *dst, size_t cap, size_t *produced,
+                   const char **err)
+{
+  size_t avail = sr->in_len - sr->in_pos;
+  switch (sr->codec) {
+  case CODEC_GZIP:
+    {
+      sr->zs.next_in = (Bytef *)sr->in + sr->in_pos;
+      sr->zs.avail_in = (uInt)avail;
+      sr->zs.next_out = (Bytef *)dst;
+      sr->zs.avail_out = (uInt)cap;
+      int rv = inflate(&sr->zs, Z_NO_FLUSH);
+      sr->in_pos += avail - sr->zs.avail_in;
+      *produced = cap - sr->zs.avail_out;
+      if (rv == Z_STREAM_END) {
+        inflateReset(&sr->zs); // concatenated gzip members
+        sr->ended = true;
+      } else if (rv != Z_OK && rv != Z_BUF_ERROR) {
+        *err = sr->zs.msg ? sr->zs.msg : "inflate failed";
+        return false;
+      } else if (avail != sr->zs.avail_in) {
+        sr->ended = false;
+      }
+    }
+    break;
+  case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+    {
+      ZSTD_inBuffer in = { sr->in + sr->in_pos, avail, 0 };
+      ZSTD_outBuffer out = { dst, cap, 0 };
+      size_t rv = ZSTD_decompressStream(sr->zds, &out, &in);
+      if (ZSTD_isError(rv)) {
+        *err = ZSTD_getErrorName(rv);
+        return false;
+      }
+      sr->in_pos += in.pos;
+      *produced = out.pos;
+      if (rv == 0) { // the frame is decoded and flushed
+        sr->ended = true;
+      } else if (in.pos) {
+        sr->ended = false;
+      }
+    }
+#endif
+    break;
+  default:
+    *produced = avail < cap ? avail : cap;
+    memcpy(dst, sr->in + sr->in_pos, *produced);
+    sr->in_pos += *produced;
+    break;
+  }
+  sr->more = *produced == cap;
+  return true;
+}
+
+
+/**
+ * Decompresses the next chunk of data into dst.
+ *
+ * @param sr Stream reader
+ * @param dst Output buffer
+ * @param cap Output buffer size
+ * @param timeout Milliseconds to wait for compressed data (-1 blocks)
+ * @param produced Set to the number of bytes written to dst
+ * @param err Set to the error message on READ_ERROR
+ *
+ * @return read_status
+ */
+static read_status read_chunk(stream_reader *sr, char *dst, size_t cap,
+                              int timeout, size_t *produced, const char **err)
+{
+  for (;;) {
+    *produced = 0;
+    if (sr->in_pos < sr->in_len || sr->more) {
+      if (!decode(sr, dst, cap, produced, err)) return READ_ERROR;
+      if (*produced) return READ_DATA;
+    }
+    if (sr->eof) {
+      if (sr->in_pos < sr->in_len) {
+        *err = "trailing data could not be decompressed";
+        return READ_ERROR;
+      }
+      if (sr->codec != CODEC_NONE && !sr->ended) {
+        *err = "truncated stream";
+        return READ_ERROR;
+      }
+      return READ_EOF;
+    }
+
+    read_status rs = fill(sr, timeout);
+    if (rs == READ_ERROR) {
+      *err = strerror(errno);
+      return READ_ERROR;
+    }
+    if (rs == READ_AGAIN) return READ_AGAIN;
+  }
+}
+
+
+static int decompress_read(lua_State *lua)
+{
+  stream_reader *sr = check_reader(lua, 1, 2);
+  int timeout = luaL_optint(lua, 2, -1);
+  if (!sr->out) {
+    sr->out = malloc(sr->chunk_size);
+    if (!sr->out) {
+      return luaL_error(lua, "memory allocation failed");
+    }
+  }
+
+  size_t produced;
+  const char *err = NULL;
+  read_status rs = read_chunk(sr, sr->out, sr->chunk_size, timeout, &produced,
+                              &err);
+  if (rs == READ_ERROR) {
+    return luaL_error(lua, "read failed: %s", err);
+  }
+  if (produced) {
+    lua_pushlstring(lua, sr->out, produced);
+  } else {
+    lua_pushnil(lua);
+  }
+  lua_pushboolean(lua, rs == READ_EOF);
+  return 2;
+}
+
+
+#ifdef LUA_SANDBOX
+static int decompress_read_into(lua_State *lua)
+{
+  stream_reader *sr = check_reader(lua, 2, 3);
+  heka_stream_reader *hsr = luaL_checkudata(lua, 2, LSB_HEKA_STREAM_READER);
+  int timeout = luaL_optint(lua, 3, -1);
+
+  // decompress directly after the data already buffered in the stream
+  // reader, into whatever space it has (like find_message does)
+  if (lsb_expand_input_buffer(&hsr->buf, 1)) {
+    return luaL_error(lua, "stream reader buffer is full");
+  }
+  size_t produced;
+  const char *err = NULL;
+  read_status rs = read_chunk(sr, hsr->buf.buf + hsr->buf.readpos,
+                              hsr->buf.size - hsr->buf.readpos, timeout,
+                              &produced, &err);
+  if (rs == READ_ERROR) {
+    return luaL_error(lua, "read failed: %s", err);
+  }
+  hsr->buf.readpos += produced;
+  lua_pushnumber(lua, (lua_Number)produced);
+  lua_pushboolean(lua, rs == READ_EOF);
+  return 2;
+}
+#endif
+
+
+static int decompress_prefetch(lua_State *lua)
+{
+  stream_reader *sr = check_reader(lua, 1, 1);
+  read_status rs;
+  do {
+    rs = fill(sr, 0);
+    if (rs == READ_ERROR) {
+      return luaL_error(lua, "read failed: %s", strerror(errno));
+    }
+  } while (rs == READ_DATA && !sr->eof);
+  lua_pushnumber(lua, (lua_Number)(sr->in_len - sr->in_pos));
+  return 1;
+}
+
+
+static int decompress_poll(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= 1 && n <= 2, 0, "incorrect number of arguments");
+  luaL_checktype(lua, 1, LUA_TTABLE);
+  int timeout = luaL_optint(lua, 2, -1);
+  int cnt = (int)lua_objlen(lua, 1);
+  luaL_argcheck(lua, cnt > 0 && cnt <= max_poll_readers, 1,
+                "must contain 1-1024 readers");
+
+  struct pollfd fds[cnt];
+  for (int i = 0; i < cnt; ++i) {
+    lua_rawgeti(lua, 1, i + 1);
+    stream_reader *sr = luaL_checkudata(lua, -1, mozsvc_decompress);
+    lua_pop(lua, 1);
+    if (!sr->fp) {
+      return luaL_error(lua, "decompress reader is closed");
+    }
+    if (sr->in_pos < sr->in_len || sr->more || sr->eof) {
+      lua_pushinteger(lua, i + 1); // buffered data is ready without a read
+      return 1;
+    }
+    fds[i].fd = fileno(sr->fp);
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+
+  int rv = poll(fds, cnt, timeout);
+  if (rv < 0 && errno != EINTR) {
+    return luaL_error(lua, "poll failed: %s", strerror(errno));
+  }
+  for (int i = 0; rv > 0 && i < cnt; ++i) {
+    if (fds[i].revents) {
+      lua_pushinteger(lua, i + 1);
+      return 1;
+    }
+  }
+  lua_pushnil(lua);
+  return 1;
+}
+
+
+static int decompress_close(lua_State *lua)
+{
+  stream_reader *sr = check_reader(lua, 1, 1);
+  int status = 0;
+  close_reader(sr, &status);
+  lua_pushinteger(lua, status);
+  return 1;
+}
+
+
+static int decompress_gc(lua_State *lua)
+{
+  stream_reader *sr = luaL_checkudata(lua, 1, mozsvc_decompress);
+  close_reader(sr, NULL);
+  return 0;
+}
+
+
+static int decompress_version(lua_State *lua)
+{
+  lua_pushstring(lua, DIST_VERSION);
+  return 1;
+}
+
+
+static const struct luaL_reg decompresslib_f[] =
+{
+  { "popen", decompress_popen }
+  , { "open", decompress_open }
+  , { "poll", decompress_poll }
+  , { "version", decompress_version }
+  , { NULL, NULL }
+};
+
+
+static const struct luaL_reg decompresslib_m[] =
+{
+  { "read", decompress_read }
+#ifdef LUA_SANDBOX
+  , { "read_into", decompress_read_into }
+#endif
+  , { "prefetch", decompress_prefetch }
+  , { "close", decompress_close }
+  , { "__gc", decompress_gc }
+  , { NULL, NULL }
+};
+
+
+int luaopen_decompress(lua_State *lua)
+{
+  luaL_newmetatable(lua, mozsvc_decompress);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, decompresslib_m);
+  luaL_register(lua, "decompress", decompresslib_f);
+  return 1;
+}
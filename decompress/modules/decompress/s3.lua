@@ -0,0 +1,199 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+--[[
+# S3 Heka Protobuf Stream Fetch Module
+
+Retrieves/reads each file from the `s3_file_list` for the S3 input sandboxes.
+The reader supports uncompressed, gzip, or zstd compression. The objects are
+decompressed as they are downloaded and parsed directly from the stream (no
+temporary file).
+
+A failed fetch (non zero exit status, corrupt or truncated object) is retried
+twice; the retry skips the decompressed data that was already parsed so no
+message is injected twice. If the retries fail the rest of the object is
+skipped.
+
+## Sample Configuration
+```lua
+s3_bucket       = "net-mozaws-prod-us-west-2-pipeline-data"
+s3_file_list    = "files.ls.1"
+
+-- Number of objects fetched in parallel
+-- Default:
+-- concurrent_fetches = 1
+
+-- When true the messages are injected in the `s3_file_list` order (the other
+-- fetches are buffered, see `max_prefetch`), when false they are injected as
+-- the data arrives
+-- Default:
+-- ordered = true
+
+-- Maximum number of compressed bytes buffered per fetch
+-- Default:
+-- max_prefetch = 8 * 1024 * 1024
+```
+
+## Functions
+
+### process
+
+Fetches every object in the file list, returns when the list is exhausted or
+the sandbox is stopped.
+
+*Arguments*
+- inject (function) Called with the stream reader and the object codec
+  ("none", "gzip" or "zstd") for every message found
+- decode (function, optional) Called with the codec of each object, returning
+  false frames its messages without decoding them (`find_message` decode
+  argument, default true)
+
+*Return*
+- none
+--]]
+
+-- Imports
+local decompress = require "decompress"
+local io         = require "io"
+local string     = require "string"
+local table      = require "table"
+
+local assert    = assert
+local ipairs    = ipairs
+local pcall     = pcall
+local print     = print
+local type      = type
+
+local create_stream_reader = create_stream_reader
+local is_running           = is_running
+
+local s3_bucket          = read_config("s3_bucket") or error("s3_bucket must be set")
+local s3_file_list       = assert(io.open(read_config("s3_file_list")))
+local concurrent_fetches = read_config("concurrent_fetches") or 1
+assert(type(concurrent_fetches) == "number" and concurrent_fetches >= 1, "invalid concurrent_fetches cfg")
+local ordered            = read_config("ordered")
+if ordered == nil then ordered = true end
+local reader_cfg         = {max_prefetch = read_config("max_prefetch")}
+
+local M = {}
+setfenv(1, M) -- Remove external access to contain everything in the module
+
+local codecs = {zst = "zstd", gz = "gzip"}
+
+
+local function start_fetch(slot, fn)
+    local ext = fn:match("%.([^.]-)$")
+    local cmd = string.format("aws s3 cp s3://%s/%s -", s3_bucket, fn)
+    print("processing", cmd)
+    slot.codec  = codecs[ext] or "none"
+    slot.reader = decompress.popen(cmd, slot.codec, reader_cfg)
+    slot.fn     = fn
+    slot.skip   = slot.bytes -- already parsed by a failed attempt
+    slot.failed = false
+end
+
+
+-- returns true if the fetch was restarted
+local function finish_fetch(slot)
+    local rv = slot.reader:close()
+    slot.reader = nil
+    if rv ~= 0 or slot.failed then
+        if slot.retries < 2 then
+            slot.retries = slot.retries + 1
+            start_fetch(slot, slot.fn)
+            return true
+        end
+        print("failed to fetch rv:", rv, " file:", slot.fn)
+        -- drop the partial message so it is not prepended to the next object
+        slot.hsr = create_stream_reader(slot.name)
+    end
+    return false
+end
+
+
+local function process_chunk(slot, timeout, inject)
+    local buf = ""
+    local ok, bytes, eof
+    if slot.skip > 0 then -- a retry, drop the data the failed attempt parsed
+        local chunk
+        ok, chunk, eof = pcall(slot.reader.read, slot.reader, timeout)
+        bytes = chunk
+        if ok then
+            chunk = chunk or ""
+            if #chunk > slot.skip then
+                buf = chunk:sub(slot.skip + 1)
+            end
+            slot.skip = slot.skip - (#chunk - #buf)
+            bytes = #buf
+        end
+    else
+        ok, bytes, eof = pcall(slot.reader.read_into, slot.reader, slot.hsr, timeout)
+    end
+    if not ok then -- corrupt or truncated object, handled as a failed fetch
+        print("read failed:", bytes, " file:", slot.fn)
+        slot.failed = true
+        return true
+    end
+    slot.bytes = slot.bytes + bytes
+
+    while slot.hsr:find_message(buf, slot.decode) do
+        inject(slot.hsr, slot.codec)
+        buf = ""
+    end
+    return eof
+end
+
+
+function process(inject, decode)
+    local next_file = s3_file_list:lines()
+    local active  = {} -- fetches in progress, in file list order
+    local readers = {} -- decompress readers of the active fetches
+
+    local function start(slot)
+        local fn = next_file()
+        if not fn then return end
+        slot.retries = 0
+        slot.bytes   = 0
+        start_fetch(slot, fn)
+        if decode then
+            slot.decode = decode(slot.codec) ~= false
+        else
+            slot.decode = true
+        end
+        active[#active + 1] = slot
+        readers[#readers + 1] = slot.reader
+    end
+
+    for i = 1, concurrent_fetches do
+        local name = "s3" .. i
+        start({name = name, hsr = create_stream_reader(name)})
+    end
+
+    while active[1] and is_running() do
+        local idx = 1
+        if not ordered then
+            idx = decompress.poll(readers, 1000)
+        end
+        if idx then
+            local slot = active[idx]
+            local eof = process_chunk(slot, ordered and 100 or 0, inject)
+            if ordered then
+                for i = 2, #active do active[i].reader:prefetch() end
+            end
+            if eof then
+                if finish_fetch(slot) then
+                    readers[idx] = slot.reader
+                else
+                    table.remove(active, idx)
+                    table.remove(readers, idx)
+                    start(slot)
+                end
+            end
+        end
+    end
+
+    for i, slot in ipairs(active) do slot.reader:close() end
+end
+
+return M
@@ -0,0 +1,128 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <luasandbox/heka/sandbox.h>
+#include <luasandbox/test/mu_test.h>
+#include <luasandbox/test/sandbox.h>
+
+#include "test_module.h"
+
+char *e = NULL;
+
+void dlog(void *context, const char *component, int level, const char *fmt, ...)
+{
+  (void)context;
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "%lld [%d] %s ", (long long)time(NULL), level,
+          component ? component : "unnamed");
+  vfprintf(stderr, fmt, args);
+  fwrite("\n", 1, 1, stderr);
+  va_end(args);
+}
+static lsb_logger logger = { .context = NULL, .cb = dlog };
+
+static int g_injected = 0;
+static int iim(void *parent, const char *pb, size_t pb_len, double cp_numeric,
+               const char *cp_string)
+{
+  (void)parent;
+  (void)pb_len;
+  (void)cp_numeric;
+  (void)cp_string;
+  if (pb) ++g_injected;
+  return 0;
+}
+
+
+static char* test_core()
+{
+  lsb_lua_sandbox *sb = lsb_create(NULL, "test.lua", TEST_MODULE_PATH, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* test_read_into()
+{
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_input(NULL, "test_sandbox_read_into.lua", NULL,
+                              TEST_MODULE_PATH, &logger, iim);
+  mu_assert(hsb, "lsb_heka_create_input failed");
+  mu_assert(0 == lsb_heka_pm_input(hsb, 0, NULL, false), "err: %s",
+            lsb_heka_get_error(hsb));
+  mu_assert(g_injected == 40, "injected: %d", g_injected);
+  e = lsb_heka_destroy_sandbox(hsb);
+  mu_assert(!e, "%s", e);
+  return NULL;
+}
+
+
+static char* test_s3()
+{
+  // tests/aws stands in for the aws cli, see test_sandbox_s3.lua
+  char cwd[1024];
+  mu_assert(getcwd(cwd, sizeof(cwd)), "getcwd failed");
+  const char *path = getenv("PATH");
+  char env[4096];
+  snprintf(env, sizeof(env), "%s:%s", cwd, path ? path : "");
+  setenv("PATH", env, 1);
+  unlink("s3_failed");
+
+  g_injected = 0;
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_input(NULL, "test_sandbox_s3.lua", NULL,
+                              TEST_MODULE_PATH
+                              "s3_bucket = 'test'\n"
+                              "s3_file_list = 's3.ls'\n"
+                              "concurrent_fetches = 2\n",
+                              &logger, iim);
+  mu_assert(hsb, "lsb_heka_create_input failed");
+  mu_assert(0 == lsb_heka_pm_input(hsb, 0, NULL, false), "err: %s",
+            lsb_heka_get_error(hsb));
+  mu_assert(g_injected == 60, "injected: %d", g_injected);
+  mu_assert(access("s3_failed", F_OK) == 0, "the fail/ fetch was not retried");
+  e = lsb_heka_destroy_sandbox(hsb);
+  mu_assert(!e, "%s", e);
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_core);
+  mu_run_test(test_read_into);
+  mu_run_test(test_s3);
+  return NULL;
+}
+
+
+int main()
+{
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  free(e);
+
+  return result != 0;
+}
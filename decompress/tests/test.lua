@@ -0,0 +1,92 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "decompress"
+require "string"
+require "table"
+assert(decompress.version() == "1.0.0", decompress.version())
+
+local errors = {
+    function() local r = decompress.popen() end, -- incorrect # args
+    function() local r = decompress.popen("true", "lz4") end, -- invalid codec
+    function() local r = decompress.popen("true", "none", {chunk_size = 0}) end, -- invalid chunk_size
+    function() local r = decompress.popen("true", "none", "options") end, -- invalid options
+    function() local r = decompress.open("/does/not/exist") end, -- missing file
+    function()
+        local r = decompress.popen("true")
+        r:close()
+        r:read() -- closed
+    end,
+    function() decompress.poll({}) end, -- no readers
+    function() decompress.poll({1}) end, -- not a reader
+    function()
+        local r = decompress.popen("printf 'not gzip data'", "gzip")
+        r:read()
+    end,
+}
+
+for i, v in ipairs(errors) do
+    local ok = pcall(v)
+    if ok then error(string.format("error test %d failed\n", i)) end
+end
+
+
+local function read_all(r)
+    local t = {}
+    local eof
+    repeat
+        local chunk
+        chunk, eof = r:read(-1)
+        if chunk then t[#t + 1] = chunk end
+    until eof
+    return table.concat(t)
+end
+
+local r = decompress.popen("printf 'one\\ntwo\\n'")
+assert(read_all(r) == "one\ntwo\n")
+assert(r:close() == 0)
+
+r = decompress.popen("exit 3")
+assert(read_all(r) == "")
+assert(r:close() == 3)
+
+-- concatenated gzip members, small chunks
+r = decompress.popen("printf 'hello ' | gzip -c; printf 'world' | gzip -c", "gzip", {chunk_size = 2})
+local s = read_all(r)
+assert(s == "hello world", s)
+assert(r:close() == 0)
+
+-- a truncated stream is an error rather than a short read
+for i, cmd in ipairs({"printf 'hello world' | gzip -c | head -c 20", "true"}) do
+    r = decompress.popen(cmd, "gzip")
+    local ok, err = pcall(read_all, r)
+    assert(not ok and err:match("read failed: truncated stream$"), tostring(err))
+    r:close()
+end
+
+local readers = {
+    decompress.popen("sleep 1"),
+    decompress.popen("printf 'ready'"),
+}
+assert(decompress.poll(readers, 5000) == 2)
+assert(readers[2]:prefetch() == 5)
+assert(readers[2]:read(0) == "ready")
+for i, v in ipairs(readers) do v:close() end
+
+r = decompress.popen("command -v zstd")
+local zstd_cli = read_all(r) ~= ""
+r:close()
+local ok, zstd = pcall(decompress.popen, "printf 'zstd data' | zstd -c 2>/dev/null", "zstd")
+if ok and zstd_cli then -- zstd support is compiled in and the cli is installed
+    s = read_all(zstd)
+    assert(zstd:close() == 0)
+    assert(s == "zstd data", s)
+
+    zstd = decompress.popen("printf 'zstd data' | zstd -c | head -c 12", "zstd")
+    local ok, err = pcall(read_all, zstd)
+    assert(not ok and err:match("read failed: truncated stream$"), tostring(err))
+    zstd:close()
+elseif ok then
+    zstd:close()
+end
@@ -0,0 +1,46 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "decompress"
+require "io"
+require "string"
+
+-- framed Heka message: uuid (zeros), timestamp 0 and the payload
+local function framed(payload)
+    local msg = "\10\16" .. string.rep("\0", 16) .. "\16\0\50" .. string.char(#payload) .. payload
+    return "\30\2\8" .. string.char(#msg) .. "\31" .. msg
+end
+
+local cnt = 20
+local fh = assert(io.open("read_into.hpb", "wb"))
+for i = 1, cnt do fh:write(framed("message " .. i)) end
+fh:close()
+
+local tests = {
+    {"gzip -c < read_into.hpb", {chunk_size = 7}}, -- messages straddle the reads
+    -- the first member ends inside the second message, the default chunk_size
+    -- is as large as the stream reader buffer
+    {"(head -c 50 read_into.hpb | gzip -c; tail -c +51 read_into.hpb | gzip -c)"},
+}
+
+function process_message()
+    for i, t in ipairs(tests) do
+        local hsr = create_stream_reader("read_into" .. i)
+        local r = decompress.popen(t[1], "gzip", t[2])
+        local n, eof = 0
+        repeat
+            local bytes
+            bytes, eof = r:read_into(hsr)
+            while hsr:find_message("") do
+                n = n + 1
+                local payload = hsr:read_message("Payload")
+                assert(payload == "message " .. n, string.format("test: %d received: %s", i, tostring(payload)))
+                inject_message(hsr)
+            end
+        until eof
+        assert(r:close() == 0)
+        assert(n == cnt, string.format("test: %d messages: %d", i, n))
+    end
+    return 0
+end
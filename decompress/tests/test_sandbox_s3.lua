@@ -0,0 +1,39 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "io"
+require "string"
+
+-- framed Heka message: uuid (zeros), timestamp 0 and the payload
+local function framed(payload)
+    local msg = "\10\16" .. string.rep("\0", 16) .. "\16\0\50" .. string.char(#payload) .. payload
+    return "\30\2\8" .. string.char(#msg) .. "\31" .. msg
+end
+
+local cnt = 20
+local fh = assert(io.open("s3.hpb", "wb"))
+for i = 1, cnt do fh:write(framed("message " .. i)) end
+fh:close()
+
+-- the fail/ object is cut half way by the first fetch (see tests/aws)
+fh = assert(io.open("s3.ls", "w"))
+fh:write("s3.hpb\ns3.hpb.gz\nfail/s3.hpb.gz\n")
+fh:close()
+
+local s3 = require "decompress.s3"
+
+local n = 0
+local function inject(hsr, codec)
+    n = n + 1
+    local expected = "message " .. ((n - 1) % cnt + 1)
+    local payload = hsr:read_message("Payload")
+    assert(payload == expected, string.format("message: %d codec: %s received: %s", n, codec, tostring(payload)))
+    inject_message(hsr)
+end
+
+function process_message()
+    s3.process(inject)
+    assert(n == 3 * cnt, string.format("messages: %d", n))
+    return 0
+end
@@ -3,10 +3,9 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 --[[
-# Single File Input (new line delimited)
-todo: when more than line splitting is needed the file should be read in chunks
-and passed to a generic splitter buffer with a token/match specification and a
-find function similar to the Heka stream reader.
+# Single File Input (delimited records)
+The file is read in chunks and split into records by the splitter module; the
+checkpoint is updated once per chunk.
 
 ## Sample Configuration
 ```lua
@@ -30,9 +29,24 @@ filename = "file.lua"
 -- with the Payload containing the error.
 -- Default:
 -- send_decode_failures = false
+
+-- Record delimiter token
+-- Default:
+-- delimiter = "\n"
+
+-- Set of bytes that mark a continuation line (a delimiter followed by any of
+-- them does not end the record) e.g. " \t" to keep indented stack traces
+-- together with the log line.
+-- Default:
+-- continuation = nil
+
+-- Records larger than this are split
+-- Default:
+-- max_record_size = 64 * 1024
 ```
 --]]
 require "io"
+require "splitter"
 require "string"
 
 local input_filename  = read_config("input_filename")
@@ -45,6 +59,10 @@ if not decode then
     error(decoder_module .. " does not provide a decode function")
 end
 local send_decode_failures  = read_config("send_decode_failures")
+local sp = splitter.new(read_config("delimiter"), {
+    continuation    = read_config("continuation"),
+    max_record_size = read_config("max_record_size"),
+})
 
 local err_msg = {
     Type    = "error",
@@ -63,18 +81,34 @@ function process_message(checkpoint)
     end
 
     local cnt = 0
-    for data in fh:lines() do
+    local function process_record(data)
         local ok, err = pcall(decode, data, default_headers)
         if (not ok or err) and send_decode_failures then
             err_msg.Payload = err
             pcall(inject_message, err_msg)
         end
+        cnt = cnt + 1
+    end
 
-        if input_filename then
-            checkpoint = checkpoint + #data + 1
-            inject_message(nil, checkpoint)
+    while true do
+        local data, consumed, read = sp:find_record(fh)
+        if input_filename and read > 0 then
+            inject_message(nil, checkpoint) -- once per chunk
         end
-        cnt = cnt + 1
+        if data then
+            process_record(data)
+        elseif read == 0 then
+            break
+        end
+        if input_filename then checkpoint = checkpoint + consumed end
+    end
+
+    local data, consumed = sp:flush() -- the last record may not be delimited
+    while data do
+        process_record(data)
+        if input_filename then checkpoint = checkpoint + consumed end
+        data, consumed = sp:flush()
     end
-    return 0, string.format("processed %d lines", cnt)
+    if input_filename then inject_message(nil, checkpoint) end
+    return 0, string.format("processed %d records", cnt)
 end
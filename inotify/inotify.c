@@ -0,0 +1,202 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lua inotify (Linux file system event) implementation @file */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+
+static const char *mozsvc_inotify = "mozsvc.inotify";
+
+// events required to follow the files in a directory
+static const uint32_t watch_mask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE
+    | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+typedef struct inotify_watcher
+{
+  int fd;
+} inotify_watcher;
+
+typedef struct event_name
+{
+  uint32_t    mask;
+  const char  *name;
+} event_name;
+
+static const event_name event_names[] = {
+  { IN_CREATE, "create" },
+  { IN_MODIFY, "modify" },
+  { IN_CLOSE_WRITE, "close_write" },
+  { IN_DELETE, "delete" },
+  { IN_MOVED_FROM, "moved_from" },
+  { IN_MOVED_TO, "moved_to" },
+  { IN_DELETE_SELF, "delete_self" },
+  { IN_MOVE_SELF, "move_self" },
+  { IN_IGNORED, "ignored" },
+  { IN_Q_OVERFLOW, "overflow" },
+  { 0, NULL }
+};
+
+
+static inotify_watcher* check_watcher(lua_State *lua, int min_args,
+                                      int max_args)
+{
+  inotify_watcher *w = luaL_checkudata(lua, 1, mozsvc_inotify);
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= min_args && n <= max_args, 0,
+                "incorrect number of arguments");
+  if (w->fd < 0) {
+    luaL_error(lua, "inotify watcher is closed");
+  }
+  return w;
+}
+
+
+static int inotify_new(lua_State *lua)
+{
+  luaL_argcheck(lua, lua_gettop(lua) == 0, 0, "incorrect number of arguments");
+  inotify_watcher *w = lua_newuserdata(lua, sizeof(inotify_watcher));
+  w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->fd < 0) {
+    return luaL_error(lua, "inotify_init1 failed: %s", strerror(errno));
+  }
+  luaL_getmetatable(lua, mozsvc_inotify);
+  lua_setmetatable(lua, -2);
+  return 1;
+}
+
+
+static int inotify_add(lua_State *lua)
+{
+  inotify_watcher *w = check_watcher(lua, 2, 2);
+  const char *path = luaL_checkstring(lua, 2);
+  int wd = inotify_add_watch(w->fd, path, watch_mask);
+  if (wd < 0) {
+    return luaL_error(lua, "inotify_add_watch failed: %s %s", path,
+                      strerror(errno));
+  }
+  lua_pushinteger(lua, wd);
+  return 1;
+}
+
+
+static int inotify_remove(lua_State *lua)
+{
+  inotify_watcher *w = check_watcher(lua, 2, 2);
+  int wd = luaL_checkint(lua, 2);
+  lua_pushboolean(lua, inotify_rm_watch(w->fd, wd) == 0);
+  return 1;
+}
+
+
+static void push_event(lua_State *lua, int idx, const struct inotify_event *ie,
+                       const char *name)
+{
+  lua_createtable(lua, 0, 3);
+  lua_pushinteger(lua, ie->wd);
+  lua_setfield(lua, -2, "wd");
+  lua_pushstring(lua, name);
+  lua_setfield(lua, -2, "event");
+  if (ie->len && ie->name[0]) {
+    lua_pushstring(lua, ie->name);
+    lua_setfield(lua, -2, "name");
+  }
+  lua_rawseti(lua, -2, idx);
+}
+
+
+static int inotify_read(lua_State *lua)
+{
+  inotify_watcher *w = check_watcher(lua, 1, 2);
+  int timeout = luaL_optint(lua, 2, 0);
+
+  struct pollfd pfd = { .fd = w->fd, .events = POLLIN, .revents = 0 };
+  int rv = poll(&pfd, 1, timeout);
+  if (rv < 0 && errno != EINTR) {
+    return luaL_error(lua, "poll failed: %s", strerror(errno));
+  }
+
+  lua_newtable(lua);
+  if (rv <= 0) return 1;
+
+  char buf[64 * 1024]
+      __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int idx = 0;
+  for (;;) {
+    ssize_t len = read(w->fd, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EINTR) break;
+      return luaL_error(lua, "read failed: %s", strerror(errno));
+    }
+    if (len == 0) break;
+
+    for (char *p = buf; p < buf + len;) {
+      const struct inotify_event *ie = (const struct inotify_event *)p;
+      for (const event_name *en = event_names; en->mask; ++en) {
+        if (ie->mask & en->mask) {
+          push_event(lua, ++idx, ie, en->name);
+        }
+      }
+      p += sizeof(struct inotify_event) + ie->len;
+    }
+  }
+  return 1;
+}
+
+
+static int inotify_gc(lua_State *lua)
+{
+  inotify_watcher *w = luaL_checkudata(lua, 1, mozsvc_inotify);
+  if (w->fd >= 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+  return 0;
+}
+
+
+static int inotify_version(lua_State *lua)
+{
+  lua_pushstring(lua, DIST_VERSION);
+  return 1;
+}
+
+
+static const struct luaL_reg inotifylib_f[] =
+{
+  { "new", inotify_new }
+  , { "version", inotify_version }
+  , { NULL, NULL }
+};
+
+
+static const struct luaL_reg inotifylib_m[] =
+{
+  { "add_watch", inotify_add }
+  , { "rm_watch", inotify_remove }
+  , { "read", inotify_read }
+  , { "close", inotify_gc }
+  , { "__gc", inotify_gc }
+  , { NULL, NULL }
+};
+
+
+int luaopen_inotify(lua_State *lua)
+{
+  luaL_newmetatable(lua, mozsvc_inotify);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, inotifylib_m);
+  luaL_register(lua, "inotify", inotifylib_f);
+  return 1;
+}
@@ -0,0 +1,244 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+--[[
+# Multi File Tail Input (inotify)
+
+Follows every file in a directory matching a glob. The directory is watched
+with inotify so a file is only read when it has new data and rotation
+(rename/create), truncation and deletion are handled as the events arrive. The
+read offset of every file is tracked by inode in a single checkpoint string.
+
+## Sample Configuration
+```lua
+filename = "tail_glob.lua"
+
+-- Directory to watch (not recursive)
+input_directory = "/var/log/app"
+
+-- Glob ('*' and '?' wildcards) the file names must match
+-- Default:
+-- input_glob = "*"
+
+-- Heka message table containing the default header values to use, if they are
+-- not populated by the decoder. If 'Fields' is specified it should be in the
+-- hashed based format see:  http://mozilla-services.github.io/lua_sandbox/heka/message.html
+-- Default:
+-- default_headers = nil
+
+-- Specifies a module that will decode the raw data and inject the resulting message.
+-- Default:
+-- decoder_module = "decoders.payload"
+
+-- Boolean, if true, any decode failure will inject a  message of Type "error",
+-- with the Payload containing the error.
+-- Default:
+-- send_decode_failures = false
+
+-- Record delimiter token
+-- Default:
+-- delimiter = "\n"
+
+-- Set of bytes that mark a continuation line (a delimiter followed by any of
+-- them does not end the record)
+-- Default:
+-- continuation = nil
+
+-- Records larger than this are split
+-- Default:
+-- max_record_size = 64 * 1024
+
+-- Number of bytes read from a file at a time (buffer allocated per open file)
+-- Default:
+-- chunk_size = 16 * 1024
+```
+--]]
+require "inotify"
+require "io"
+require "lfs"
+require "splitter"
+require "string"
+require "table"
+
+local is_running      = is_running
+local input_directory = read_config("input_directory") or error("input_directory is required")
+local input_glob      = read_config("input_glob") or "*"
+local default_headers = read_config("default_headers")
+assert(default_headers == nil or type(default_headers) == "table", "invalid default_headers cfg")
+
+local decoder_module  = read_config("decoder_module") or "decoders.payload"
+local decode          = require(decoder_module).decode
+if not decode then
+    error(decoder_module .. " does not provide a decode function")
+end
+local send_decode_failures  = read_config("send_decode_failures")
+local splitter_cfg = {
+    continuation    = read_config("continuation"),
+    max_record_size = read_config("max_record_size"),
+    chunk_size      = read_config("chunk_size") or 16 * 1024,
+}
+local delimiter = read_config("delimiter")
+
+local name_pattern = "^" .. input_glob:gsub("[%^%$%(%)%%%.%[%]%+%-]", "%%%0"):gsub("%*", ".*"):gsub("%?", ".") .. "$"
+
+local err_msg = {
+    Type    = "error",
+    Payload = nil,
+}
+
+local files   = {} -- tracked files by inode
+local names   = {} -- inode by file name
+local offsets = {} -- restored checkpoint offsets by inode
+local moved   = {} -- batch number by inode of the files renamed away
+local batch   = 0
+
+local function process_record(data)
+    local ok, err = pcall(decode, data, default_headers)
+    if (not ok or err) and send_decode_failures then
+        err_msg.Payload = err
+        pcall(inject_message, err_msg)
+    end
+end
+
+
+local function read_file(f)
+    local size = f.fh:seek("end")
+    if size < f.offset + f.sp:buffered() then -- truncated
+        f.offset = 0
+        f.sp:reset()
+        f.fh:seek("set", 0)
+    else
+        f.fh:seek("set", f.offset + f.sp:buffered())
+    end
+
+    while true do
+        local data, consumed, read = f.sp:find_record(f.fh)
+        if data then
+            process_record(data)
+        elseif read == 0 then
+            break
+        end
+        f.offset = f.offset + consumed
+    end
+end
+
+
+local function close_file(ino)
+    local f = files[ino]
+    if not f then return end
+    read_file(f) -- drain anything written before the rename/delete
+    local data = f.sp:flush()
+    while data do
+        process_record(data)
+        data = f.sp:flush()
+    end
+    f.fh:close()
+    files[ino] = nil
+    if names[f.name] == ino then names[f.name] = nil end
+end
+
+
+local function open_file(name, offset)
+    local path = string.format("%s/%s", input_directory, name)
+    local attr = lfs.attributes(path)
+    if not attr or attr.mode ~= "file" then return end -- e.g. ".", "..", subdirectories
+    local ino = attr.ino
+
+    local previous = names[name]
+    if previous and previous ~= ino then close_file(previous) end -- replaced
+
+    local f = files[ino]
+    if f then -- renamed within the directory
+        moved[ino] = nil
+        if names[f.name] == ino then names[f.name] = nil end
+        f.name = name
+        names[name] = ino
+        return f
+    end
+
+    local fh = io.open(path, "rb")
+    if not fh then return end
+    f = {fh = fh, name = name, offset = offset or offsets[ino] or 0,
+        sp = splitter.new(delimiter, splitter_cfg)}
+    offsets[ino] = nil
+    files[ino] = f
+    names[name] = ino
+    return f
+end
+
+
+local function get_checkpoint()
+    local t = {}
+    for ino, f in pairs(files) do
+        t[#t + 1] = string.format("%d:%d", ino, f.offset)
+    end
+    return table.concat(t, " ")
+end
+
+
+local function scan_directory()
+    for name in lfs.dir(input_directory) do
+        if name:match(name_pattern) then
+            local f = open_file(name)
+            if f then read_file(f) end
+        end
+    end
+end
+
+
+local watcher
+function process_message(checkpoint)
+    if not watcher then
+        if checkpoint then
+            for ino, offset in string.gmatch(checkpoint, "(%d+):(%d+)") do
+                offsets[tonumber(ino)] = tonumber(offset)
+            end
+        end
+        watcher = inotify.new()
+        watcher:add_watch(input_directory)
+        scan_directory() -- watch first so no file is missed
+        offsets = {} -- files that no longer exist
+        inject_message(nil, get_checkpoint())
+    end
+
+    while is_running() do
+        local events = watcher:read(1000)
+        for i, ev in ipairs(events) do
+            local e = ev.event
+            if e == "overflow" then
+                scan_directory()
+            elseif e == "delete_self" or e == "move_self" then
+                error("input_directory was removed: " .. input_directory)
+            elseif ev.name and ev.name:match(name_pattern) then
+                local ino = names[ev.name]
+                if e == "modify" or e == "close_write" then
+                    local f = ino and files[ino] or open_file(ev.name, 0)
+                    if f then read_file(f) end
+                elseif e == "create" or e == "moved_to" then
+                    local f = open_file(ev.name, 0)
+                    if f then read_file(f) end
+                elseif e == "moved_from" then
+                    if ino then
+                        read_file(files[ino])
+                        names[ev.name] = nil
+                        moved[ino] = batch
+                    end
+                elseif e == "delete" then
+                    if ino then close_file(ino) end
+                end
+            end
+        end
+        -- the moved_to can arrive in the next read so a file is only
+        -- considered rotated out of the glob a batch later
+        for ino, b in pairs(moved) do
+            if b < batch then
+                close_file(ino)
+                moved[ino] = nil
+            end
+        end
+        batch = batch + 1
+        if #events > 0 then inject_message(nil, get_checkpoint()) end
+    end
+    return 0
+end
@@ -0,0 +1,155 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <luasandbox/heka/sandbox.h>
+#include <luasandbox/test/mu_test.h>
+#include <luasandbox/test/sandbox.h>
+
+#include "test_module.h"
+
+char *e = NULL;
+
+void dlog(void *context, const char *component, int level, const char *fmt, ...)
+{
+  (void)context;
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "%lld [%d] %s ", (long long)time(NULL), level,
+          component ? component : "unnamed");
+  vfprintf(stderr, fmt, args);
+  fwrite("\n", 1, 1, stderr);
+  va_end(args);
+}
+static lsb_logger logger = { .context = NULL, .cb = dlog };
+
+#define TG_DIR "tail_glob"
+
+static lsb_heka_sandbox *g_hsb = NULL;
+static char g_payloads[64];
+
+
+static void write_file(const char *name, const char *mode, const char *data)
+{
+  char path[64];
+  snprintf(path, sizeof path, TG_DIR "/%s", name);
+  FILE *fh = fopen(path, mode);
+  if (fh) {
+    fputs(data, fh);
+    fclose(fh);
+  }
+}
+
+
+// each record drives the next step: rotate, truncate, delete and stop
+static int tail_glob_iim(void *parent, const char *pb, size_t pb_len,
+                         double cp_numeric, const char *cp_string)
+{
+  (void)parent;
+  (void)cp_numeric;
+  (void)cp_string;
+  if (!pb) return 0; // checkpoint only
+
+  lsb_heka_message m;
+  if (lsb_init_heka_message(&m, 1)) return 1;
+  char payload[8] = { 0 };
+  if (lsb_decode_heka_message(&m, pb, pb_len, NULL)) {
+    snprintf(payload, sizeof payload, "%.*s", (int)m.payload.len,
+             m.payload.s ? m.payload.s : "");
+  }
+  lsb_free_heka_message(&m);
+
+  size_t len = strlen(g_payloads);
+  snprintf(g_payloads + len, sizeof g_payloads - len, "%s ", payload);
+  if (strcmp(payload, "1") == 0) {
+    write_file("a.log", "a", "2\n");
+    rename(TG_DIR "/a.log", TG_DIR "/a.log.1");
+    write_file("a.log", "w", "333\n");
+  } else if (strcmp(payload, "333") == 0) {
+    mkdir(TG_DIR "/newdir", 0755); // directories matching the glob are ignored
+    write_file("a.log", "w", "4\n");
+  } else if (strcmp(payload, "4") == 0) {
+    unlink(TG_DIR "/a.log.1");
+    unlink(TG_DIR "/a.log");
+    write_file("b.log", "w", "5\n");
+  } else if (strcmp(payload, "5") == 0) {
+    lsb_heka_stop_sandbox_clean(g_hsb);
+  }
+  return 0;
+}
+
+
+static char* test_core()
+{
+  lsb_lua_sandbox *sb = lsb_create(NULL, "test.lua", TEST_MODULE_PATH, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* test_tail_glob()
+{
+  static const char *cfg = TEST_MODULE_PATH
+      "path = path .. ';./?.lua'\n"
+      "input_directory = '" TG_DIR "'\n"
+      "decoder_module = 'tail_glob_decoder'\n";
+
+  mkdir(TG_DIR, 0755);
+  mkdir(TG_DIR "/subdir", 0755);
+  rmdir(TG_DIR "/newdir");
+  unlink(TG_DIR "/a.log.1");
+  unlink(TG_DIR "/b.log");
+  write_file("a.log", "w", "1\n");
+  g_payloads[0] = 0;
+
+  g_hsb = lsb_heka_create_input(NULL, "tail_glob.lua", NULL, cfg, &logger,
+                                tail_glob_iim);
+  mu_assert(g_hsb, "lsb_heka_create_input failed");
+  mu_assert(0 == lsb_heka_pm_input(g_hsb, 0, NULL, false), "err: %s",
+            lsb_heka_get_error(g_hsb));
+  // a rotated file is read to its end exactly once
+  mu_assert(strcmp(g_payloads, "1 2 333 4 5 ") == 0, "received: %s",
+            g_payloads);
+  e = lsb_heka_destroy_sandbox(g_hsb);
+  mu_assert(!e, "%s", e);
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_core);
+  mu_run_test(test_tail_glob);
+  return NULL;
+}
+
+
+int main()
+{
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  free(e);
+
+  return result != 0;
+}
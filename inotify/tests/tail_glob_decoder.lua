@@ -0,0 +1,18 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- test_sandbox.c tail_glob decoder, injects each record as the Payload
+local inject_message = inject_message
+
+local M = {}
+setfenv(1, M)
+
+local msg = {}
+
+function decode(data)
+    msg.Payload = data
+    inject_message(msg)
+end
+
+return M
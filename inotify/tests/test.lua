@@ -0,0 +1,57 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "inotify"
+require "string"
+assert(inotify.version() == "1.0.0", inotify.version())
+
+local errors = {
+    function() local w = inotify.new(1) end, -- new() incorrect # args
+    function()
+        local w = inotify.new()
+        w:add_watch() -- incorrect # args
+    end,
+    function()
+        local w = inotify.new()
+        w:add_watch("/does/not/exist") -- invalid path
+    end,
+    function()
+        local w = inotify.new()
+        w:close()
+        w:read(0) -- closed
+    end,
+}
+
+for i, v in ipairs(errors) do
+    local ok = pcall(v)
+    if ok then error(string.format("error test %d failed\n", i)) end
+end
+
+local w = inotify.new()
+local wd = w:add_watch(".")
+assert(#w:read(0) == 0)
+
+local ok, io = pcall(require, "io")
+local ok1, os = pcall(require, "os")
+if ok and ok1 and os.remove then
+    local filename = "inotify_test.log"
+    local fh = assert(io.open(filename, "w"))
+    fh:write("one\n")
+    fh:close()
+    assert(os.remove(filename))
+
+    local expected = {"create", "modify", "close_write", "delete"}
+    local cnt = 0
+    for i, ev in ipairs(w:read(1000)) do
+        if ev.name == filename then
+            cnt = cnt + 1
+            assert(ev.wd == wd, ev.wd)
+            assert(ev.event == expected[cnt], string.format("expected: %s received: %s", expected[cnt], ev.event))
+        end
+    end
+    assert(cnt == #expected, cnt)
+end
+
+assert(w:rm_watch(wd))
+w:close()
@@ -0,0 +1,282 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * @brief Kafka producer/consumer sandbox benchmark using the librdkafka mock
+ * cluster @file
+ *
+ * usage: kafka_benchmark [messages] [payload_size] [encoder] [min_msgs_sec]
+ *  encoder: raw (heka protobuf), framed (heka framed protobuf) or Payload
+ *
+ * With no arguments a small matrix of sizes/encoders is run.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#include <luasandbox/heka/sandbox.h>
+#include <luasandbox/test/mu_test.h>
+#include <luasandbox/util/util.h>
+
+#include "test_module.h"
+
+#define MAX_SAMPLES 100000
+
+char *e = NULL;
+
+void dlog(void *context, const char *component, int level, const char *fmt, ...)
+{
+  (void)context;
+  if (level > 4) return;
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "[%d] %s ", level, component ? component : "unnamed");
+  vfprintf(stderr, fmt, args);
+  fwrite("\n", 1, 1, stderr);
+  va_end(args);
+}
+static lsb_logger logger = { .context = NULL, .cb = dlog };
+
+static rd_kafka_mock_cluster_t *mc = NULL;
+static lsb_heka_message g_im;
+static long long g_received = 0;
+static unsigned long long g_samples[MAX_SAMPLES];
+static size_t g_samples_cnt = 0;
+static volatile ptrdiff_t g_sequence = 0;
+
+
+static int ucp(void *parent, void *sequence_id)
+{
+  (void)parent;
+  g_sequence = (ptrdiff_t)sequence_id;
+  return 0;
+}
+
+
+static int iim(void *parent, const char *pb, size_t pb_len, double cp_numeric,
+               const char *cp_string)
+{
+  (void)parent;
+  (void)cp_numeric;
+  (void)cp_string;
+  unsigned long long t = lsb_get_time();
+  if (!lsb_decode_heka_message(&g_im, pb, pb_len, NULL)) {
+    return 1;
+  }
+  lsb_const_string name = { "received", 8 };
+  lsb_read_value v;
+  lsb_read_heka_field(&g_im, &name, 0, 0, &v);
+  if (v.type == LSB_READ_NUMERIC) {
+    g_received += (long long)v.u.d;
+  }
+  // the send time of every message in the batch
+  lsb_const_string sent = { "sent", 4 };
+  for (int i = 0; g_samples_cnt < MAX_SAMPLES
+       && lsb_read_heka_field(&g_im, &sent, 0, i, &v)
+       && v.type == LSB_READ_NUMERIC; ++i) {
+    unsigned long long ts = (unsigned long long)v.u.d;
+    g_samples[g_samples_cnt++] = t > ts ? t - ts : 0;
+  }
+  return 0;
+}
+
+
+static size_t encode_varint(unsigned long long v, char *buf)
+{
+  size_t i = 0;
+  while (v > 0x7f) {
+    buf[i++] = (char)(0x80 | (v & 0x7f));
+    v >>= 7;
+  }
+  buf[i++] = (char)v;
+  return i;
+}
+
+
+static int cmp_ull(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+
+static double percentile(double p)
+{
+  if (!g_samples_cnt) return 0;
+  size_t i = (size_t)(p * (g_samples_cnt - 1));
+  return g_samples[i] / 1e6;
+}
+
+
+static char* drain(lsb_heka_sandbox *in, lsb_heka_sandbox *out,
+                   long long received, ptrdiff_t sequence)
+{
+  unsigned long long deadline = lsb_get_time() + 60 * 1000000000ULL;
+  while (g_received < received || g_sequence != sequence) {
+    mu_assert(lsb_get_time() < deadline, "timed out delivered: %lld of %lld"
+              " received: %lld of %lld", (long long)g_sequence,
+              (long long)sequence, g_received, received);
+    mu_assert(0 == lsb_heka_timer_event(out, 0, false), "err: %s",
+              lsb_heka_get_error(out));
+    mu_assert(0 == lsb_heka_pm_input(in, 0, NULL, false), "err: %s",
+              lsb_heka_get_error(in));
+  }
+  return NULL;
+}
+
+
+static char* benchmark(long long messages, size_t size, const char *encoder,
+                       double min_rate)
+{
+  static const char uuid[] = "\x0a\x10\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09"
+      "\x0a\x0b\x0c\x0d\x0e\x0f\x10\x00";
+  char *pb = malloc(sizeof uuid + 11 + size);
+  mu_assert(pb, "malloc failed");
+  size_t pb_len = sizeof uuid - 1;
+  memcpy(pb, uuid, pb_len);
+  pb[pb_len++] = 0x32; // Payload
+  pb_len += encode_varint(size, pb + pb_len);
+  memset(pb + pb_len, 'x', size);
+  pb_len += size;
+
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m, pb, pb_len, NULL), "failed");
+
+  // each run gets its own topic/consumer group so no previous data is seen
+  static int run = 0;
+  char topic[32];
+  snprintf(topic, sizeof topic, "benchmark%d", ++run);
+  mu_assert(!rd_kafka_mock_topic_create(mc, topic, 4, 3), "topic create");
+
+  char cfg[4096];
+  snprintf(cfg, sizeof cfg, TEST_MODULE_PATH
+           "brokerlist = [[%s]]\n"
+           "topic = [[%s]]\n"
+           "encoder = [[%s]]\n"
+           "output_limit = 1024 * 1024\n",
+           rd_kafka_mock_cluster_bootstraps(mc), topic, encoder);
+
+  lsb_heka_sandbox *in, *out;
+  in = lsb_heka_create_input(NULL, "benchmark_mock_consumer.lua", NULL, cfg,
+                             &logger, iim);
+  mu_assert(in, "lsb_heka_create_input failed");
+  out = lsb_heka_create_output(NULL, "benchmark_mock_producer.lua", NULL, cfg,
+                               &logger, ucp);
+  mu_assert(out, "lsb_heka_create_output failed");
+
+  // warm up until the consumer group has been joined and is receiving
+  ptrdiff_t x = 1;
+  g_received = 0;
+  g_sequence = 0;
+  m.timestamp = (long long)lsb_get_time();
+  mu_assert(-5 == lsb_heka_pm_output(out, &m, (void *)x, false), "err: %s",
+            lsb_heka_get_error(out));
+  char *r = drain(in, out, 1, x);
+  if (r) return r;
+
+  g_received = 0;
+  g_samples_cnt = 0;
+  unsigned long long start = lsb_get_time();
+  for (long long i = 0; i < messages; ++i) {
+    int rv;
+    ++x;
+    m.timestamp = (long long)lsb_get_time();
+    while ((rv = lsb_heka_pm_output(out, &m, (void *)x, false)) == -3) {
+      mu_assert(0 == lsb_heka_timer_event(out, 0, false), "err: %s",
+                lsb_heka_get_error(out));
+      mu_assert(0 == lsb_heka_pm_input(in, 0, NULL, false), "err: %s",
+                lsb_heka_get_error(in));
+    }
+    mu_assert(rv == -5, "rv: %d err: %s", rv, lsb_heka_get_error(out));
+    if (x % 1000 == 0) {
+      mu_assert(0 == lsb_heka_pm_input(in, 0, NULL, false), "err: %s",
+                lsb_heka_get_error(in));
+    }
+  }
+  r = drain(in, out, messages, x);
+  if (r) return r;
+  double secs = (lsb_get_time() - start) / 1e9;
+  mu_assert(g_received == messages, "received: %lld expected: %lld",
+            g_received, messages);
+
+  e = lsb_heka_destroy_sandbox(out);
+  mu_assert(!e, "%s", e);
+  e = lsb_heka_destroy_sandbox(in);
+  mu_assert(!e, "%s", e);
+  lsb_free_heka_message(&m);
+  free(pb);
+
+  qsort(g_samples, g_samples_cnt, sizeof(g_samples[0]), cmp_ull);
+  double rate = messages / secs;
+  printf("benchmark encoder: %-7s size: %-6zu %10.0f msgs/sec %8.2f MB/sec"
+         " latency ms p50: %.2f p90: %.2f p99: %.2f max: %.2f\n",
+         encoder, size, rate, messages * (double)size / secs / 1e6,
+         percentile(0.5), percentile(0.9), percentile(0.99), percentile(1));
+  mu_assert(rate >= min_rate, "%g msgs/sec is below the minimum of %g", rate,
+            min_rate);
+  return NULL;
+}
+
+
+static char* benchmark_matrix()
+{
+  static const char *encoders[] = { "raw", "framed" };
+  static const size_t sizes[] = { 100, 1000, 10000 };
+  for (size_t i = 0; i < sizeof encoders / sizeof encoders[0]; ++i) {
+    for (size_t j = 0; j < sizeof sizes / sizeof sizes[0]; ++j) {
+      char *r = benchmark(50000, sizes[j], encoders[i], 0);
+      if (r) return r;
+    }
+  }
+  return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+  char errstr[512];
+  rd_kafka_conf_t *conf = rd_kafka_conf_new();
+  if (rd_kafka_conf_set(conf, "test.mock.num.brokers", "3", errstr,
+                        sizeof errstr) != RD_KAFKA_CONF_OK) {
+    fprintf(stderr, "%s\n", errstr);
+    return 1;
+  }
+  rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof errstr);
+  if (!rk) {
+    fprintf(stderr, "rd_kafka_new failed: %s\n", errstr);
+    return 1;
+  }
+  mc = rd_kafka_handle_mock_cluster(rk);
+  lsb_init_heka_message(&g_im, 8);
+
+  char *result;
+  if (argc > 1) {
+    long long messages = strtoll(argv[1], NULL, 10);
+    size_t size = argc > 2 ? (size_t)strtoul(argv[2], NULL, 10) : 100;
+    const char *encoder = argc > 3 ? argv[3] : "raw";
+    double min_rate = argc > 4 ? strtod(argv[4], NULL) : 0;
+    result = benchmark(messages, size, encoder, min_rate);
+  } else {
+    result = benchmark_matrix();
+  }
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("BENCHMARK COMPLETE\n");
+  }
+
+  lsb_free_heka_message(&g_im);
+  rd_kafka_destroy(rk);
+  free(e);
+  return result != 0;
+}
@@ -10,8 +10,10 @@
 #include <errno.h>
 #include <float.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <librdkafka/rdkafka.h>
 
 #include "lauxlib.h"
@@ -20,6 +22,7 @@
 #ifdef LUA_SANDBOX
 #include <luasandbox.h>
 #include <luasandbox/heka/sandbox.h>
+#include <luasandbox/heka/stream_reader.h>
 #include <luasandbox_output.h>
 #endif
 
@@ -27,22 +30,108 @@ static const char *mozsvc_kafka_consumer  = "mozsvc.kafka_consumer";
 static const char *mozsvc_kafka_producer  = "mozsvc.kafka_producer";
 static const char *mozsvc_kafka_table     = "kafka";
 
+static const size_t max_batch_size = 100000;
+
+#ifdef LUA_SANDBOX
+typedef enum {
+  KEY_NONE,
+  KEY_UUID,
+  KEY_TIMESTAMP,
+  KEY_TYPE,
+  KEY_LOGGER,
+  KEY_SEVERITY,
+  KEY_PAYLOAD,
+  KEY_ENV_VERSION,
+  KEY_PID,
+  KEY_HOSTNAME,
+  KEY_FIELD
+} message_key_source;
+#endif
+
+
+typedef struct delivery_report {
+  uintptr_t sequence_id;
+  bool      delivered;
+} delivery_report;
+
+
+// outstanding messages in send order
+typedef struct delivery_window {
+  delivery_report *reports;
+  size_t          size;
+  size_t          head;
+  size_t          cnt;
+} delivery_window;
+
+
+typedef struct msg_buffer {
+  struct msg_buffer *prev;
+  struct msg_buffer *next;
+  size_t            size;
+  int               bucket;
+  char              data[];
+} msg_buffer;
+
+
+#define BUFFER_BUCKETS 32
+#define BUFFER_MIN_SIZE 256
+
+// message payloads owned by the producer, recycled by the delivery report
+typedef struct buffer_pool {
+  msg_buffer          *free[BUFFER_BUCKETS];
+  msg_buffer          *in_use;
+  size_t              max_pooled;
+  size_t              pooled;
+  size_t              outstanding;
+  unsigned long long  allocations;
+  unsigned long long  reuses;
+} buffer_pool;
+
+
+// librdkafka opaque, the first member of the producer and consumer
+typedef struct kafka_client {
+  rd_kafka_t          *rk;
+#ifdef LUA_SANDBOX
+  const lsb_logger    *logger;
+#endif
+  char                *stats;
+  size_t              stats_len;
+  size_t              stats_size;
+  unsigned long long  stats_cnt;
+  int                 stats_ref; // decoded statistics table
+  unsigned long long  stats_ref_cnt;
+} kafka_client;
+
+
 typedef struct kafka_producer {
-  rd_kafka_t  *rk;
-  void        *msg_opaque;
+  kafka_client client;
+  buffer_pool pool;
+  delivery_window window;
+  uintptr_t   watermark;      // last sequence_id with all prior sends complete
+  size_t      advanced;       // completions since the last checkpoint
+  size_t      checkpoint_step;
+  time_t      checkpoint_interval;
+  time_t      checkpoint_time;
 #ifdef LUA_SANDBOX
-  const lsb_logger  *logger;
+  lsb_heka_sandbox  *hsb;
+  message_key_source  key_source;
+  char              *key_field;
 #endif
   int         failures;
 } kafka_producer;
 
 
 typedef struct kafka_consumer {
-  rd_kafka_t                      *rk;
+  kafka_client                    client;
   rd_kafka_topic_partition_list_t *topics;
-#ifdef LUA_SANDBOX
-  const lsb_logger  *logger;
-#endif
+  rd_kafka_queue_t                *queue;
+  rd_kafka_queue_t                **pqueues;
+  int                             pqueues_cnt;
+  int                             pqueues_pos;
+  rd_kafka_message_t              **batch;
+  size_t                          batch_size;
+  size_t                          batch_cnt;
+  size_t                          batch_pos;
 } kafka_consumer;
 
 
@@ -70,13 +159,214 @@ static void log_cb(const rd_kafka_t *rk,
                    const char *buf)
 {
   if (!rk) {return;}
-  kafka_producer *kp = rd_kafka_opaque(rk);
-  kp->logger->cb(kp->logger->context, rd_kafka_name(rk), level, "%s\t%s", fac,
+  kafka_client *kc = rd_kafka_opaque(rk);
+  kc->logger->cb(kc->logger->context, rd_kafka_name(rk), level, "%s\t%s", fac,
                  buf);
 }
 #endif
 
 
+static int stats_cb(rd_kafka_t *rk, char *json, size_t json_len, void *opaque)
+{
+  (void)rk;
+  kafka_client *kc = opaque;
+  if (json_len >= kc->stats_size) {
+    char *stats = realloc(kc->stats, json_len + 1);
+    if (!stats) return 0;
+    kc->stats = stats;
+    kc->stats_size = json_len + 1;
+  }
+  memcpy(kc->stats, json, json_len);
+  kc->stats[json_len] = 0;
+  kc->stats_len = json_len;
+  ++kc->stats_cnt;
+  return 0; // librdkafka frees the json
+}
+
+
+static void init_client(kafka_client *kc)
+{
+  kc->rk = NULL;
+#ifdef LUA_SANDBOX
+  kc->logger = NULL;
+#endif
+  kc->stats = NULL;
+  kc->stats_len = 0;
+  kc->stats_size = 0;
+  kc->stats_cnt = 0;
+  kc->stats_ref = LUA_NOREF;
+  kc->stats_ref_cnt = 0;
+}
+
+
+// The statistics are decoded with cjson once per emitted JSON document, the
+// table is shared by the calls until the next one arrives.
+static int push_stats(lua_State *lua, kafka_client *kc)
+{
+  if (!kc->stats_len) {
+    lua_pushnil(lua);
+    lua_pushnumber(lua, (lua_Number)kc->stats_cnt);
+    lua_pushnil(lua);
+    return 3;
+  }
+
+  if (kc->stats_ref == LUA_NOREF || kc->stats_ref_cnt != kc->stats_cnt) {
+    lua_getglobal(lua, "require");
+    lua_pushstring(lua, "cjson");
+    lua_call(lua, 1, 1);
+    lua_getfield(lua, -1, "decode");
+    lua_pushlstring(lua, kc->stats, kc->stats_len);
+    lua_call(lua, 1, 1);
+    luaL_unref(lua, LUA_REGISTRYINDEX, kc->stats_ref);
+    kc->stats_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+    kc->stats_ref_cnt = kc->stats_cnt;
+    lua_pop(lua, 1); // cjson
+  }
+  lua_rawgeti(lua, LUA_REGISTRYINDEX, kc->stats_ref);
+  lua_pushnumber(lua, (lua_Number)kc->stats_cnt);
+  lua_pushlstring(lua, kc->stats, kc->stats_len);
+  return 3;
+}
+
+
+static delivery_report* get_report(delivery_window *w, size_t i)
+{
+  return &w->reports[(w->head + i) % w->size];
+}
+
+
+static bool add_report(delivery_window *w, uintptr_t sequence_id,
+                       bool delivered)
+{
+  if (w->cnt == w->size) {
+    size_t size = w->size ? w->size * 2 : 1024;
+    delivery_report *reports = malloc(sizeof(delivery_report) * size);
+    if (!reports) return false;
+    for (size_t i = 0; i < w->cnt; ++i) {
+      reports[i] = *get_report(w, i);
+    }
+    free(w->reports);
+    w->reports = reports;
+    w->size = size;
+    w->head = 0;
+  }
+  delivery_report *r = get_report(w, w->cnt++);
+  r->sequence_id = sequence_id;
+  r->delivered = delivered;
+  return true;
+}
+
+
+static void complete_report(delivery_window *w, uintptr_t sequence_id)
+{
+  // sequence ids are normally sent in increasing order
+  size_t lo = 0, hi = w->cnt;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (get_report(w, mid)->sequence_id < sequence_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (size_t i = lo; i < w->cnt; ++i) {
+    delivery_report *r = get_report(w, i);
+    if (r->sequence_id != sequence_id) break;
+    if (!r->delivered) {
+      r->delivered = true;
+      return;
+    }
+  }
+  for (size_t i = 0; i < w->cnt; ++i) { // out of order ids, fallback to a scan
+    delivery_report *r = get_report(w, i);
+    if (r->sequence_id == sequence_id && !r->delivered) {
+      r->delivered = true;
+      return;
+    }
+  }
+}
+
+
+static void advance_watermark(kafka_producer *kp)
+{
+  delivery_window *w = &kp->window;
+  while (w->cnt > 0) {
+    delivery_report *r = get_report(w, 0);
+    if (!r->delivered) break;
+    kp->watermark = r->sequence_id;
+    ++kp->advanced;
+    w->head = (w->head + 1) % w->size;
+    --w->cnt;
+  }
+}
+
+
+static msg_buffer* acquire_buffer(buffer_pool *bp, size_t len)
+{
+  int bucket = 0;
+  size_t size = BUFFER_MIN_SIZE;
+  while (size < len) {
+    if (++bucket == BUFFER_BUCKETS) return NULL;
+    size <<= 1;
+  }
+
+  msg_buffer *b = bp->free[bucket];
+  if (b) {
+    bp->free[bucket] = b->next;
+    bp->pooled -= b->size;
+    ++bp->reuses;
+  } else {
+    b = malloc(sizeof(msg_buffer) + size);
+    if (!b) return NULL;
+    b->size = size;
+    b->bucket = bucket;
+    ++bp->allocations;
+  }
+  b->prev = NULL;
+  b->next = bp->in_use;
+  if (bp->in_use) bp->in_use->prev = b;
+  bp->in_use = b;
+  bp->outstanding += b->size;
+  return b;
+}
+
+
+static void release_buffer(buffer_pool *bp, msg_buffer *b)
+{
+  if (b->prev) {
+    b->prev->next = b->next;
+  } else {
+    bp->in_use = b->next;
+  }
+  if (b->next) b->next->prev = b->prev;
+  bp->outstanding -= b->size;
+
+  if (bp->pooled + b->size <= bp->max_pooled) {
+    b->next = bp->free[b->bucket];
+    bp->free[b->bucket] = b;
+    bp->pooled += b->size;
+  } else {
+    free(b);
+  }
+}
+
+
+static void destroy_pool(buffer_pool *bp)
+{
+  msg_buffer *b;
+  for (int i = 0; i < BUFFER_BUCKETS; ++i) {
+    while ((b = bp->free[i])) {
+      bp->free[i] = b->next;
+      free(b);
+    }
+  }
+  while ((b = bp->in_use)) {
+    bp->in_use = b->next;
+    free(b);
+  }
+}
+
+
 static void msg_delivered(rd_kafka_t *rk,
                           void *payload,
                           size_t len,
@@ -85,10 +375,14 @@ static void msg_delivered(rd_kafka_t *rk,
                           void *msg_opaque)
 {
   (void)rk;
-  (void)payload;
   (void)len;
   kafka_producer *kp = (kafka_producer *)opaque;
-  kp->msg_opaque = msg_opaque;
+  if (kp->pool.max_pooled && payload) {
+    release_buffer(&kp->pool,
+                   (msg_buffer *)((char *)payload - offsetof(msg_buffer, data)));
+  }
+  complete_report(&kp->window, (uintptr_t)msg_opaque);
+  advance_watermark(kp);
   if (error_code) ++kp->failures;
 }
 
@@ -259,27 +553,141 @@ bool load_topic_conf(lua_State *lua, rd_kafka_topic_conf_t *conf, int idx)
 }
 
 
+#ifdef LUA_SANDBOX
+static bool parse_message_key(lua_State *lua, kafka_producer *kp, int idx)
+{
+  size_t len;
+  const char *s = lua_tolstring(lua, idx, &len);
+  if (!s) {
+    lua_pushstring(lua, "message_key must be a string");
+    return false;
+  }
+
+  if (len > 8 && memcmp(s, LSB_FIELDS "[", 7) == 0 && s[len - 1] == ']') {
+    kp->key_field = malloc(len - 7);
+    if (!kp->key_field) {
+      lua_pushstring(lua, "memory allocation failed");
+      return false;
+    }
+    memcpy(kp->key_field, s + 7, len - 8);
+    kp->key_field[len - 8] = 0;
+    kp->key_source = KEY_FIELD;
+  } else if (strcmp(s, LSB_UUID) == 0) {
+    kp->key_source = KEY_UUID;
+  } else if (strcmp(s, LSB_TIMESTAMP) == 0) {
+    kp->key_source = KEY_TIMESTAMP;
+  } else if (strcmp(s, LSB_TYPE) == 0) {
+    kp->key_source = KEY_TYPE;
+  } else if (strcmp(s, LSB_LOGGER) == 0) {
+    kp->key_source = KEY_LOGGER;
+  } else if (strcmp(s, LSB_SEVERITY) == 0) {
+    kp->key_source = KEY_SEVERITY;
+  } else if (strcmp(s, LSB_PAYLOAD) == 0) {
+    kp->key_source = KEY_PAYLOAD;
+  } else if (strcmp(s, LSB_ENV_VERSION) == 0) {
+    kp->key_source = KEY_ENV_VERSION;
+  } else if (strcmp(s, LSB_PID) == 0) {
+    kp->key_source = KEY_PID;
+  } else if (strcmp(s, LSB_HOSTNAME) == 0) {
+    kp->key_source = KEY_HOSTNAME;
+  } else {
+    lua_pushfstring(lua, "invalid message_key: %s", s);
+    return false;
+  }
+  return true;
+}
+#endif
+
+
+static bool load_options(lua_State *lua, kafka_producer *kp, int idx)
+{
+  if (lua_isnil(lua, idx)) {
+    return true;
+  }
+
+  lua_pushnil(lua);
+  while (lua_next(lua, idx) != 0) {
+    const char *key = NULL;
+    if (lua_type(lua, -2) == LUA_TSTRING) {
+      key = lua_tostring(lua, -2);
+    }
+    if (key && strcmp(key, "buffer_pool_size") == 0) {
+      if (lua_type(lua, -1) != LUA_TNUMBER || lua_tonumber(lua, -1) < 0) {
+        lua_pushfstring(lua, "%s must be a number >= 0", key);
+        return false;
+      }
+      kp->pool.max_pooled = (size_t)lua_tonumber(lua, -1);
+    } else if (key && (strcmp(key, "checkpoint_step") == 0
+                || strcmp(key, "checkpoint_interval") == 0)) {
+      if (lua_type(lua, -1) != LUA_TNUMBER || lua_tonumber(lua, -1) < 0) {
+        lua_pushfstring(lua, "%s must be a number >= 0", key);
+        return false;
+      }
+      if (strcmp(key, "checkpoint_step") == 0) {
+        kp->checkpoint_step = (size_t)lua_tonumber(lua, -1);
+      } else {
+        kp->checkpoint_interval = (time_t)lua_tonumber(lua, -1);
+      }
+    } else if (key && strcmp(key, "message_key") == 0) {
+#ifdef LUA_SANDBOX
+      if (!kp->hsb) {
+        lua_pushstring(lua, "message_key requires a Heka sandbox");
+        return false;
+      }
+      if (!parse_message_key(lua, kp, lua_gettop(lua))) {
+        return false;
+      }
+#else
+      (void)kp;
+      lua_pushstring(lua, "message_key requires a Heka sandbox");
+      return false;
+#endif
+    } else {
+      lua_pushfstring(lua, "invalid producer option: %s",
+                      key ? key : lua_typename(lua, lua_type(lua, -2)));
+      return false;
+    }
+    lua_pop(lua, 1);
+  }
+  return true;
+}
+
+
 static int producer_new(lua_State *lua)
 {
   int n = lua_gettop(lua);
-  luaL_argcheck(lua, n >= 1 && n <= 2, n, "incorrect number of arguments");
+  luaL_argcheck(lua, n >= 1 && n <= 3, n, "incorrect number of arguments");
 
   const char *brokerlist = luaL_checkstring(lua, 1);
-  int t = lua_type(lua, 2);
-  switch (t) {
-  case LUA_TNONE:
-    lua_pushnil(lua);
-    break;
-  case LUA_TNIL:
-    break;
-  default:
-    luaL_checktype(lua, 2, LUA_TTABLE); // producer config
+  for (int i = 2; i <= 3; ++i) {
+    int t = lua_type(lua, i);
+    switch (t) {
+    case LUA_TNONE:
+      lua_pushnil(lua);
+      break;
+    case LUA_TNIL:
+      break;
+    default:
+      luaL_checktype(lua, i, LUA_TTABLE); // producer config, options
+    }
   }
 
   kafka_producer *kp = lua_newuserdata(lua, sizeof(kafka_producer));
-  kp->rk          = NULL;
-  kp->msg_opaque  = NULL;
+  init_client(&kp->client);
+  memset(&kp->pool, 0, sizeof(buffer_pool));
+  kp->pool.max_pooled = 8 * 1024 * 1024;
+  memset(&kp->window, 0, sizeof(delivery_window));
+  kp->watermark   = 0;
+  kp->advanced    = 0;
+  kp->checkpoint_step     = 0;
+  kp->checkpoint_interval = 0;
+  kp->checkpoint_time     = time(NULL);
   kp->failures    = 0;
+#ifdef LUA_SANDBOX
+  kp->hsb         = NULL;
+  kp->key_source  = KEY_NONE;
+  kp->key_field   = NULL;
+#endif
   lua_pushlightuserdata(lua, kp); // setup a topic table for this producer
   lua_newtable(lua);
   lua_rawset(lua, LUA_ENVIRONINDEX);
@@ -293,6 +701,7 @@ static int producer_new(lua_State *lua)
   }
   rd_kafka_conf_set_opaque(conf, kp);
   rd_kafka_conf_set_dr_cb(conf, msg_delivered);
+  rd_kafka_conf_set_stats_cb(conf, stats_cb);
 
 #ifdef LUA_SANDBOX
   lua_getfield(lua, LUA_REGISTRYINDEX, LSB_THIS_PTR);
@@ -301,24 +710,32 @@ static int producer_new(lua_State *lua)
   if (!lsb) {
     return luaL_error(lua, "invalid " LSB_THIS_PTR);
   }
-  kp->logger = lsb_get_logger(lsb);
-  if (kp->logger->cb) {
+  kp->client.logger = lsb_get_logger(lsb);
+  if (kp->client.logger->cb) {
     rd_kafka_conf_set_log_cb(conf, log_cb);
   } else {
     rd_kafka_conf_set_log_cb(conf, NULL); // disable logging
   }
+  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_HEKA_THIS_PTR);
+  kp->hsb = lua_touserdata(lua, -1);
+  lua_pop(lua, 1); // remove this ptr
 #else
   rd_kafka_conf_set_log_cb(conf, NULL); // disable logging
 #endif
 
+  if (!load_options(lua, kp, 3)) {
+    rd_kafka_conf_destroy(conf);
+    return lua_error(lua);
+  }
+
   char errstr[512];
-  kp->rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof errstr);
-  if (!kp->rk) {
+  kp->client.rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof errstr);
+  if (!kp->client.rk) {
     rd_kafka_conf_destroy(conf); // the producer has not taken ownership
     return luaL_error(lua, "rd_kafka_new failed: %s", errstr);
   }
 
-  if (rd_kafka_brokers_add(kp->rk, brokerlist) == 0) {
+  if (rd_kafka_brokers_add(kp->client.rk, brokerlist) == 0) {
     return luaL_error(lua, "invalid broker list");
   }
   return 1;
@@ -368,6 +785,18 @@ static int producer_create_topic(lua_State *lua)
   }
 
   rd_kafka_topic_conf_t *tconf = rd_kafka_topic_conf_new();
+  bool partitioner = false;
+  if (lua_type(lua, 3) == LUA_TTABLE) {
+    lua_getfield(lua, 3, "partitioner");
+    partitioner = !lua_isnil(lua, -1);
+    lua_pop(lua, 1);
+  }
+  // keyed messages are hashed; an explicit callback would take precedence
+  // over the 'partitioner' property so it is only set when that is absent
+  if (tconf && !partitioner) {
+    rd_kafka_topic_conf_set_partitioner_cb(
+        tconf, rd_kafka_msg_partitioner_consistent_random);
+  }
   if (!load_topic_conf(lua, tconf, 3)) {
     rd_kafka_topic_conf_destroy(tconf);
     free(kt);
@@ -375,7 +804,7 @@ static int producer_create_topic(lua_State *lua)
   }
 
   char errstr[512];
-  kt->rkt = rd_kafka_topic_new(kp->rk, topic, tconf);
+  kt->rkt = rd_kafka_topic_new(kp->client.rk, topic, tconf);
   if (!kt->rkt) {
     rd_kafka_topic_conf_destroy(tconf);
     free(kt);
@@ -427,31 +856,120 @@ static int producer_destroy_topic(lua_State *lua)
 #ifdef LUA_SANDBOX
 static int producer_poll_heka(lua_State *lua)
 {
-  kafka_producer *kp = check_producer(lua, 1, 1);
-  kp->failures = 0;
-  kp->msg_opaque = NULL;
-  rd_kafka_poll(kp->rk, 0);
-  if (kp->msg_opaque) {
-    lua_getfield(lua, LUA_GLOBALSINDEX, LSB_HEKA_UPDATE_CHECKPOINT);
-    if (lua_type(lua, -1) == LUA_TFUNCTION) {
-      lua_pushlightuserdata(lua, kp->msg_opaque);
-      lua_pushinteger(lua, kp->failures);
-      if (lua_pcall(lua, 2, 0, 0)) {
-        lua_error(lua);
-      }
-    } else {
-      luaL_error(lua, LSB_HEKA_UPDATE_CHECKPOINT " was not found");
+  kafka_producer *kp = check_producer(lua, 1, 2);
+  bool flush = lua_toboolean(lua, 2);
+  rd_kafka_poll(kp->client.rk, 0);
+  if (kp->advanced == 0) {
+    return 0;
+  }
+
+  time_t t = time(NULL);
+  bool step = kp->checkpoint_step && kp->advanced >= kp->checkpoint_step;
+  bool interval = kp->checkpoint_interval
+      && t - kp->checkpoint_time >= kp->checkpoint_interval;
+  bool always = !kp->checkpoint_step && !kp->checkpoint_interval;
+  if (!flush && !step && !interval && !always) {
+    return 0;
+  }
+
+  lua_getfield(lua, LUA_GLOBALSINDEX, LSB_HEKA_UPDATE_CHECKPOINT);
+  if (lua_type(lua, -1) == LUA_TFUNCTION) {
+    lua_pushlightuserdata(lua, (void *)kp->watermark);
+    lua_pushinteger(lua, kp->failures);
+    kp->advanced = 0;
+    kp->failures = 0;
+    kp->checkpoint_time = t;
+    if (lua_pcall(lua, 2, 0, 0)) {
+      lua_error(lua);
     }
-    lua_pop(lua, 1);
+  } else {
+    luaL_error(lua, LSB_HEKA_UPDATE_CHECKPOINT " was not found");
   }
+  lua_pop(lua, 1);
   return 0;
 }
 
 
+static lsb_const_string get_message_key(kafka_producer *kp, char *buf,
+                                        size_t len)
+{
+  lsb_const_string key = { NULL, 0 };
+  const lsb_heka_message *m = lsb_heka_get_message(kp->hsb);
+  if (!m || !m->raw.s) {
+    return key;
+  }
+
+  const lsb_const_string *cs = NULL;
+  switch (kp->key_source) {
+  case KEY_NONE:
+    break;
+  case KEY_UUID:
+    cs = &m->uuid;
+    break;
+  case KEY_TIMESTAMP:
+    key.len = (size_t)snprintf(buf, len, "%lld", (long long)m->timestamp);
+    key.s = buf;
+    break;
+  case KEY_TYPE:
+    cs = &m->type;
+    break;
+  case KEY_LOGGER:
+    cs = &m->logger;
+    break;
+  case KEY_SEVERITY:
+    key.len = (size_t)snprintf(buf, len, "%d", m->severity);
+    key.s = buf;
+    break;
+  case KEY_PAYLOAD:
+    cs = &m->payload;
+    break;
+  case KEY_ENV_VERSION:
+    cs = &m->env_version;
+    break;
+  case KEY_PID:
+    key.len = (size_t)snprintf(buf, len, "%d", m->pid);
+    key.s = buf;
+    break;
+  case KEY_HOSTNAME:
+    cs = &m->hostname;
+    break;
+  case KEY_FIELD:
+    {
+      lsb_const_string name = { kp->key_field, strlen(kp->key_field) };
+      lsb_read_value v;
+      lsb_read_heka_field(m, &name, 0, 0, &v);
+      switch (v.type) {
+      case LSB_READ_STRING:
+        key = v.u.s;
+        break;
+      case LSB_READ_NUMERIC: // matches Lua's number to string conversion
+        key.len = (size_t)snprintf(buf, len, "%.14g", v.u.d);
+        key.s = buf;
+        break;
+      case LSB_READ_BOOL:
+        key.s = v.u.d ? "true" : "false";
+        key.len = strlen(key.s);
+        break;
+      default:
+        break;
+      }
+    }
+    break;
+  }
+  if (cs) {
+    key = *cs;
+  }
+  if (!key.s) {
+    key.len = 0;
+  }
+  return key;
+}
+
+
 static int producer_send_heka(lua_State *lua)
 {
-  static const int msg_idx = 5;
-  kafka_producer *kp = check_producer(lua, msg_idx, msg_idx);
+  int msg_idx = 5;
+  kafka_producer *kp = check_producer(lua, msg_idx, msg_idx + 1);
 
   const char *topic = luaL_checkstring(lua, 2);
   kafka_topic *kt = get_topic(lua, kp, topic);
@@ -461,9 +979,25 @@ static int producer_send_heka(lua_State *lua)
   luaL_checktype(lua, 4, LUA_TLIGHTUSERDATA);
   void *sequence_id = lua_touserdata(lua, 4);
 
+  char numeric_key[32];
+  lsb_const_string key = { NULL, 0 };
+  if (lua_gettop(lua) > msg_idx) {
+    if (!lua_isnil(lua, msg_idx + 1)) {
+      key.s = luaL_checklstring(lua, msg_idx + 1, &key.len);
+    }
+    // the zero copy results are pushed after the message
+    lua_pushvalue(lua, msg_idx);
+    lua_remove(lua, msg_idx);
+    ++msg_idx;
+  }
+  if (!key.s && kp->key_source != KEY_NONE) {
+    key = get_message_key(kp, numeric_key, sizeof numeric_key);
+  }
+
   int msgflags = RD_KAFKA_MSG_F_COPY;
   size_t len = 0;
   const char *msg = NULL;
+  msg_buffer *buf = NULL;
 
   switch (lua_type(lua, msg_idx)) {
   case LUA_TSTRING:
@@ -498,13 +1032,24 @@ static int producer_send_heka(lua_State *lua)
       }
 
       if (segments == 0 || total_len == 0) {
+        if (!add_report(&kp->window, (uintptr_t)sequence_id, true)) {
+          return luaL_error(lua, "memory allocation failed");
+        }
+        advance_watermark(kp);
         lua_pushinteger(lua, 0);
         return 1;
       }
 
-      if (segments > 1) {
-        char *buf = malloc(total_len);
-        if (!buf) {
+      if (segments > 1 || kp->pool.max_pooled) {
+        char *dst;
+        if (kp->pool.max_pooled) {
+          buf = acquire_buffer(&kp->pool, total_len);
+          dst = buf ? buf->data : NULL;
+        } else {
+          dst = malloc(total_len);
+          msgflags = RD_KAFKA_MSG_F_FREE; // give ownership to kafka
+        }
+        if (!dst) {
           return luaL_error(lua, "malloc failed");
         }
 
@@ -520,13 +1065,12 @@ static int producer_send_heka(lua_State *lua)
             break;
           }
           if (msg && len > 0) {
-            memcpy(buf + pos, msg, len);
+            memcpy(dst + pos, msg, len);
             pos += len;
           }
         }
-        msg = buf;
+        msg = dst;
         len = total_len;
-        msgflags = RD_KAFKA_MSG_F_FREE; // give ownership to kafka
       }
     }
     break;
@@ -536,16 +1080,32 @@ static int producer_send_heka(lua_State *lua)
     break;
   }
 
+  if (kp->pool.max_pooled && !buf) {
+    buf = acquire_buffer(&kp->pool, len);
+    if (!buf) {
+      return luaL_error(lua, "malloc failed");
+    }
+    memcpy(buf->data, msg, len);
+    msg = buf->data;
+  }
+  if (buf) {
+    msgflags = 0; // the buffer is released by the delivery report
+  }
+
   errno = 0;
   int ret = rd_kafka_produce(kt->rkt, partition,
                              msgflags,
                              (void *)msg, len,
-                             NULL, 0, // optional key/len
+                             key.s, key.len,
                              sequence_id // opaque pointer
                             );
   if (ret == -1) {
+    if (buf) release_buffer(&kp->pool, buf);
     lua_pushinteger(lua, errno);
   } else {
+    if (!add_report(&kp->window, (uintptr_t)sequence_id, false)) {
+      return luaL_error(lua, "memory allocation failed");
+    }
     lua_pushinteger(lua, 0);
   }
   return 1;
@@ -557,23 +1117,22 @@ static int producer_poll(lua_State *lua)
 {
   kafka_producer *kp = check_producer(lua, 1, 2);
   int timeout = luaL_optint(lua, 2, 0);
-  kp->failures = 0;
-  kp->msg_opaque = NULL;
-  rd_kafka_poll(kp->rk, timeout);
-  if (kp->msg_opaque) {
-    uintptr_t sequence_id = (uintptr_t)kp->msg_opaque;
-    lua_pushnumber(lua, (lua_Number)sequence_id);
+  rd_kafka_poll(kp->client.rk, timeout);
+  if (kp->advanced) {
+    lua_pushnumber(lua, (lua_Number)kp->watermark);
   } else {
     lua_pushnil(lua);
   }
   lua_pushinteger(lua, kp->failures);
+  kp->advanced = 0;
+  kp->failures = 0;
   return 2;
 }
 
 
 static int producer_send(lua_State *lua)
 {
-  kafka_producer *kp = check_producer(lua, 5, 5);
+  kafka_producer *kp = check_producer(lua, 5, 6);
 
   const char *topic = luaL_checkstring(lua, 2);
   kafka_topic *kt = get_topic(lua, kp, topic);
@@ -590,23 +1149,66 @@ static int producer_send(lua_State *lua)
   size_t len = 0;
   const char *msg = luaL_checklstring(lua, 5, &len);
 
+  size_t key_len = 0;
+  const char *key = luaL_optlstring(lua, 6, NULL, &key_len);
+
+  int msgflags = RD_KAFKA_MSG_F_COPY;
+  msg_buffer *buf = NULL;
+  if (kp->pool.max_pooled) {
+    buf = acquire_buffer(&kp->pool, len);
+    if (!buf) {
+      return luaL_error(lua, "malloc failed");
+    }
+    memcpy(buf->data, msg, len);
+    msg = buf->data;
+    msgflags = 0; // the buffer is released by the delivery report
+  }
 
   errno = 0;
   int ret = rd_kafka_produce(kt->rkt, partition,
-                             RD_KAFKA_MSG_F_COPY,
+                             msgflags,
                              (void *)msg, len,
-                             NULL, 0, // optional key/len
+                             key, key_len,
                              (void *)sequence_id // opaque pointer
                             );
   if (ret == -1) {
+    if (buf) release_buffer(&kp->pool, buf);
     lua_pushinteger(lua, errno);
   } else {
+    if (!add_report(&kp->window, sequence_id, false)) {
+      return luaL_error(lua, "memory allocation failed");
+    }
     lua_pushinteger(lua, 0);
   }
   return 1;
 }
 
 
+static int producer_buffer_stats(lua_State *lua)
+{
+  kafka_producer *kp = check_producer(lua, 1, 1);
+  lua_createtable(lua, 0, 5);
+  lua_pushnumber(lua, (lua_Number)kp->pool.max_pooled);
+  lua_setfield(lua, -2, "max_pooled");
+  lua_pushnumber(lua, (lua_Number)kp->pool.pooled);
+  lua_setfield(lua, -2, "pooled");
+  lua_pushnumber(lua, (lua_Number)kp->pool.outstanding);
+  lua_setfield(lua, -2, "outstanding");
+  lua_pushnumber(lua, (lua_Number)kp->pool.allocations);
+  lua_setfield(lua, -2, "allocations");
+  lua_pushnumber(lua, (lua_Number)kp->pool.reuses);
+  lua_setfield(lua, -2, "reuses");
+  return 1;
+}
+
+
+static int producer_stats(lua_State *lua)
+{
+  kafka_producer *kp = check_producer(lua, 1, 1);
+  return push_stats(lua, &kp->client);
+}
+
+
 static int producer_gc(lua_State *lua)
 {
   kafka_producer *kp = check_producer(lua, 1, 1);
@@ -622,7 +1224,14 @@ static int producer_gc(lua_State *lua)
     }
     lua_pop(lua, 1);
   }
-  if (kp->rk) rd_kafka_destroy(kp->rk);
+  if (kp->client.rk) rd_kafka_destroy(kp->client.rk);
+  destroy_pool(&kp->pool); // includes any undelivered messages
+  free(kp->client.stats);
+  luaL_unref(lua, LUA_REGISTRYINDEX, kp->client.stats_ref);
+  free(kp->window.reports);
+#ifdef LUA_SANDBOX
+  free(kp->key_field);
+#endif
 
   lua_pushlightuserdata(lua, kp);
   lua_pushnil(lua);
@@ -634,20 +1243,222 @@ static int producer_gc(lua_State *lua)
 }
 
 
-static kafka_consumer* check_consumer(lua_State *lua, int args)
+static kafka_consumer* check_consumer(lua_State *lua,
+                                      int min_args,
+                                      int max_args)
 {
   kafka_consumer *kc = luaL_checkudata(lua, 1, mozsvc_kafka_consumer);
   int n = lua_gettop(lua);
-  luaL_argcheck(lua, args == n, n, "incorrect number of arguments");
+  luaL_argcheck(lua, n >= min_args && n <= max_args, n,
+                "incorrect number of arguments");
   return kc;
 }
 
 
+static rd_kafka_message_t* next_batch_message(kafka_consumer *kc)
+{
+  if (kc->batch_pos < kc->batch_cnt) {
+    return kc->batch[kc->batch_pos++];
+  }
+  return NULL;
+}
+
+
+static void release_batch(kafka_consumer *kc)
+{
+  rd_kafka_message_t *rkmessage;
+  while ((rkmessage = next_batch_message(kc))) {
+    rd_kafka_message_destroy(rkmessage);
+  }
+  kc->batch_cnt = 0;
+  kc->batch_pos = 0;
+}
+
+
+static bool is_fatal_error(lua_State *lua, rd_kafka_message_t *rkmessage)
+{
+  if (rkmessage->err != RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION &&
+      rkmessage->err != RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC) {
+    return false;
+  }
+
+  if (rkmessage->rkt) {
+    lua_pushfstring(lua, "topic: %s partition: %d offset: %g err: %s",
+                    rd_kafka_topic_name(rkmessage->rkt),
+                    (int)rkmessage->partition,
+                    (double)rkmessage->offset,
+                    rd_kafka_message_errstr(rkmessage));
+  } else {
+    lua_pushfstring(lua, "%s err: %s", rd_kafka_err2str(rkmessage->err),
+                    rd_kafka_message_errstr(rkmessage));
+  }
+  return true;
+}
+
+
+static ssize_t consume_partition_queues(kafka_consumer *kc, int timeout,
+                                        size_t max_msgs)
+{
+  // the consumer queue is always served, it carries the errors/statistics and
+  // anything fetched before the partition queues were split off
+  ssize_t cnt = rd_kafka_consume_batch_queue(kc->queue, 0, kc->batch,
+                                             max_msgs);
+  if (cnt != 0) return cnt;
+
+  // round robin over the partitions; first a non blocking pass, then the
+  // timeout is shared between the queues
+  int wait = timeout / kc->pqueues_cnt;
+  if (timeout > 0 && wait == 0) wait = 1;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < kc->pqueues_cnt; ++i) {
+      rd_kafka_queue_t *q = kc->pqueues[kc->pqueues_pos];
+      kc->pqueues_pos = (kc->pqueues_pos + 1) % kc->pqueues_cnt;
+      cnt = rd_kafka_consume_batch_queue(q, pass ? wait : 0, kc->batch,
+                                         max_msgs);
+      if (cnt != 0) return cnt;
+    }
+    if (wait == 0) break;
+  }
+  return 0;
+}
+
+
+static bool fill_batch(lua_State *lua, kafka_consumer *kc, size_t max_msgs,
+                       int timeout)
+{
+  if (max_msgs > kc->batch_size) {
+    rd_kafka_message_t **batch = realloc(kc->batch, sizeof(rd_kafka_message_t *)
+                                         * max_msgs);
+    if (!batch) {
+      lua_pushstring(lua, "memory allocation failed");
+      return false;
+    }
+    kc->batch = batch;
+    kc->batch_size = max_msgs;
+  }
+  kc->batch_cnt = 0;
+  kc->batch_pos = 0;
+
+  ssize_t cnt;
+  if (kc->pqueues_cnt) {
+    cnt = consume_partition_queues(kc, timeout, max_msgs);
+  } else {
+    cnt = rd_kafka_consume_batch_queue(kc->queue, timeout, kc->batch, max_msgs);
+  }
+  if (cnt < 0) {
+    lua_pushfstring(lua, "rd_kafka_consume_batch_queue failed: %s",
+                    rd_kafka_err2str(rd_kafka_last_error()));
+    return false;
+  }
+
+  bool err = false;
+  for (ssize_t i = 0; i < cnt; ++i) { // drop the consumer events
+    rd_kafka_message_t *rkmessage = kc->batch[i];
+    if (rkmessage->err) {
+      if (!err) err = is_fatal_error(lua, rkmessage);
+      rd_kafka_message_destroy(rkmessage);
+    } else {
+      kc->batch[kc->batch_cnt++] = rkmessage;
+    }
+  }
+  return !err;
+}
+
+
+static void push_message_source(lua_State *lua, rd_kafka_message_t *rkmessage)
+{
+  lua_pushstring(lua, rd_kafka_topic_name(rkmessage->rkt));
+  lua_pushinteger(lua, (lua_Integer)rkmessage->partition);
+  if (rkmessage->key_len) {
+    lua_pushlstring(lua, rkmessage->key, rkmessage->key_len);
+  } else {
+    lua_pushnil(lua);
+  }
+}
+
+
+static bool parse_offset(const char *s, int64_t *offset)
+{
+  if (strcmp(s, "beginning") == 0) {
+    *offset = RD_KAFKA_OFFSET_BEGINNING;
+  } else if (strcmp(s, "end") == 0) {
+    *offset = RD_KAFKA_OFFSET_END;
+  } else if (strcmp(s, "stored") == 0) {
+    *offset = RD_KAFKA_OFFSET_STORED;
+  } else {
+    char *end;
+    errno = 0;
+    long long o = strtoll(s, &end, 10);
+    if (end == s || *end || errno || o < 0) {
+      return false;
+    }
+    *offset = (int64_t)o;
+  }
+  return true;
+}
+
+
+static bool load_consumer_options(lua_State *lua, bool *partition_queues,
+                                  int idx)
+{
+  *partition_queues = false;
+  int t = lua_type(lua, idx);
+  if (t == LUA_TNONE || t == LUA_TNIL) return true;
+  if (t != LUA_TTABLE) {
+    lua_pushstring(lua, "options must be a table");
+    return false;
+  }
+
+  lua_pushnil(lua);
+  while (lua_next(lua, idx) != 0) {
+    const char *key = lua_type(lua, -2) == LUA_TSTRING ?
+        lua_tostring(lua, -2) : "";
+    if (strcmp(key, "partition_queues") == 0) {
+      if (lua_type(lua, -1) != LUA_TBOOLEAN) {
+        lua_pushstring(lua, "partition_queues must be a boolean");
+        return false;
+      }
+      *partition_queues = lua_toboolean(lua, -1);
+    } else {
+      lua_pushfstring(lua, "invalid consumer option: %s", key);
+      return false;
+    }
+    lua_pop(lua, 1);
+  }
+  return true;
+}
+
+
+static bool create_partition_queues(lua_State *lua, kafka_consumer *kc)
+{
+  kc->pqueues = calloc((size_t)kc->topics->cnt, sizeof(rd_kafka_queue_t *));
+  if (!kc->pqueues) {
+    lua_pushstring(lua, "memory allocation failed");
+    return false;
+  }
+
+  for (int i = 0; i < kc->topics->cnt; ++i) {
+    rd_kafka_topic_partition_t *tp = &kc->topics->elems[i];
+    rd_kafka_queue_t *q = rd_kafka_queue_get_partition(kc->client.rk, tp->topic,
+                                                       tp->partition);
+    if (!q) {
+      lua_pushfstring(lua, "rd_kafka_queue_get_partition failed: %s:%d",
+                      tp->topic, (int)tp->partition);
+      return false;
+    }
+    rd_kafka_queue_forward(q, NULL); // stop forwarding to the consumer queue
+    kc->pqueues[kc->pqueues_cnt++] = q;
+  }
+  return true;
+}
+
+
 static bool add_consumer_topics(lua_State *lua,
                                 kafka_consumer *kc,
-                                int cnt)
+                                int cnt,
+                                bool partition_queues)
 {
-  bool is_subscription = true;
+  int subscriptions = 0;
 
   kc->topics = rd_kafka_topic_partition_list_new(cnt);
   if (!kc->topics) {
@@ -667,12 +1478,13 @@ static bool add_consumer_topics(lua_State *lua,
     char *t;
     long partition = -1;
 
-    if ((t = strstr(topic, ":"))) { // Parse "topic[:partition]
+    if ((t = strstr(topic, ":"))) { // Parse "topic[:partition[@offset]]
       char s[strlen(topic)];
       memcpy(s, topic, t - topic);
       s[t - topic] = 0;
 
-      partition = strtol(t + 1, NULL, 10);
+      char *end;
+      partition = strtol(t + 1, &end, 10);
       if (partition > INT32_MAX) {
         lua_pushstring(lua, "invalid topic partition > INT32_MAX");
         return false;
@@ -680,27 +1492,52 @@ static bool add_consumer_topics(lua_State *lua,
         lua_pushstring(lua, "invalid topic partition < 0");
         return false;
       }
-      is_subscription = false;
-      rd_kafka_topic_partition_list_add(kc->topics, s, (int32_t)partition);
+      int64_t offset = RD_KAFKA_OFFSET_INVALID; // use the committed offset
+      if (*end == '@') {
+        if (!parse_offset(end + 1, &offset)) {
+          lua_pushfstring(lua, "invalid topic offset: %s", end + 1);
+          return false;
+        }
+      } else if (end == t + 1 || *end) {
+        lua_pushfstring(lua, "invalid topic partition: %s", t + 1);
+        return false;
+      }
+      rd_kafka_topic_partition_list_add(kc->topics, s,
+                                        (int32_t)partition)->offset = offset;
     } else {
+      ++subscriptions;
       rd_kafka_topic_partition_list_add(kc->topics, topic, (int32_t)partition);
     }
     lua_pop(lua, 1);
   }
 
+  if (subscriptions && subscriptions != kc->topics->cnt) {
+    lua_pushstring(lua, "topics cannot mix subscriptions and partition "
+                   "assignments");
+    return false;
+  }
+
   rd_kafka_resp_err_t err;
-  if (is_subscription) {
-    if ((err = rd_kafka_subscribe(kc->rk, kc->topics))) {
+  if (subscriptions) {
+    if (partition_queues) {
+      lua_pushstring(lua, "partition_queues requires a manual partition "
+                     "assignment");
+      return false;
+    }
+    if ((err = rd_kafka_subscribe(kc->client.rk, kc->topics))) {
       lua_pushfstring(lua, "rd_kafka_subscribe failed: %s",
                       rd_kafka_err2str(err));
       return false;
     }
 
   } else {
-    if ((err = rd_kafka_assign(kc->rk, kc->topics))) {
+    if ((err = rd_kafka_assign(kc->client.rk, kc->topics))) {
       lua_pushfstring(lua, "rd_kafka_assign failed: %s", rd_kafka_err2str(err));
       return false;
     }
+    if (partition_queues && !create_partition_queues(lua, kc)) {
+      return false;
+    }
   }
   return true;
 }
@@ -710,7 +1547,7 @@ static int consumer_new(lua_State *lua)
 {
   static const char *group_id = "group.id";
   int n = lua_gettop(lua);
-  luaL_argcheck(lua, n >= 3 && n <= 4, n, "incorrect number of arguments");
+  luaL_argcheck(lua, n >= 3 && n <= 5, n, "incorrect number of arguments");
 
   const char *brokerlist = luaL_checkstring(lua, 1);
 
@@ -728,12 +1565,25 @@ static int consumer_new(lua_State *lua)
   case LUA_TNIL:
     break;
   default:
-    luaL_checktype(lua, 3, LUA_TTABLE);
+    luaL_checktype(lua, 4, LUA_TTABLE);
+  }
+
+  bool partition_queues;
+  if (!load_consumer_options(lua, &partition_queues, 5)) {
+    return lua_error(lua);
   }
 
   kafka_consumer *kc = lua_newuserdata(lua, sizeof(kafka_consumer));
-  kc->rk = NULL;
+  init_client(&kc->client);
   kc->topics = NULL;
+  kc->queue = NULL;
+  kc->pqueues = NULL;
+  kc->pqueues_cnt = 0;
+  kc->pqueues_pos = 0;
+  kc->batch = NULL;
+  kc->batch_size = 0;
+  kc->batch_cnt = 0;
+  kc->batch_pos = 0;
   luaL_getmetatable(lua, mozsvc_kafka_consumer);
   lua_setmetatable(lua, -2);
 
@@ -743,16 +1593,18 @@ static int consumer_new(lua_State *lua)
     return lua_error(lua);
   }
 
-#ifdef LUA_SANDBOX
   rd_kafka_conf_set_opaque(conf, kc);
+  rd_kafka_conf_set_stats_cb(conf, stats_cb);
+
+#ifdef LUA_SANDBOX
   lua_getfield(lua, LUA_REGISTRYINDEX, LSB_THIS_PTR);
   lsb_lua_sandbox *lsb = lua_touserdata(lua, -1);
   lua_pop(lua, 1); // remove this ptr
   if (!lsb) {
     return luaL_error(lua, "invalid " LSB_THIS_PTR);
   }
-  kc->logger = lsb_get_logger(lsb);
-  if (kc->logger->cb) {
+  kc->client.logger = lsb_get_logger(lsb);
+  if (kc->client.logger->cb) {
     rd_kafka_conf_set_log_cb(conf, log_cb);
   } else {
     rd_kafka_conf_set_log_cb(conf, NULL); // disable logging
@@ -784,18 +1636,22 @@ static int consumer_new(lua_State *lua)
   }
   rd_kafka_conf_set_default_topic_conf(conf, tconf);
 
-  kc->rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof errstr);
-  if (!kc->rk) {
+  kc->client.rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof errstr);
+  if (!kc->client.rk) {
     rd_kafka_conf_destroy(conf);
     return luaL_error(lua, "rd_kafka_new failed: %s", errstr);
   }
 
-  if (rd_kafka_brokers_add(kc->rk, brokerlist) == 0) {
+  if (rd_kafka_brokers_add(kc->client.rk, brokerlist) == 0) {
     return luaL_error(lua, "invalid broker list");
   }
 
-  rd_kafka_poll_set_consumer(kc->rk);
-  if (!add_consumer_topics(lua, kc, topic_cnt)) {
+  rd_kafka_poll_set_consumer(kc->client.rk);
+  kc->queue = rd_kafka_queue_get_consumer(kc->client.rk);
+  if (!kc->queue) {
+    return luaL_error(lua, "rd_kafka_queue_get_consumer failed");
+  }
+  if (!add_consumer_topics(lua, kc, topic_cnt, partition_queues)) {
     return lua_error(lua);
   }
   return 1;
@@ -805,25 +1661,21 @@ static int consumer_new(lua_State *lua)
 static int consumer_receive(lua_State *lua)
 {
   bool err = false;
-  kafka_consumer *kc = check_consumer(lua, 1);
-  rd_kafka_message_t *rkmessage = rd_kafka_consumer_poll(kc->rk, 1000);
+  kafka_consumer *kc = check_consumer(lua, 1, 2);
+  int timeout = luaL_optint(lua, 2, 1000);
+  rd_kafka_message_t *rkmessage = next_batch_message(kc);
+  if (!rkmessage && kc->pqueues_cnt) {
+    if (!fill_batch(lua, kc, 1, timeout)) {
+      return lua_error(lua);
+    }
+    rkmessage = next_batch_message(kc);
+  } else if (!rkmessage) {
+    rkmessage = rd_kafka_consumer_poll(kc->client.rk, timeout);
+  }
   if (rkmessage) {
     if (rkmessage->err) {
-      if (rkmessage->err == RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION ||
-          rkmessage->err == RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC) {
-        if (rkmessage->rkt) {
-          err = true;
-          lua_pushfstring(lua, "topic: %s partition: %d offset: %g err: %s",
-                          rd_kafka_topic_name(rkmessage->rkt),
-                          (int)rkmessage->partition,
-                          (double)rkmessage->offset,
-                          rd_kafka_message_errstr(rkmessage));
-        } else {
-          err = true;
-          lua_pushfstring(lua, "%s err: %s", rd_kafka_err2str(rkmessage->err),
-                          rd_kafka_message_errstr(rkmessage));
-        }
-      } else {
+      err = is_fatal_error(lua, rkmessage);
+      if (!err) {
         lua_pushnil(lua);
         lua_pushnil(lua);
         lua_pushnil(lua);
@@ -831,13 +1683,7 @@ static int consumer_receive(lua_State *lua)
       }
     } else {
       lua_pushlstring(lua, rkmessage->payload, rkmessage->len);
-      lua_pushstring(lua, rd_kafka_topic_name(rkmessage->rkt));
-      lua_pushinteger(lua, (lua_Integer)rkmessage->partition);
-      if (rkmessage->key_len) {
-        lua_pushlstring(lua, rkmessage->key, rkmessage->key_len);
-      } else {
-        lua_pushnil(lua);
-      }
+      push_message_source(lua, rkmessage);
     }
     rd_kafka_message_destroy(rkmessage);
   } else {
@@ -851,12 +1697,84 @@ static int consumer_receive(lua_State *lua)
 }
 
 
+static int consumer_receive_batch(lua_State *lua)
+{
+  kafka_consumer *kc = check_consumer(lua, 1, 3);
+  lua_Integer max_msgs = luaL_optinteger(lua, 2, 1000);
+  luaL_argcheck(lua, max_msgs > 0 && (size_t)max_msgs <= max_batch_size, 2,
+                "max_msgs must be 1-100000");
+  int timeout = luaL_optint(lua, 3, 1000);
+
+  if (kc->batch_pos < kc->batch_cnt) { // hand out the remainder first
+    lua_pushinteger(lua, (lua_Integer)(kc->batch_cnt - kc->batch_pos));
+    return 1;
+  }
+
+  if (!fill_batch(lua, kc, (size_t)max_msgs, timeout)) {
+    return lua_error(lua);
+  }
+  lua_pushinteger(lua, (lua_Integer)kc->batch_cnt);
+  return 1;
+}
+
+
+#ifdef LUA_SANDBOX
+static int consumer_decode_into(lua_State *lua)
+{
+  kafka_consumer *kc = check_consumer(lua, 2, 2);
+  heka_stream_reader *hsr = luaL_checkudata(lua, 2, LSB_HEKA_STREAM_READER);
+
+  rd_kafka_message_t *rkmessage = next_batch_message(kc);
+  if (!rkmessage) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  // copy into the stream reader buffer, the decoded message must outlive the
+  // Kafka message
+  bool ok = false;
+  hsr->buf.readpos = 0;
+  hsr->buf.scanpos = 0;
+  hsr->buf.msglen = 0;
+  if (rkmessage->len > 0 && !lsb_expand_input_buffer(&hsr->buf,
+                                                     rkmessage->len)) {
+    memcpy(hsr->buf.buf, rkmessage->payload, rkmessage->len);
+    ok = lsb_decode_heka_message(&hsr->msg, hsr->buf.buf, rkmessage->len,
+                                 kc->client.logger->cb ? kc->client.logger : NULL);
+  }
+  if (!ok) {
+    lsb_clear_heka_message(&hsr->msg);
+  }
+  lua_pushboolean(lua, ok);
+  push_message_source(lua, rkmessage);
+  rd_kafka_message_destroy(rkmessage);
+  return 4;
+}
+#endif
+
+
+static int consumer_stats(lua_State *lua)
+{
+  kafka_consumer *kc = check_consumer(lua, 1, 1);
+  return push_stats(lua, &kc->client);
+}
+
+
 static int consumer_gc(lua_State *lua)
 {
-  kafka_consumer *kc = check_consumer(lua, 1);
-  if (kc->rk) rd_kafka_consumer_close(kc->rk);
+  kafka_consumer *kc = check_consumer(lua, 1, 1);
+  release_batch(kc);
+  free(kc->batch);
+  for (int i = 0; i < kc->pqueues_cnt; ++i) {
+    rd_kafka_queue_destroy(kc->pqueues[i]);
+  }
+  free(kc->pqueues);
+  if (kc->queue) rd_kafka_queue_destroy(kc->queue);
+  if (kc->client.rk) rd_kafka_consumer_close(kc->client.rk);
   if (kc->topics) rd_kafka_topic_partition_list_destroy(kc->topics);
-  if (kc->rk) rd_kafka_destroy(kc->rk);
+  if (kc->client.rk) rd_kafka_destroy(kc->client.rk);
+  free(kc->client.stats);
+  luaL_unref(lua, LUA_REGISTRYINDEX, kc->client.stats_ref);
   rd_kafka_wait_destroyed(1000);
   return 0;
 }
@@ -883,6 +1801,8 @@ static const struct luaL_reg producerlib_m[] = {
   { "destroy_topic", producer_destroy_topic },
   { "poll", producer_poll },
   { "send", producer_send },
+  { "buffer_stats", producer_buffer_stats },
+  { "stats", producer_stats },
   { "__gc", producer_gc },
   { NULL, NULL }
 };
@@ -898,10 +1818,19 @@ static const struct luaL_reg producerlibext_m[] = {
 
 static const struct luaL_reg consumerlib_m[] = {
   { "receive", consumer_receive },
+  { "receive_batch", consumer_receive_batch },
+  { "stats", consumer_stats },
   { "__gc", consumer_gc },
   { NULL, NULL }
 };
 
+#ifdef LUA_SANDBOX
+static const struct luaL_reg consumerlibext_m[] = {
+  { "decode_into", consumer_decode_into },
+  { NULL, NULL }
+};
+#endif
+
 
 int luaopen_kafka(lua_State *lua)
 {
@@ -924,6 +1853,11 @@ int luaopen_kafka(lua_State *lua)
   lua_pushvalue(lua, -1);
   lua_setfield(lua, -2, "__index");
   luaL_register(lua, NULL, consumerlib_m);
+#ifdef LUA_SANDBOX
+  if (hsb) {
+    luaL_register(lua, NULL, consumerlibext_m);
+  }
+#endif
   lua_pop(lua, 1);
 
   luaL_register(lua, mozsvc_kafka_table, kafkalib_f);
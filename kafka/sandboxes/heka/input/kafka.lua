@@ -13,6 +13,10 @@ brokerlist              = "localhost:9092" -- see https://github.com/edenhill/li
 
 -- In balanced consumer group mode a consumer can only subscribe on topics, not topics:partitions.
 -- The partition syntax is only used for manual assignments (without balanced consumer groups).
+-- A manual assignment may specify the starting offset "topic:partition@offset"
+-- where offset is a number, "beginning", "end", or "stored" (default). Pinning
+-- each input plugin to a subset of the partitions avoids the group rebalancing
+-- e.g. topics = {"test:0@stored", "test:1@stored"}
 topics                  = {"test"}
 
 -- https://github.com/edenhill/librdkafka/blob/master/CONFIGURATION.md#global-configuration-properties
@@ -36,17 +40,40 @@ topic_conf = {
 -- default_headers = nil
 
 -- Specify a module that will decode the raw data and inject the resulting message.
+-- When the default is used the messages are decoded and injected directly from
+-- the Kafka buffers without creating a Lua string.
 -- Default:
 -- decoder_module = "decoders.heka.protobuf"
+
+-- Consume each manually assigned partition from its own queue (round robin)
+-- instead of a single consumer queue so one busy partition cannot starve the
+-- others.
+-- Default:
+-- partition_queues = false
+
+-- Maximum number of messages retrieved from the consumer queue per call.
+-- Default:
+-- receive_batch_size = 1000
+
+-- Inject a summary of the librdkafka statistics (Type "kafka.statistics") each
+-- time they are emitted. Requires ["statistics.interval.ms"] to be set in the
+-- consumer_conf. Fields: replyq, rx, rx_bytes, rxmsgs, rxmsg_bytes,
+-- consumer_lag (sum over all partitions), rtt_avg and rtt_p99 (microseconds,
+-- highest of all brokers), and a consumer_lag.<topic>.<partition> entry per
+-- assigned partition.
+-- Default:
+-- inject_statistics = false
 ```
 --]]
 
 require "kafka"
+require "string"
 
 local brokerlist      = read_config("brokerlist") or error("brokerlist must be set")
 local topics          = read_config("topics") or error("topics must be set")
 local consumer_conf   = read_config("consumer_conf")
 local topic_conf      = read_config("topic_conf")
+local partition_queues = read_config("partition_queues") or false
 local default_headers = read_config("default_headers") or {}
 assert(type(default_headers) == "table", "invalid default_headers cfg")
 local decoder_module  = read_config("decoder_module") or "decoders.heka.protobuf"
@@ -54,9 +81,18 @@ local decode          = require(decoder_module).decode
 if not decode then
     error(decoder_module .. " does not provide a decode function")
 end
+local batch_size = read_config("receive_batch_size") or 1000
+assert(type(batch_size) == "number" and batch_size > 0, "invalid receive_batch_size cfg")
+local inject_statistics = read_config("inject_statistics")
+
+local hsr
+if decoder_module == "decoders.heka.protobuf" then
+    hsr = create_stream_reader(read_config("Logger"))
+end
 
 local is_running    = is_running
-local consumer      = kafka.consumer(brokerlist, topics, consumer_conf, topic_conf)
+local consumer      = kafka.consumer(brokerlist, topics, consumer_conf, topic_conf,
+                                   {partition_queues = partition_queues})
 
 local err_msg = {
     Logger  = read_config("Logger"),
@@ -64,8 +100,65 @@ local err_msg = {
     Payload = nil,
 }
 
-function process_message()
-    while is_running() do
+local stats_cnt = 0
+local stats_msg = {
+    Logger  = read_config("Logger"),
+    Type    = "kafka.statistics",
+    Fields  = nil,
+}
+
+local function inject_stats()
+    local s, cnt = consumer:stats()
+    if not s or cnt == stats_cnt then return end
+    stats_cnt = cnt
+
+    local f = {
+        replyq      = s.replyq,
+        rx          = s.rx,
+        rx_bytes    = s.rx_bytes,
+        rxmsgs      = s.rxmsgs,
+        rxmsg_bytes = s.rxmsg_bytes,
+        consumer_lag = 0,
+        rtt_avg     = 0,
+        rtt_p99     = 0,
+    }
+    for _, b in pairs(s.brokers or {}) do
+        if b.rtt then
+            if b.rtt.avg > f.rtt_avg then f.rtt_avg = b.rtt.avg end
+            if b.rtt.p99 and b.rtt.p99 > f.rtt_p99 then f.rtt_p99 = b.rtt.p99 end
+        end
+    end
+    for tn, t in pairs(s.topics or {}) do
+        for pid, p in pairs(t.partitions or {}) do
+            if pid ~= "-1" and p.consumer_lag and p.consumer_lag >= 0 then
+                f.consumer_lag = f.consumer_lag + p.consumer_lag
+                f[string.format("consumer_lag.%s.%s", tn, pid)] = p.consumer_lag
+            end
+        end
+    end
+    stats_msg.Fields = f
+    pcall(inject_message, stats_msg)
+end
+
+local function inject_batch(cnt)
+    for i = 1, cnt do
+        local ok, topic, partition = consumer:decode_into(hsr)
+        local err
+        if ok then
+            ok, err = pcall(inject_message, hsr)
+        else
+            err = string.format("invalid Heka message topic: %s partition: %d", topic, partition)
+        end
+        if not ok then
+            err_msg.Payload = err
+            pcall(inject_message, err_msg)
+        end
+    end
+end
+
+
+local function decode_batch(cnt)
+    for i = 1, cnt do
         local data, topic, partition, key = consumer:receive()
         if data then
             default_headers.Type = topic
@@ -76,5 +169,18 @@ function process_message()
             end
         end
     end
+end
+
+
+function process_message()
+    while is_running() do
+        local cnt = consumer:receive_batch(batch_size)
+        if hsr then
+            inject_batch(cnt)
+        else
+            decode_batch(cnt)
+        end
+        if inject_statistics then inject_stats() end
+    end
     return 0
 end
@@ -27,6 +27,18 @@ producer_conf = {
 
 -- Specify a module that will encode/convert the Heka message into its output representation.
 encoder_module = "encoders.heka.protobuf" -- default
+
+-- Header or field used as the Kafka message key. Keyed messages are assigned
+-- to a partition using a consistent hash so all messages with the same key
+-- land on the same partition (unkeyed messages are randomly distributed).
+-- Default:
+-- message_key = nil -- e.g. "Hostname" or "Fields[docid]"
+
+-- The checkpoint is updated once this many messages have been delivered or
+-- checkpoint_interval seconds have elapsed, whichever comes first.
+-- Default:
+-- checkpoint_step = 1000
+-- checkpoint_interval = 1
 ```
 --]]
 local brokerlist        = read_config("brokerlist") or error("brokerlist must be set")
@@ -34,12 +46,19 @@ local topic_constant    = read_config("topic_constant")
 local topic_variable    = read_config("topic_variable") or "Logger"
 local producer_conf     = read_config("producer_conf")
 local encoder_module    = read_config("encoder_module") or "encoders.heka.protobuf"
+local message_key       = read_config("message_key")
+local checkpoint_step   = read_config("checkpoint_step") or 1000
+local checkpoint_interval = read_config("checkpoint_interval") or 1
 local encode = require(encoder_module).encode
 if not encode then
     error(encoder_module .. " does not provide an encode function")
 end
 
-local producer = kafka.producer(brokerlist, producer_conf)
+local producer = kafka.producer(brokerlist, producer_conf, {
+    message_key         = message_key,
+    checkpoint_step     = checkpoint_step,
+    checkpoint_interval = checkpoint_interval
+    })
 
 function process_message(sequence_id)
     local topic = topic_constant
@@ -70,5 +89,5 @@ function process_message(sequence_id)
 end
 
 function timer_event(ns)
-    producer:poll()
+    producer:poll(true)
 end
@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <luasandbox/heka/sandbox.h>
 #include <luasandbox/test/mu_test.h>
@@ -109,11 +110,56 @@ static char* test_consumer()
 }
 
 
+static char* benchmark_producer()
+{
+  static const char *cfgs[] = {
+    TEST_MODULE_PATH "buffer_pool_size = 0\n",
+    TEST_MODULE_PATH
+  };
+  static const char *names[] = { "(no buffer pool)", "(buffer pool)" };
+  static const char pb[] = "\x0a\x10\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x10\x00\x32\x03one";
+  int iter = 100000;
+
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof pb - 1, NULL), "failed");
+  for (size_t i = 0; i < sizeof cfgs / sizeof cfgs[0]; ++i) {
+    lsb_heka_sandbox *hsb;
+    hsb = lsb_heka_create_output(NULL, "benchmark_producer.lua", NULL, cfgs[i],
+                                 &logger, ucp);
+    mu_assert(hsb, "lsb_heka_create_output failed");
+
+    g_sequence = 0;
+    clock_t t = clock();
+    for (ptrdiff_t x = 1; x <= iter; ++x) {
+      int rv;
+      while ((rv = lsb_heka_pm_output(hsb, &m, (void *)x, false)) == -3) {
+        mu_assert(0 == lsb_heka_timer_event(hsb, 0, false), "err: %s",
+                  lsb_heka_get_error(hsb));
+      }
+      mu_assert(rv == -5, "rv: %d err: %s", rv, lsb_heka_get_error(hsb));
+    }
+    while (g_sequence != iter) {
+      mu_assert(0 == lsb_heka_timer_event(hsb, 0, false), "err: %s",
+                lsb_heka_get_error(hsb));
+    }
+    t = clock() - t;
+    e = lsb_heka_destroy_sandbox(hsb);
+    mu_assert(!e, "%s", e);
+    printf("benchmark_producer %s %g msgs/sec\n", names[i],
+           iter / (((double)t) / CLOCKS_PER_SEC));
+  }
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
 static char* all_tests()
 {
   mu_run_test(test_errors);
   mu_run_test(test_producer);
   mu_run_test(test_consumer);
+  mu_run_test(benchmark_producer);
   return NULL;
 }
 
@@ -0,0 +1,28 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "kafka"
+
+local topic = read_config("topic")
+local consumer = kafka.consumer(read_config("brokerlist"), {topic},
+                                {["group.id"] = topic},
+                                {["auto.offset.reset"] = "smallest"})
+local hsr = create_stream_reader("benchmark")
+local msg = {Fields = {received = 0, sent = nil}}
+
+-- Reports the batch size and the send time of every message in the batch
+function process_message()
+    local cnt = consumer:receive_batch(10000, 10)
+    if cnt == 0 then return 0 end
+
+    local sent = {}
+    for i = 1, cnt do
+        local ok, topic, partition, key = consumer:decode_into(hsr)
+        sent[i] = tonumber(key)
+    end
+    msg.Fields.received = cnt
+    msg.Fields.sent = sent
+    inject_message(msg)
+    return 0
+end
@@ -0,0 +1,31 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "kafka"
+
+local producer = kafka.producer(read_config("brokerlist"),
+                                {
+                                    ["queue.buffering.max.messages"] = 100000,
+                                    ["batch.num.messages"] = 1000,
+                                    ["queue.buffering.max.ms"] = 5,
+                                },
+                                {
+                                    message_key = "Timestamp", -- used to measure the latency
+                                    checkpoint_step = 1000,
+                                })
+local topic = read_config("topic")
+producer:create_topic(topic)
+local encoder = read_config("encoder")
+
+function process_message(sequence_id)
+    producer:poll()
+    local ret = producer:send(topic, -1, sequence_id, read_message(encoder, nil, nil, true))
+    if ret == 105 then return -3, "queue full" end
+    assert(ret == 0, ret)
+    return -5
+end
+
+function timer_event(ns)
+    producer:poll(true)
+end
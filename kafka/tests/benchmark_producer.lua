@@ -0,0 +1,32 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "kafka"
+
+local producer = kafka.producer("localhost:9092",
+                                {
+                                    ["queue.buffering.max.messages"] = 20000,
+                                    ["batch.num.messages"] = 200,
+                                    ["queue.buffering.max.ms"] = 10,
+                                    ["topic.metadata.refresh.interval.ms"] = -1,
+                                },
+                                {
+                                    buffer_pool_size = read_config("buffer_pool_size"),
+                                    checkpoint_step = 1000,
+                                })
+local topic = "benchmark"
+producer:create_topic(topic)
+local framed = read_message("framed", nil, nil, true)
+
+function process_message(sequence_id)
+    producer:poll()
+    local ret = producer:send(topic, -1, sequence_id, framed)
+    if ret == 105 then return -3, "queue full" end
+    assert(ret == 0, ret)
+    return -5
+end
+
+function timer_event(ns)
+    producer:poll(true)
+end
@@ -4,13 +4,14 @@
 
 require "kafka"
 require "string"
-assert(kafka.version() == "1.0.5", kafka.version())
+assert(kafka.version() == "1.0.11", kafka.version())
 
 local producer = kafka.producer("localhost:9092",
                                     {
                                         ["topic.metadata.refresh.interval.ms"] = -1,
                                         ["batch.num.messages"] = 1,
                                         ["queue.buffering.max.ms"] = 1,
+                                        ["statistics.interval.ms"] = 100,
                                     })
 
 local topic = "test"
@@ -28,7 +29,11 @@ ok, err = pcall(producer.create_topic, producer, "topic", true)
 assert(err == "bad argument #3 to '?' (table expected, got boolean)", err)
 ok, err = pcall(producer.send, producer, "foobar", -1, 1, "msg x")
 assert(err == "invalid topic", err)
-assert(0 == producer:send(topic, -1, 2, "two"))
+ok, err = pcall(producer.send, producer, topic, -1, 1, "msg x", {})
+assert(err == "bad argument #6 to '?' (string expected, got table)", err)
+ok, err = pcall(kafka.producer, "localhost:9092", nil, {message_key = "Type"})
+assert(err == "message_key requires a Heka sandbox", err)
+assert(0 == producer:send(topic, -1, 2, "two", "key"))
 assert(0 == producer:send(topic, -1, 3, "three"))
 local sid, failures
 local cnt = 0
@@ -39,6 +44,27 @@ repeat
         error("timedout out waiting for delivery confirmation")
     end
 until sid == 3
+local stats, cnt, json
+repeat
+    producer:poll(100)
+    stats, cnt, json = producer:stats()
+    cnt = (cnt or 0)
+until cnt > 0
+assert(stats.type == "producer", tostring(stats.type))
+assert(json:match('^{"name":'), json)
+assert(producer:stats() == stats, "statistics decoded again")
+local assignment = {}
+for p in pairs(stats.topics.test.partitions) do
+    if tonumber(p) >= 0 then -- skip the unassigned partition
+        assignment[#assignment + 1] = string.format("test:%s@beginning", p)
+    end
+end
+assert(#assignment > 0, "missing partition statistics")
+
+local stats = producer:buffer_stats()
+assert(stats.allocations + stats.reuses == 3, stats.allocations + stats.reuses)
+assert(stats.outstanding == 0, stats.outstanding)
+assert(stats.max_pooled == 8 * 1024 * 1024, stats.max_pooled)
 
 
 local consumer = kafka.consumer("localhost:9092", {"test"}, {["group.id"] = "integration_testing"}, {["auto.offset.reset"] = "smallest"})
@@ -48,6 +74,31 @@ assert(not pb)
 
 local payloads = {"one", "two", "three"}
 
+local batch = kafka.consumer("localhost:9092", {"test"}, {["group.id"] = "integration_testing_batch"}, {["auto.offset.reset"] = "smallest"})
+local cnt = 0
+for i=1, 10 do
+    for j=1, batch:receive_batch(2, 1000) do
+        msg, topic, partition, key = batch:receive()
+        cnt = cnt + 1
+        assert(msg == payloads[cnt], string.format("batch expected: %s received: %s", payloads[cnt], tostring(msg)))
+        assert(topic == "test", topic)
+    end
+    if cnt >= 3 then break end
+end
+assert(cnt == 3, string.format("batch received %d/3 messages", cnt))
+
+local pconsumer = kafka.consumer("localhost:9092", assignment, {["group.id"] = "integration_testing_partitions"}, nil, {partition_queues = true})
+local cnt = 0
+for i=1, 10 do
+    for j=1, pconsumer:receive_batch(10, 1000) do
+        msg, topic, partition, key = pconsumer:receive()
+        assert(topic == "test", topic)
+        cnt = cnt + 1
+    end
+    if cnt >= 3 then break end
+end
+assert(cnt == 3, string.format("partition queues received %d/3 messages", cnt))
+
 local cnt = 0
 for i=1, 10 do
     msg, topic, partition, key = consumer:receive()
@@ -30,6 +30,41 @@ assert(err == "invalid config key type: function", err)
 ok, err = pcall(kafka.producer, "brokerlist", {foo = assert})
 assert(err == "invalid config value type: function", err)
 
+ok, err = pcall(kafka.producer, "brokerlist", nil, nil, nil)
+assert(err == "bad argument #4 to '?' (incorrect number of arguments)", err)
+
+ok, err = pcall(kafka.producer, "brokerlist", nil, true)
+assert(err == "bad argument #3 to '?' (table expected, got boolean)", err)
+
+ok, err = pcall(kafka.producer, "brokerlist", nil, {foo = true})
+assert(err == "invalid producer option: foo", err)
+
+ok, err = pcall(kafka.producer, "brokerlist", nil, {message_key = true})
+assert(err == "message_key must be a string", err)
+
+ok, err = pcall(kafka.producer, "brokerlist", nil, {message_key = "Fields[]"})
+assert(err == "invalid message_key: Fields[]", err)
+
+ok, err = pcall(kafka.producer, "brokerlist", nil, {message_key = "foo"})
+assert(err == "invalid message_key: foo", err)
+
+kafka.producer("brokerlist", nil, {message_key = "Fields[docid]"})
+ok, err = pcall(kafka.producer, "brokerlist", nil, {checkpoint_step = -1})
+assert(err == "checkpoint_step must be a number >= 0", err)
+
+ok, err = pcall(kafka.producer, "brokerlist", nil, {checkpoint_interval = "1"})
+assert(err == "checkpoint_interval must be a number >= 0", err)
+
+kafka.producer("brokerlist", nil, {checkpoint_step = 100, checkpoint_interval = 1})
+
+ok, err = pcall(kafka.producer, "brokerlist", nil, {buffer_pool_size = true})
+assert(err == "buffer_pool_size must be a number >= 0", err)
+
+local stats = kafka.producer("brokerlist", nil, {buffer_pool_size = 0}):buffer_stats()
+assert(stats.max_pooled == 0 and stats.pooled == 0 and stats.outstanding == 0, stats.max_pooled)
+assert(stats.allocations == 0 and stats.reuses == 0)
+kafka.producer("brokerlist", nil, {message_key = "Hostname"})
+
 ok, err = pcall(kafka.consumer)
 assert(err == "bad argument #0 to '?' (incorrect number of arguments)", err)
 
@@ -69,6 +104,33 @@ assert(err == "invalid topic partition > INT32_MAX", err)
 ok, err = pcall(kafka.consumer, "test", {"test:-1"}, {["group.id"] = "foo"})
 assert(err == "invalid topic partition < 0", err)
 
+ok, err = pcall(kafka.consumer, "test", {"test:1x"}, {["group.id"] = "foo"})
+assert(err == "invalid topic partition: 1x", err)
+
+ok, err = pcall(kafka.consumer, "test", {"test:1@first"}, {["group.id"] = "foo"})
+assert(err == "invalid topic offset: first", err)
+
+ok, err = pcall(kafka.consumer, "test", {"test:1@-5"}, {["group.id"] = "foo"})
+assert(err == "invalid topic offset: -5", err)
+
+ok, err = pcall(kafka.consumer, "test", {"test", "test:1"}, {["group.id"] = "foo"})
+assert(err == "topics cannot mix subscriptions and partition assignments", err)
+
+ok, err = pcall(kafka.consumer, "test", {"test"}, {["group.id"] = "foo"}, nil, {partition_queues = true})
+assert(err == "partition_queues requires a manual partition assignment", err)
+
+ok, err = pcall(kafka.consumer, "test", {"test:1"}, {["group.id"] = "foo"}, nil, {partition_queues = 1})
+assert(err == "partition_queues must be a boolean", err)
+
+ok, err = pcall(kafka.consumer, "test", {"test:1"}, {["group.id"] = "foo"}, nil, {foo = true})
+assert(err == "invalid consumer option: foo", err)
+
+ok, err = pcall(kafka.consumer, "test", {"test:1"}, {["group.id"] = "foo"}, nil, true)
+assert(err == "options must be a table", err)
+
+local assigned = kafka.consumer("test", {"test:0@beginning", "test:1@end", "test:2@stored", "test:3@42"}, {["group.id"] = "foo"}, nil, {partition_queues = true})
+assert(assigned:receive_batch(10, 0) == 0)
+
 ok, err = pcall(kafka.consumer, "test", {true}, {["group.id"] = "foo"})
 assert(err == "topics must be an array of strings", err)
 
@@ -77,3 +139,25 @@ assert(err == "topics must be an array of strings", err)
 
 ok, err = pcall(kafka.consumer, "test", {"test"}, {["group.id"] = "foo", ["message.max.bytes"] = true})
 assert(err:match("^Failed to set message.max.bytes = true"), err)
+
+local consumer = kafka.consumer("test", {"test"}, {["group.id"] = "foo"})
+ok, err = pcall(consumer.receive_batch, consumer, 0)
+assert(err == "bad argument #2 to '?' (max_msgs must be 1-100000)", err)
+
+ok, err = pcall(consumer.receive_batch, consumer, 100001)
+assert(err == "bad argument #2 to '?' (max_msgs must be 1-100000)", err)
+
+ok, err = pcall(consumer.receive_batch, consumer, 10, 0, 1)
+assert(err == "bad argument #4 to '?' (incorrect number of arguments)", err)
+
+local stats, cnt = consumer:stats()
+assert(stats == nil and cnt == 0, tostring(stats))
+ok, err = pcall(consumer.stats, consumer, true)
+assert(err == "bad argument #2 to '?' (incorrect number of arguments)", err)
+
+local hsr = create_stream_reader("test")
+assert(consumer:receive_batch(10, 0) == 0)
+assert(consumer:decode_into(hsr) == nil)
+
+ok, err = pcall(consumer.decode_into, consumer, {})
+assert(err == "bad argument #2 to '?' (lsb.heka_stream_reader expected, got table)", err)
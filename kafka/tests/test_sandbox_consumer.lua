@@ -12,6 +12,26 @@ assert(not pb)
 
 local payloads = {"one", "two", "three"}
 
+local batch = kafka.consumer("localhost:9092", {"test"}, {["group.id"] = "integration_testing_batch"}, {["auto.offset.reset"] = "smallest"})
+local hsr = create_stream_reader("kafka")
+
+local function receive_batch()
+    local cnt = 0
+    for i=1, 10 do
+        for j=1, batch:receive_batch(2, 1000) do
+            local ok, topic, partition = batch:decode_into(hsr)
+            assert(ok and topic == "test", tostring(topic))
+            cnt = cnt + 1
+            local payload = hsr:read_message("Payload")
+            if payload ~= payloads[cnt] then
+                return string.format("batch expected: %s received: %s", payloads[cnt], tostring(payload))
+            end
+            if cnt == 3 then return end
+        end
+    end
+    return string.format("batch received %d/3 messages", cnt)
+end
+
 function process_message()
     local cnt = 0
     for i=1, 10 do
@@ -22,7 +42,11 @@ function process_message()
             if msg.Payload ~= payloads[cnt] then
                 return -1, string.format("expected: %s received: %s", payloads[cnt], msg.Payload)
             end
-            if cnt == 3 then return 0 end
+            if cnt == 3 then
+                local err = receive_batch()
+                if err then return -1, err end
+                return 0
+            end
         end
     end
     return -1, string.format("received %d/3 messages", cnt)
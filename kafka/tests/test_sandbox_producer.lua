@@ -11,8 +11,11 @@ local producer = kafka.producer("localhost:9092",
                                              ["batch.num.messages"] = 1,
                                              ["queue.buffering.max.ms"] = 1,
                                          })
+local keyed = kafka.producer("localhost:9092", nil, {message_key = "Fields[docid]"})
+local batched = kafka.producer("localhost:9092", nil, {checkpoint_step = 1000, checkpoint_interval = 60})
 local cnt = 0
 local topic = "test"
+batched:create_topic(topic)
 local sid
 local raw = read_message("raw", nil, nil, true)
 function process_message(sequence_id)
@@ -33,7 +36,7 @@ function process_message(sequence_id)
         ok, err = pcall(producer.send, producer, "foobar", -1, sequence_id, raw)
         assert(err == "invalid topic", err)
     elseif cnt == 1 then
-        assert(0 == producer:send(topic, -1, sequence_id, encode_message({Payload = "two"})))
+        assert(0 == producer:send(topic, -1, sequence_id, encode_message({Payload = "two"}), "two"))
     elseif cnt == 2 then
         assert(0 == producer:send(topic, -1, sequence_id, encode_message({Payload = "three"})))
     end
@@ -41,10 +44,23 @@ function process_message(sequence_id)
     return 0
 end
 
+local function test_batched_checkpoint()
+    local ucp = update_checkpoint
+    local checkpoint
+    update_checkpoint = function(sequence_id, failures) checkpoint = sequence_id end
+    assert(0 == batched:send(topic, -1, sid, raw)) -- nothing to send, completes immediately
+    batched:poll()
+    assert(not checkpoint, "the checkpoint step was not reached")
+    batched:poll(true)
+    assert(checkpoint == sid, "the flush did not update the checkpoint")
+    update_checkpoint = ucp
+end
+
 function timer_event(ns)
     if sid then
         ok, err = pcall(producer.send, producer, topic, -1, sid, raw)
         assert(ok, "nil zero copy result should not error")
+        test_batched_checkpoint()
         sid = nil
     end
     producer:poll()
@@ -3,10 +3,10 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 --[[
-# Tail File Input (new line delimited)
-todo: when more than line splitting is needed the file should be read in chunks
-and passed to a generic splitter buffer with a token/match specification and a
-find function similar to the Heka stream reader.
+# Tail File Input (delimited records)
+The file is read in chunks and split into records by the splitter module; the
+checkpoint is updated once per chunk. A partial record at EOF is held until the
+rest of it is appended.
 
 ## Sample Configuration
 ```lua
@@ -34,9 +34,24 @@ input_filename = /var/log/text.log
 -- with the Payload containing the error.
 -- Default:
 -- send_decode_failures = false
+
+-- Record delimiter token
+-- Default:
+-- delimiter = "\n"
+
+-- Set of bytes that mark a continuation line (a delimiter followed by any of
+-- them does not end the record) e.g. " \t" to keep indented stack traces
+-- together with the log line.
+-- Default:
+-- continuation = nil
+
+-- Records larger than this are split
+-- Default:
+-- max_record_size = 64 * 1024
 ```
 --]]
 require "io"
+require "splitter"
 
 local input_filename  = read_config("input_filename") or error("input_filename is required")
 local follow = read_config("follow") or "descriptor"
@@ -51,28 +66,49 @@ if not decode then
     error(decoder_module .. " does not provide a decode function")
 end
 local send_decode_failures  = read_config("send_decode_failures")
+local sp = splitter.new(read_config("delimiter"), {
+    continuation    = read_config("continuation"),
+    max_record_size = read_config("max_record_size"),
+})
 
 local err_msg = {
     Type    = "error",
     Payload = nil,
 }
 
+local function process_record(data)
+    local ok, err = pcall(decode, data, default_headers)
+    if (not ok or err) and send_decode_failures then
+        err_msg.Payload = err
+        pcall(inject_message, err_msg)
+    end
+end
+
+
 local function read_until_eof(fh, checkpoint)
-    for data in fh:lines() do
-        local ok, err = pcall(decode, data, default_headers)
-        if (not ok or err) and send_decode_failures then
-            err_msg.Payload = err
-            pcall(inject_message, err_msg)
+    local last = checkpoint
+    while true do
+        local data, consumed, read = sp:find_record(fh)
+        if read > 0 and checkpoint ~= last then
+            inject_message(nil, checkpoint) -- once per chunk
+            last = checkpoint
+        end
+        if data then
+            process_record(data)
+        elseif read == 0 then
+            break
         end
-        checkpoint = checkpoint + #data + 1
-        inject_message(nil, checkpoint)
+        checkpoint = checkpoint + consumed
     end
+    if checkpoint ~= last then inject_message(nil, checkpoint) end
+    return checkpoint
 end
 
 
 local function open_file(checkpoint)
     local fh, err = io.open(input_filename, "rb")
     if not fh then return nil end
+    sp:reset()
 
     if checkpoint ~= 0 then
         if not fh:seek("set", checkpoint) then
@@ -94,10 +130,15 @@ local inode
 local function follow_name(fh, checkpoint)
     if not inode then inode = get_inode() end
     while true do
-        read_until_eof(fh, checkpoint)
+        checkpoint = read_until_eof(fh, checkpoint)
         local tinode = get_inode()
         if inode ~= tinode then
             inode = tinode
+            local data = sp:flush() -- the file is complete
+            while data do
+                process_record(data)
+                data = sp:flush()
+            end
             checkpoint = 0
             inject_message(nil, checkpoint)
             fh:close()
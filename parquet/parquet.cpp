@@ -6,12 +6,21 @@
 
 /** @brief Lua parquet-cpp wrapper implementation @file */
 
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <parquet/column/reader.h>
+#include <parquet/column/statistics.h>
 #include <parquet/column/writer.h>
+#include <parquet/file/reader.h>
 #include <parquet/file/writer.h>
 #include <parquet/types.h>
 #include <parquet/util/output.h>
@@ -25,6 +34,15 @@ int luaopen_parquet(lua_State *lua);
 }
 
 #ifdef LUA_SANDBOX
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <luasandbox/heka/sandbox.h>
 #include <luasandbox/util/heka_message.h>
 #include <luasandbox/util/protobuf.h>
@@ -37,6 +55,11 @@ namespace pq = parquet;
 static const char *mozsvc_parquet_schema    = "mozsvc.parquet_schema";
 static const char *mozsvc_parquet_group     = "mozsvc.parquet_group";
 static const char *mozsvc_parquet_writer    = "mozsvc.parquet_writer";
+static const char *mozsvc_parquet_pool      = "mozsvc.parquet_pool";
+static const char *mozsvc_parquet_reader    = "mozsvc.parquet_reader";
+#ifdef LUA_SANDBOX
+static const char *mozsvc_parquet_partitioned = "mozsvc.parquet_partitioned_writer";
+#endif
 static const char *repetitions[] = { "required", "optional", "repeated", NULL };
 static const char *data_types[] = { "boolean", "int32", "int64", "int96",
   "float", "double", "binary", "fixed_len_byte_array", NULL };
@@ -81,6 +104,18 @@ struct pq_node {
 };
 
 
+// Dedups the values of a low cardinality BYTE_ARRAY column; the column bytes
+// only hold each distinct value once per row group.
+typedef struct pq_intern
+{
+  vector<uint32_t>      slots;  // values index + 1, 0 = empty
+  vector<pq::ByteArray> values; // length and offset into the column bytes
+  size_t                max_values;
+
+  pq_intern(size_t max_values) : slots(64, 0), max_values(max_values) { }
+} pq_intern;
+
+
 typedef struct pq_column
 {
   pq_node                                     *n;
@@ -91,6 +126,7 @@ typedef struct pq_column
   vector<int16_t> *rlevels;
 
   vector<uint8_t> *bytes; // fixed length byte array/byte array/bool usage
+  pq_intern       *intern; // optional BYTE_ARRAY dedup table
   union {
     vector<int32_t>       *i32;
     vector<int64_t>       *i64;
@@ -107,10 +143,19 @@ typedef struct pq_column
   size_t rec_d_items;
   size_t rec_v_items;
 
-  pq_column(pq_node *n) : n(n),
+  // buffer sizes of the last row group written, used to release capacity
+  // left over from an unusually large one
+  size_t hw_values;
+  size_t hw_items;
+  size_t hw_bytes;
+
+  size_t *buffered; // the writer's running total of column_bytes
+
+  pq_column(pq_node *n, size_t *buffered) : n(n),
       pn(static_pointer_cast<pq::schema::PrimitiveNode>(n->node)),
       num_values(0), dlevels(nullptr), rlevels(nullptr), bytes(nullptr),
-      i32(nullptr), rec_num(0), rec_r_items(0), rec_d_items(0), rec_v_items(0)
+      intern(nullptr), i32(nullptr), rec_num(0), rec_r_items(0), rec_d_items(0), rec_v_items(0),
+      hw_values(0), hw_items(0), hw_bytes(0), buffered(buffered)
   { }
 } pq_column;
 
@@ -120,12 +165,84 @@ typedef struct pq_node_ud {
 } pq_node_ud;
 
 
+typedef struct pq_field_ref
+{
+  const char  *name; // points into the pq_node name
+  size_t      len;
+  size_t      column;
+  size_t      seen; // dissect sequence number of the last record using it
+} pq_field_ref;
+
+
+struct pq_writer;
+
+// Threads shared by all async writers in the sandbox; each writer has at most
+// one row group queued or in flight so row groups of different writers are
+// encoded and compressed in parallel.
+typedef struct pq_pool
+{
+  vector<thread>        threads;
+  deque<pq_writer *>    jobs;
+  mutex                 mtx;
+  condition_variable    work_cv;
+  condition_variable    done_cv;
+  size_t                max_threads;
+  size_t                idle;
+  bool                  stop;
+
+  pq_pool() : max_threads(1), idle(0), stop(false) { }
+} pq_pool;
+
+
+typedef struct pq_pool_ud
+{
+  pq_pool *p;
+} pq_pool_ud;
+
+
+// Sink for the in memory and callback writers; Tell() must stay absolute since
+// parquet-cpp records the column chunk offsets in the footer, so delivered
+// bytes are tracked by offset.
+class pq_buffer_stream : public pq::OutputStream
+{
+public:
+  vector<uint8_t> data;
+  int64_t         offset; // file position of data[0]
+
+  pq_buffer_stream() : offset(0) { }
+  void Close() { }
+  int64_t Tell() { return offset + static_cast<int64_t>(data.size()); }
+  void Write(const uint8_t *buf, int64_t len) { data.insert(data.end(), buf, buf + len); }
+};
+
+
 typedef struct pq_writer
 {
   pq_node *node;
   vector<pq_column *> columns;
   unique_ptr<pq::ParquetFileWriter> writer;
+  shared_ptr<pq_buffer_stream> buffer; // in memory/callback sink
+  int callback; // registry reference, LUA_NOREF for the in memory sink
   size_t num_records;
+  size_t max_rowgroup_bytes; // 0 = no byte limit
+  size_t buffered; // column_bytes of columns, maintained as values are added
+
+  // Fields columns sorted by name for dissect_message, built on first use
+  vector<pq_field_ref> fields;
+  bool fields_indexed;
+  size_t fields_seq;
+
+  // async mode: completed row groups are handed off to the pool while the
+  // next one is collected in the alternate column set
+  pq_pool *pool;
+  bool flushing; // guarded by pool->mtx
+  vector<pq_column *> flush_columns;
+  size_t flush_records;
+  string async_error;
+
+  pq_writer() : callback(LUA_NOREF), num_records(0), max_rowgroup_bytes(0),
+      buffered(0), fields_indexed(false), fields_seq(0),
+      pool(nullptr), flushing(false), flush_records(0) { }
 
   ~pq_writer();
 } pq_writer;
@@ -226,7 +343,7 @@ static void free_children(pq_node *n)
 }
 
 
-pq_writer::~pq_writer()
+static void free_columns(vector<pq_column *> &columns)
 {
   size_t len = columns.size();
   for (size_t i = 0; i < len; ++i) {
@@ -258,10 +375,25 @@ pq_writer::~pq_writer()
       break;
     }
     delete c->bytes;
+    delete c->intern;
     delete c->rlevels;
     delete c->dlevels;
     delete c;
   }
+  columns.clear();
+}
+
+
+pq_writer::~pq_writer()
+{
+  if (pool) {
+    unique_lock<mutex> lock(pool->mtx);
+    while (flushing) {
+      pool->done_cv.wait(lock);
+    }
+  }
+  free_columns(columns);
+  free_columns(flush_columns);
 }
 
 
@@ -494,16 +626,17 @@ static pq::schema::NodePtr build_nested(pq_node *n, int16_t r, int16_t d, size_t
 }
 
 
-static void add_columns(pq_writer *pw, pq_node *n)
+static void add_columns(vector<pq_column *> &columns, pq_node *n,
+                        size_t *buffered)
 {
   size_t len = n->group->fields.size();
   for (size_t i = 0; i < len; ++i) {
     pq_node *cn = n->group->fields[i];
     if (cn->nt == pq::schema::Node::GROUP) {
-      add_columns(pw, cn);
+      add_columns(columns, cn, buffered);
     } else {
       // create a column data collector specific to this writer
-      pq_column *c = new pq_column(cn);
+      pq_column *c = new pq_column(cn, buffered);
       switch (c->pn->physical_type()) {
       case pq::Type::INT32:
         c->i32 = new vector<int32_t>;
@@ -538,7 +671,7 @@ static void add_columns(pq_writer *pw, pq_node *n)
       if (cn->dl > 0) {
         c->dlevels = new vector<int16_t>;
       }
-      pw->columns.push_back(c);
+      columns.push_back(c);
     }
   }
 }
@@ -568,6 +701,19 @@ static int pq_schema_finalize(lua_State *lua)
 }
 
 
+// Page indexes and bloom filters postdate the parquet-cpp release this module
+// is built against; requesting them is an error rather than a silent no-op.
+static void check_unsupported(lua_State *lua, const char *key)
+{
+  if ((strcmp(key, "column_index") == 0 || strcmp(key, "offset_index") == 0
+       || strcmp(key, "bloom_filter") == 0) && lua_toboolean(lua, -1)) {
+    stringstream ss;
+    ss << key << " is not supported by this parquet-cpp version";
+    throw pq::ParquetException(ss.str());
+  }
+}
+
+
 static void setup_column_properties(lua_State *lua, const char *colname,
                                     pq::WriterProperties::Builder &pb)
 {
@@ -631,6 +777,8 @@ static void setup_column_properties(lua_State *lua, const char *colname,
         } else {
           pb.disable_statistics(colname);
         }
+      } else {
+        check_unsupported(lua, key);
       }
     }
     lua_pop(lua, 1);
@@ -638,11 +786,12 @@ static void setup_column_properties(lua_State *lua, const char *colname,
 }
 
 
-static shared_ptr<pq::WriterProperties> setup_properties(lua_State *lua)
+static shared_ptr<pq::WriterProperties>
+setup_properties(lua_State *lua, int idx)
 {
   pq::WriterProperties::Builder pb;
   lua_pushnil(lua);
-  while (lua_next(lua, 3) != 0) {
+  while (lua_next(lua, idx) != 0) {
     if (lua_type(lua, -2) != LUA_TSTRING) {
       stringstream ss;
       ss << "non string key in the properties table";
@@ -749,6 +898,8 @@ static shared_ptr<pq::WriterProperties> setup_properties(lua_State *lua)
           ss << "columns must be a table";
           throw pq::ParquetException(ss.str());
         }
+      } else {
+        check_unsupported(lua, key);
       }
     }
     lua_pop(lua, 1);
@@ -757,11 +908,125 @@ static shared_ptr<pq::WriterProperties> setup_properties(lua_State *lua)
 }
 
 
+static void setup_interning(lua_State *lua, pq_writer *pw, int idx)
+{
+  lua_getfield(lua, idx, "columns");
+  if (lua_type(lua, -1) != LUA_TTABLE) {
+    lua_pop(lua, 1);
+    return;
+  }
+
+  pq::SchemaDescriptor sd;
+  sd.Init(pw->node->node);
+  size_t len = pw->columns.size();
+  for (size_t i = 0; i < len; ++i) {
+    string path = sd.Column(static_cast<int>(i))->path()->ToDotString();
+    lua_getfield(lua, -1, path.c_str());
+    if (lua_type(lua, -1) == LUA_TTABLE) {
+      lua_getfield(lua, -1, "intern");
+      size_t max_values = 0;
+      switch (lua_type(lua, -1)) {
+      case LUA_TBOOLEAN:
+        max_values = lua_toboolean(lua, -1) ? 65536 : 0;
+        break;
+      case LUA_TNUMBER:
+        {
+          lua_Number n = lua_tonumber(lua, -1);
+          if (n < 0 || n > 4294967295.0) { // slots hold 32 bit value indexes
+            stringstream ss;
+            ss << "intern must be a boolean or a number 0-4294967295:" << path;
+            throw pq::ParquetException(ss.str());
+          }
+          max_values = static_cast<size_t>(n);
+        }
+        break;
+      }
+      lua_pop(lua, 1);
+
+      if (max_values > 0) {
+        if (pw->columns[i]->pn->physical_type() != pq::Type::BYTE_ARRAY) {
+          stringstream ss;
+          ss << "intern requires a binary column:" << path;
+          throw pq::ParquetException(ss.str());
+        }
+        pw->columns[i]->intern = new pq_intern(max_values);
+        if (!pw->flush_columns.empty()) {
+          pw->flush_columns[i]->intern = new pq_intern(max_values);
+        }
+      }
+    }
+    lua_pop(lua, 1);
+  }
+  lua_pop(lua, 1);
+}
+
+
+static void free_writer(pq_writer *w)
+{
+  if (--w->node->ref_cnt == 0) {
+    free_children(w->node);
+  }
+  delete w;
+}
+
+
+// props is the stack index of the properties table, 0 for the defaults
+static pq_writer* create_writer(lua_State *lua,
+                                const shared_ptr<pq::OutputStream> &sink,
+                                pq_node *n, int props)
+{
+  pq_writer *w = new pq_writer;
+  w->node = n;
+  ++n->ref_cnt;
+  try {
+    add_columns(w->columns, n, &w->buffered);
+    if (props) {
+      lua_getfield(lua, props, "max_rowgroup_bytes");
+      lua_Number mrb = lua_tonumber(lua, -1);
+      lua_pop(lua, 1);
+      if (mrb < 0) {
+        throw pq::ParquetException("max_rowgroup_bytes must be >= 0");
+      }
+      w->max_rowgroup_bytes = static_cast<size_t>(mrb);
+
+      lua_getfield(lua, props, "async");
+      bool async = lua_toboolean(lua, -1);
+      lua_pop(lua, 1);
+      if (async) {
+        lua_getfield(lua, LUA_REGISTRYINDEX, mozsvc_parquet_pool);
+        pq_pool_ud *pp = static_cast<pq_pool_ud *>(lua_touserdata(lua, -1));
+        lua_pop(lua, 1);
+        if (!pp || !pp->p) {
+          throw pq::ParquetException("async writer pool unavailable");
+        }
+        add_columns(w->flush_columns, n, &w->buffered);
+        w->pool = pp->p;
+      }
+      setup_interning(lua, w, props);
+    }
+
+    if (props) {
+      w->writer = pq::ParquetFileWriter::Open(sink, static_pointer_cast<pq::schema::GroupNode>(n->node),
+                                              setup_properties(lua, props));
+    } else {
+      w->writer = pq::ParquetFileWriter::Open(sink, static_pointer_cast<pq::schema::GroupNode>(n->node));
+    }
+  } catch (...) {
+    free_writer(w);
+    throw;
+  }
+  return w;
+}
+
+
 static int pq_new_writer(lua_State *lua)
 {
-  size_t len;
-  const char *name = luaL_checklstring(lua, 1, &len);
-  luaL_argcheck(lua, len > 0, 1, "filenamename cannot be empty");
+  int st = lua_type(lua, 1);
+  luaL_argcheck(lua, st == LUA_TSTRING || st == LUA_TFUNCTION || st == LUA_TNIL,
+                1, "filename, callback function or nil expected");
+  if (st == LUA_TSTRING) {
+    luaL_argcheck(lua, lua_objlen(lua, 1) > 0, 1, "filenamename cannot be empty");
+  }
 
   pq_node_ud *ud = static_cast<pq_node_ud *>
       (luaL_checkudata(lua, 2, mozsvc_parquet_schema));
@@ -778,18 +1043,19 @@ static int pq_new_writer(lua_State *lua)
 
   bool err = false;
   try {
-    pw->w = new pq_writer;
-    pw->w->node = ud->n;
-    ++pw->w->node->ref_cnt;
-    pw->w->num_records = 0;
-    add_columns(pw->w, pw->w->node);
-
-    shared_ptr<pq::LocalFileOutputStream> sink(new pq::LocalFileOutputStream(name));
-    if (t == LUA_TTABLE) {
-      pw->w->writer = pq::ParquetFileWriter::Open(sink, static_pointer_cast<pq::schema::GroupNode>(ud->n->node),
-                                                  setup_properties(lua));
+    shared_ptr<pq_buffer_stream> buffer;
+    shared_ptr<pq::OutputStream> sink;
+    if (st == LUA_TSTRING) {
+      sink.reset(new pq::LocalFileOutputStream(lua_tostring(lua, 1)));
     } else {
-      pw->w->writer = pq::ParquetFileWriter::Open(sink, static_pointer_cast<pq::schema::GroupNode>(ud->n->node));
+      buffer.reset(new pq_buffer_stream);
+      sink = buffer;
+    }
+    pw->w = create_writer(lua, sink, ud->n, t == LUA_TTABLE ? 3 : 0);
+    pw->w->buffer = buffer;
+    if (st == LUA_TFUNCTION) {
+      lua_pushvalue(lua, 1);
+      pw->w->callback = luaL_ref(lua, LUA_REGISTRYINDEX);
     }
   } catch (exception &e) {
     lua_pushstring(lua, e.what());
@@ -802,6 +1068,24 @@ static int pq_new_writer(lua_State *lua)
 }
 
 
+static int pq_set_threads(lua_State *lua)
+{
+  lua_Integer n = luaL_checkinteger(lua, 1);
+  luaL_argcheck(lua, n > 0 && n <= 256, 1, "thread count must be 1-256");
+
+  lua_getfield(lua, LUA_REGISTRYINDEX, mozsvc_parquet_pool);
+  pq_pool_ud *pp = static_cast<pq_pool_ud *>(lua_touserdata(lua, -1));
+  lua_pop(lua, 1);
+  if (!pp || !pp->p) {
+    return luaL_error(lua, "async writer pool unavailable");
+  }
+  // running threads are not stopped, the limit applies to new ones
+  lock_guard<mutex> lock(pp->p->mtx);
+  pp->p->max_threads = static_cast<size_t>(n);
+  return 0;
+}
+
+
 static int pq_version(lua_State *lua)
 {
   lua_pushstring(lua, DIST_VERSION);
@@ -809,9 +1093,13 @@ static int pq_version(lua_State *lua)
 }
 
 
+static int pq_new_reader(lua_State *lua);
+
 static const struct luaL_reg pq_lib_f[] = {
   { "schema", pq_new_schema },
   { "writer", pq_new_writer },
+  { "reader", pq_new_reader },
+  { "set_threads", pq_set_threads },
   { "version", pq_version },
   { NULL, NULL }
 };
@@ -833,11 +1121,190 @@ static const struct luaL_reg pq_grouplib_m[] = {
 };
 
 
-static void write_columns(pq_writer *pw, pq::RowGroupWriter *rgw)
+static void reset_intern(pq_intern *in)
 {
-  size_t len = pw->columns.size();
+  fill(in->slots.begin(), in->slots.end(), 0);
+  in->values.clear();
+}
+
+
+static size_t value_items(const pq_column *c)
+{
+  switch (c->pn->physical_type()) {
+  case pq::Type::BOOLEAN:
+    return c->bytes->size();
+  case pq::Type::INT32:
+    return c->i32->size();
+  case pq::Type::INT64:
+    return c->i64->size();
+  case pq::Type::INT96:
+    return c->i96->size();
+  case pq::Type::FLOAT:
+    return c->f->size();
+  case pq::Type::DOUBLE:
+    return c->d->size();
+  case pq::Type::BYTE_ARRAY:
+    return c->ba->size();
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    return c->flba->size();
+  }
+  return 0;
+}
+
+
+static size_t column_bytes(const pq_column *c)
+{
+  size_t n = value_items(c);
+  switch (c->pn->physical_type()) {
+  case pq::Type::BOOLEAN:
+    n = c->bytes->size();
+    break;
+  case pq::Type::INT32:
+    n *= sizeof(int32_t);
+    break;
+  case pq::Type::INT64:
+    n *= sizeof(int64_t);
+    break;
+  case pq::Type::INT96:
+    n *= sizeof(pq::Int96);
+    break;
+  case pq::Type::FLOAT:
+    n *= sizeof(float);
+    break;
+  case pq::Type::DOUBLE:
+    n *= sizeof(double);
+    break;
+  case pq::Type::BYTE_ARRAY:
+    n = n * sizeof(pq::ByteArray) + c->bytes->size();
+    break;
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    n = n * sizeof(pq::FLBA) + c->bytes->size();
+    break;
+  }
+  if (c->rlevels) {
+    n += c->rlevels->size() * sizeof(int16_t);
+  }
+  if (c->dlevels) {
+    n += c->dlevels->size() * sizeof(int16_t);
+  }
+  return n;
+}
+
+
+static size_t buffered_bytes(const pq_writer *pw)
+{
+  return pw->buffered;
+}
+
+
+template<typename T>
+static void fit_buffer(vector<T> *v, size_t hw)
+{
+  if (v && v->capacity() / 2 > hw) {
+    vector<T>().swap(*v);
+    v->reserve(hw);
+  }
+}
+
+
+template<typename T>
+static void reserve_buffer(vector<T> *v, size_t n)
+{
+  if (v && v->capacity() < n) {
+    v->reserve(n);
+  }
+}
+
+
+static void record_high_water(pq_column *c)
+{
+  c->hw_values = c->num_values;
+  c->hw_items = value_items(c);
+  c->hw_bytes = c->bytes ? c->bytes->size() : 0;
+}
+
+
+// Called on the emptied buffers; capacity is kept for the next row group
+// unless it is more than twice what the last one needed.
+static void trim_column(pq_column *c)
+{
+  fit_buffer(c->rlevels, c->hw_values);
+  fit_buffer(c->dlevels, c->hw_values);
+  switch (c->pn->physical_type()) {
+  case pq::Type::BOOLEAN:
+    fit_buffer(c->bytes, c->hw_items);
+    break;
+  case pq::Type::INT32:
+    fit_buffer(c->i32, c->hw_items);
+    break;
+  case pq::Type::INT64:
+    fit_buffer(c->i64, c->hw_items);
+    break;
+  case pq::Type::INT96:
+    fit_buffer(c->i96, c->hw_items);
+    break;
+  case pq::Type::FLOAT:
+    fit_buffer(c->f, c->hw_items);
+    break;
+  case pq::Type::DOUBLE:
+    fit_buffer(c->d, c->hw_items);
+    break;
+  case pq::Type::BYTE_ARRAY:
+    fit_buffer(c->ba, c->hw_items);
+    fit_buffer(c->bytes, c->hw_bytes);
+    break;
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    fit_buffer(c->flba, c->hw_items);
+    fit_buffer(c->bytes, c->hw_bytes);
+    break;
+  }
+}
+
+
+// Sizes the (empty) dst buffers for a row group like the one in src.
+static void reserve_column(pq_column *dst, const pq_column *src)
+{
+  size_t items = value_items(src);
+  reserve_buffer(dst->rlevels, src->num_values);
+  reserve_buffer(dst->dlevels, src->num_values);
+  switch (dst->pn->physical_type()) {
+  case pq::Type::BOOLEAN:
+    reserve_buffer(dst->bytes, items);
+    break;
+  case pq::Type::INT32:
+    reserve_buffer(dst->i32, items);
+    break;
+  case pq::Type::INT64:
+    reserve_buffer(dst->i64, items);
+    break;
+  case pq::Type::INT96:
+    reserve_buffer(dst->i96, items);
+    break;
+  case pq::Type::FLOAT:
+    reserve_buffer(dst->f, items);
+    break;
+  case pq::Type::DOUBLE:
+    reserve_buffer(dst->d, items);
+    break;
+  case pq::Type::BYTE_ARRAY:
+    reserve_buffer(dst->ba, items);
+    reserve_buffer(dst->bytes, src->bytes->size());
+    break;
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    reserve_buffer(dst->flba, items);
+    reserve_buffer(dst->bytes, src->bytes->size());
+    break;
+  }
+}
+
+
+static void write_columns(vector<pq_column *> &columns,
+                          pq::RowGroupWriter *rgw)
+{
+  size_t len = columns.size();
   for (size_t i = 0; i < len; ++i) {
-    pq_column *c = pw->columns[i];
+    pq_column *c = columns[i];
+    record_high_water(c);
     size_t nv = c->num_values;
     int16_t *rlevels = c->rlevels ? c->rlevels->data() : nullptr;
     int16_t *dlevels = c->dlevels ? c->dlevels->data() : nullptr;
@@ -903,6 +1370,9 @@ static void write_columns(pq_writer *pw, pq::RowGroupWriter *rgw)
         column_writer->Close();
         c->bytes->clear();
         c->ba->clear();
+        if (c->intern) {
+          reset_intern(c->intern);
+        }
       }
       break;
     case pq::Type::FIXED_LEN_BYTE_ARRAY:
@@ -932,15 +1402,16 @@ static void write_columns(pq_writer *pw, pq::RowGroupWriter *rgw)
       c->dlevels->clear();
       c->rec_d_items = 0;
     }
+    trim_column(c);
   }
 }
 
 
-static void clear_columns(pq_writer *pw)
+static void clear_column_data(vector<pq_column *> &columns)
 {
-  size_t len = pw->columns.size();
+  size_t len = columns.size();
   for (size_t i = 0; i < len; ++i) {
-    pq_column *c = pw->columns[i];
+    pq_column *c = columns[i];
     switch (c->pn->physical_type()) {
     case pq::Type::BOOLEAN:
       {
@@ -975,6 +1446,9 @@ static void clear_columns(pq_writer *pw)
     case pq::Type::BYTE_ARRAY:
       c->bytes->clear();
       c->ba->clear();
+      if (c->intern) {
+        reset_intern(c->intern);
+      }
       break;
     case pq::Type::FIXED_LEN_BYTE_ARRAY:
       c->bytes->clear();
@@ -993,7 +1467,14 @@ static void clear_columns(pq_writer *pw)
       c->rec_d_items = 0;
     }
   }
+}
+
+
+static void clear_columns(pq_writer *pw)
+{
+  clear_column_data(pw->columns);
   pw->num_records = 0;
+  pw->buffered = 0;
 }
 
 /* debugging only
@@ -1114,44 +1595,264 @@ static void dump_records(pq_writer *pw)
 */
 
 
-static void write_rowgroup(pq_writer *pw)
+static void flush_rowgroup(pq_writer *pw)
 {
-  if (pw->writer && pw->num_records > 0) {
-    //dump_records(pw);
-    auto rgw = pw->writer->AppendRowGroup(pw->num_records);
-    write_columns(pw, rgw);
+  string err;
+  try {
+    auto rgw = pw->writer->AppendRowGroup(pw->flush_records);
+    write_columns(pw->flush_columns, rgw);
     rgw->Close();
-    pw->num_records = 0;
+  } catch (exception &e) {
+    clear_column_data(pw->flush_columns);
+    err = e.what();
+  } catch (...) {
+    clear_column_data(pw->flush_columns);
+    err = "unknown write_rowgroup error";
+  }
+
+  lock_guard<mutex> lock(pw->pool->mtx);
+  if (pw->async_error.empty()) { // keep an earlier, not yet reported, error
+    pw->async_error = err;
   }
+  pw->flush_records = 0;
+  pw->flushing = false;
+  pw->pool->done_cv.notify_all();
 }
 
 
-static int pq_writer_rowgroup(lua_State *lua)
+static void pool_worker(pq_pool *p)
 {
-  pq_writer_ud *pw = static_cast<pq_writer_ud *>
-      (luaL_checkudata(lua, 1, mozsvc_parquet_writer));
-  if (!pw->w->writer) {
-    luaL_error(lua, "writer closed");
+  unique_lock<mutex> lock(p->mtx);
+  for (;;) {
+    ++p->idle;
+    while (!p->stop && p->jobs.empty()) {
+      p->work_cv.wait(lock);
+    }
+    --p->idle;
+    if (p->jobs.empty()) {
+      break;
+    }
+    pq_writer *pw = p->jobs.front();
+    p->jobs.pop_front();
+    lock.unlock();
+    flush_rowgroup(pw);
+    lock.lock();
   }
+}
 
-  bool err = false;
-  try {
-    write_rowgroup(pw->w);
-  } catch (exception &e) {
-    clear_columns(pw->w);
-    lua_pushstring(lua, e.what());
-    err = true;
-  } catch (...) {
-    clear_columns(pw->w);
-    lua_pushstring(lua, "unknown write_rowgroup error");
-    err = true;
+
+static void submit_rowgroup(pq_writer *pw)
+{
+  pq_pool *p = pw->pool;
+  lock_guard<mutex> lock(p->mtx);
+  if (p->jobs.size() >= p->idle && p->threads.size() < p->max_threads) {
+    p->threads.push_back(thread(pool_worker, p));
   }
-  return err ? lua_error(lua) : 0;
+  p->jobs.push_back(pw);
+  pw->flushing = true;
+  p->work_cv.notify_one();
+}
+
+
+// Waits for any in flight row group and rethrows its error, if any.
+static void wait_rowgroup(pq_writer *pw)
+{
+  if (!pw->pool) {return;}
+
+  string err;
+  {
+    unique_lock<mutex> lock(pw->pool->mtx);
+    while (pw->flushing) {
+      pw->pool->done_cv.wait(lock);
+    }
+    err.swap(pw->async_error);
+  }
+  if (!err.empty()) {
+    throw pq::ParquetException(err);
+  }
+}
+
+
+// Reports the error of a completed async row group without blocking.
+static void poll_rowgroup(pq_writer *pw)
+{
+  if (!pw->pool) {return;}
+
+  string err;
+  {
+    lock_guard<mutex> lock(pw->pool->mtx);
+    err.swap(pw->async_error);
+  }
+  if (!err.empty()) {
+    throw pq::ParquetException(err);
+  }
+}
+
+
+static void write_rowgroup(pq_writer *pw)
+{
+  if (pw->writer && pw->num_records > 0) {
+    //dump_records(pw);
+    if (pw->pool) {
+      // at most one row group is in flight; the sandbox only blocks here when
+      // the previous one has not finished. Its error is left in async_error
+      // for the next poll_rowgroup/wait_rowgroup so it is never reported
+      // against a record that has already been accepted.
+      {
+        unique_lock<mutex> lock(pw->pool->mtx);
+        while (pw->flushing) {
+          pw->pool->done_cv.wait(lock);
+        }
+      }
+      size_t len = pw->columns.size();
+      for (size_t i = 0; i < len; ++i) {
+        reserve_column(pw->flush_columns[i], pw->columns[i]);
+      }
+      pw->columns.swap(pw->flush_columns);
+      pw->flush_records = pw->num_records;
+      pw->num_records = 0;
+      size_t buffered = pw->buffered;
+      pw->buffered = 0; // the alternate set was emptied by its write
+      try {
+        submit_rowgroup(pw);
+      } catch (...) {
+        pw->columns.swap(pw->flush_columns);
+        pw->num_records = pw->flush_records;
+        pw->flush_records = 0;
+        pw->buffered = buffered;
+        throw;
+      }
+      return;
+    }
+    auto rgw = pw->writer->AppendRowGroup(pw->num_records);
+    write_columns(pw->columns, rgw);
+    rgw->Close();
+    pw->num_records = 0;
+    pw->buffered = 0;
+  }
+}
+
+
+// Flushes the row group once it exceeds the max_rowgroup_bytes property.
+static void check_rowgroup_size(pq_writer *pw)
+{
+  if (pw->max_rowgroup_bytes
+      && buffered_bytes(pw) >= pw->max_rowgroup_bytes) {
+    try {
+      write_rowgroup(pw);
+    } catch (...) {
+      clear_columns(pw);
+      throw;
+    }
+  }
+}
+
+
+// Hands the bytes written so far to the callback sink; skipped while an async
+// row group is in flight since the pool thread is appending to the buffer. The
+// range is only consumed once the callback succeeds so a failed delivery is
+// retried, from the same offset, by the next one.
+static void deliver_output(lua_State *lua, pq_writer *pw)
+{
+  if (pw->callback == LUA_NOREF) {return;}
+  pq_buffer_stream *b = pw->buffer.get();
+  if (pw->pool) {
+    lock_guard<mutex> lock(pw->pool->mtx);
+    if (pw->flushing || b->data.empty()) {return;}
+  } else if (b->data.empty()) {
+    return;
+  }
+
+  lua_checkstack(lua, 3);
+  lua_rawgeti(lua, LUA_REGISTRYINDEX, pw->callback);
+  lua_pushlstring(lua, reinterpret_cast<const char *>(b->data.data()), b->data.size());
+  lua_pushnumber(lua, static_cast<lua_Number>(b->offset));
+  if (lua_pcall(lua, 2, 0, 0)) {
+    const char *msg = lua_tostring(lua, -1);
+    string err("output callback failed: ");
+    err += msg ? msg : luaL_typename(lua, -1);
+    lua_pop(lua, 1);
+    throw pq::ParquetException(err);
+  }
+  b->offset += static_cast<int64_t>(b->data.size());
+  b->data.clear();
+}
+
+
+static int pq_writer_rowgroup(lua_State *lua)
+{
+  pq_writer_ud *pw = static_cast<pq_writer_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_writer));
+  if (!pw->w->writer) {
+    luaL_error(lua, "writer closed");
+  }
+
+  bool err = false;
+  try {
+    wait_rowgroup(pw->w); // a failed async row group, the buffer is kept
+    try {
+      write_rowgroup(pw->w);
+    } catch (...) {
+      clear_columns(pw->w);
+      throw;
+    }
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown write_rowgroup error");
+    err = true;
+  }
+  if (!err) {
+    try {
+      deliver_output(lua, pw->w);
+    } catch (exception &e) {
+      lua_pushstring(lua, e.what());
+      err = true;
+    }
+  }
+  return err ? lua_error(lua) : 0;
+}
+
+
+static int pq_writer_buffered_bytes(lua_State *lua)
+{
+  pq_writer_ud *pw = static_cast<pq_writer_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_writer));
+  lua_pushnumber(lua, static_cast<lua_Number>(buffered_bytes(pw->w)));
+  return 1;
+}
+
+
+static int pq_writer_contents(lua_State *lua)
+{
+  pq_writer_ud *pw = static_cast<pq_writer_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_writer));
+  if (!pw->w->buffer) {
+    return luaL_error(lua, "contents() requires an in memory writer");
+  }
+
+  bool err = false;
+  try {
+    wait_rowgroup(pw->w);
+    const vector<uint8_t> &data = pw->w->buffer->data;
+    lua_pushlstring(lua, reinterpret_cast<const char *>(data.data()), data.size());
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown contents error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 1;
 }
 
 
 static void writer_close(pq_writer *pw)
 {
+  try {
+    wait_rowgroup(pw);
+  } catch (...) {} // already reported or superseded by the close
   if (pw->writer) {
     pw->writer->Close();
     pw->writer = nullptr;
@@ -1168,6 +1869,7 @@ static int pq_writer_close(lua_State *lua)
   try {
     try {
       write_rowgroup(pw->w);
+      wait_rowgroup(pw->w);
     } catch (exception &e) {
       clear_columns(pw->w);
       lua_pushstring(lua, e.what());
@@ -1178,6 +1880,9 @@ static int pq_writer_close(lua_State *lua)
       err = true;
     }
     writer_close(pw->w);
+    if (!err) {
+      deliver_output(lua, pw->w);
+    }
   } catch (exception &e) {
     lua_pushstring(lua, e.what());
     err = true;
@@ -1199,6 +1904,7 @@ static int pq_writer_gc(lua_State *lua)
   try {
     try {
       write_rowgroup(pw->w);
+      wait_rowgroup(pw->w);
     } catch (...) {
       clear_columns(pw->w);
     }
@@ -1206,11 +1912,8 @@ static int pq_writer_gc(lua_State *lua)
     try {
       writer_close(pw->w);
     } catch (...) {}
-
-    if (--pw->w->node->ref_cnt == 0) {
-      free_children(pw->w->node);
-    }
-    delete(pw->w);
+    luaL_unref(lua, LUA_REGISTRYINDEX, pw->w->callback);
+    free_writer(pw->w);
   } catch (exception &e) {
     lua_pushstring(lua, e.what());
     err = true;
@@ -1236,13 +1939,80 @@ static void update_levels(pq_column *c, int16_t r, int16_t d)
 }
 
 
+static uint32_t intern_hash(const uint8_t *s, size_t len)
+{
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ s[i]) * 16777619u;
+  }
+  return h;
+}
+
+
+static void grow_intern(pq_column *c)
+{
+  pq_intern *in = c->intern;
+  const uint8_t *base = c->bytes->data();
+  vector<uint32_t> slots(in->slots.size() * 2, 0);
+  size_t mask = slots.size() - 1;
+  size_t len = in->values.size();
+  for (size_t i = 0; i < len; ++i) {
+    const pq::ByteArray &v = in->values[i];
+    size_t pos = intern_hash(base + reinterpret_cast<size_t>(v.ptr), v.len)
+        & mask;
+    while (slots[pos]) {
+      pos = (pos + 1) & mask;
+    }
+    slots[pos] = static_cast<uint32_t>(i + 1);
+  }
+  in->slots.swap(slots);
+}
+
+
+static void intern_string(pq_column *c, const uint8_t *s, size_t len)
+{
+  pq_intern *in = c->intern;
+  const uint8_t *base = c->bytes->data();
+  size_t mask = in->slots.size() - 1;
+  size_t pos = intern_hash(s, len) & mask;
+  while (in->slots[pos]) {
+    const pq::ByteArray &v = in->values[in->slots[pos] - 1];
+    if (v.len == len && (len == 0
+                         || memcmp(base + reinterpret_cast<size_t>(v.ptr), s,
+                                   len) == 0)) {
+      c->ba->push_back(v);
+      return;
+    }
+    pos = (pos + 1) & mask;
+  }
+
+  size_t offset = c->bytes->size();
+  c->bytes->insert(c->bytes->end(), s, s + len);
+  pq::ByteArray v(static_cast<uint32_t>(len),
+                  reinterpret_cast<uint8_t *>(offset));
+  c->ba->push_back(v);
+  if (in->values.size() < in->max_values) { // past the limit values are copied
+    in->values.push_back(v);
+    in->slots[pos] = static_cast<uint32_t>(in->values.size());
+    if (in->values.size() * 2 > in->slots.size()) {
+      grow_intern(c);
+    }
+  }
+}
+
+
 static void
 add_string(pq_column *c, const char *cs, size_t cs_len, int16_t r, int16_t d)
 {
+  size_t before = column_bytes(c);
   switch (c->pn->physical_type()) {
   case pq::Type::BYTE_ARRAY:
     {
       const uint8_t *s = reinterpret_cast<const uint8_t *>(cs);
+      if (c->intern) {
+        intern_string(c, s, cs_len);
+        break;
+      }
       size_t pos = c->bytes->size();
       c->bytes->insert(c->bytes->end(), s, s + cs_len);
       c->ba->emplace_back(static_cast<uint32_t>(cs_len),
@@ -1283,11 +2053,13 @@ add_string(pq_column *c, const char *cs, size_t cs_len, int16_t r, int16_t d)
   }
   update_levels(c, r, d);
   ++c->rec_v_items;
+  *c->buffered += column_bytes(c) - before;
 }
 
 
 static void add_boolean(pq_column *c, bool b, int16_t r, int16_t d)
 {
+  size_t before = column_bytes(c);
   switch (c->pn->physical_type()) {
   case pq::Type::BOOLEAN:
     c->bytes->push_back(b);
@@ -1302,11 +2074,13 @@ static void add_boolean(pq_column *c, bool b, int16_t r, int16_t d)
   }
   update_levels(c, r, d);
   ++c->rec_v_items;
+  *c->buffered += column_bytes(c) - before;
 }
 
 
 static void add_integer(pq_column *c, long long i, int16_t r, int16_t d)
 {
+  size_t before = column_bytes(c);
   switch (c->pn->physical_type()) {
   case pq::Type::INT32:
     c->i32->push_back(static_cast<int32_t>(i));
@@ -1324,11 +2098,13 @@ static void add_integer(pq_column *c, long long i, int16_t r, int16_t d)
   }
   update_levels(c, r, d);
   ++c->rec_v_items;
+  *c->buffered += column_bytes(c) - before;
 }
 
 
 static void add_number(pq_column *c, double n, int16_t r, int16_t d)
 {
+  size_t before = column_bytes(c);
   switch (c->pn->physical_type()) {
   case pq::Type::FLOAT:
     c->f->push_back(static_cast<float>(n));
@@ -1346,6 +2122,7 @@ static void add_number(pq_column *c, double n, int16_t r, int16_t d)
   }
   update_levels(c, r, d);
   ++c->rec_v_items;
+  *c->buffered += column_bytes(c) - before;
 }
 
 
@@ -1356,7 +2133,9 @@ static void add_null(pq_column *c, int16_t r, int16_t d)
     ss << "column '" << c->n->name << "' is required";
     throw pq::ParquetException(ss.str());
   }
+  size_t before = column_bytes(c);
   update_levels(c, r, d);
+  *c->buffered += column_bytes(c) - before;
 }
 
 
@@ -1589,9 +2368,10 @@ void rollback_record(pq_writer *pw)
     pq_column *c = pw->columns[i];
 
     if (c->rec_num != pw->num_records) {
-      return;
+      continue; // not reached by this record (Fields are in message order)
     }
 
+    size_t before = column_bytes(c);
     size_t nv = c->rec_v_items;
     if (c->rec_r_items) {
       nv = c->rec_r_items;
@@ -1637,6 +2417,7 @@ void rollback_record(pq_writer *pw)
       }
       c->rec_v_items = 0;
     }
+    pw->buffered -= before - column_bytes(c);
   }
 }
 
@@ -1652,8 +2433,11 @@ static int pq_writer_dissect(lua_State *lua)
 
   bool err = false;
   try {
+    poll_rowgroup(pw->w);
+    deliver_output(lua, pw->w);
     dissect_record(pw->w, lua, pw->w->node, 0, 0);
     ++pw->w->num_records;
+    check_rowgroup_size(pw->w);
   } catch (exception &e) {
     rollback_record(pw->w);
     lua_pushstring(lua, e.what());
@@ -1667,224 +2451,2559 @@ static int pq_writer_dissect(lua_State *lua)
 }
 
 
-#ifdef LUA_SANDBOX
-static const char*
-read_string(const char *p, const char *e, lsb_const_string *s)
+static void check_flat(pq_writer *pw)
 {
-  int tag = 0;
-  int wiretype = 0;
-  p = lsb_pb_read_key(p, &tag, &wiretype);
-  if (wiretype != LSB_PB_WT_LENGTH) {
-    throw pq::ParquetException("invalid protobuf wiretype");
+  size_t len = pw->node->group->fields.size();
+  for (size_t i = 0; i < len; ++i) {
+    pq_node *cn = pw->node->group->fields[i];
+    if (cn->nt != pq::schema::Node::PRIMITIVE || cn->node->is_repeated()) {
+      stringstream ss;
+      ss << "append_columns requires a flat schema, found '" << cn->name << "'";
+      throw pq::ParquetException(ss.str());
+    }
   }
+}
 
-  long long len;
-  p = lsb_pb_read_varint(p, e, &len);
-  if (!p || len < 0 || p + len > e) {
-    throw pq::ParquetException("invalid protobuf length");
+
+// Type checks the column array at the top of the stack and returns the number
+// of string bytes it holds; nothing is appended so a failure needs no rollback
+static size_t validate_column(lua_State *lua, pq_column *c, int nrows)
+{
+  int t = lua_type(lua, -1);
+  if (t == LUA_TNIL) {
+    if (c->pn->is_required()) {
+      stringstream ss;
+      ss << "column '" << c->n->name << "' is required";
+      throw pq::ParquetException(ss.str());
+    }
+    return 0;
   }
-  s->s = p;
-  s->len = (size_t)len;
-  return p + len;
+  if (t != LUA_TTABLE) {
+    stringstream ss;
+    ss << "column '" << c->n->name << "' expected an array";
+    throw pq::ParquetException(ss.str());
+  }
+
+  auto pt = c->pn->physical_type();
+  int expected = LUA_TNUMBER;
+  size_t fixed_len = 0;
+  switch (pt) {
+  case pq::Type::BOOLEAN:
+    expected = LUA_TBOOLEAN;
+    break;
+  case pq::Type::INT96:
+    expected = LUA_TSTRING;
+    fixed_len = sizeof(pq::Int96);
+    break;
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    expected = LUA_TSTRING;
+    fixed_len = c->pn->type_length();
+    break;
+  case pq::Type::BYTE_ARRAY:
+    expected = LUA_TSTRING;
+    break;
+  default:
+    break;
+  }
+
+  size_t bytes = 0;
+  for (int i = 1; i <= nrows; ++i) {
+    lua_rawgeti(lua, -1, i);
+    int vt = lua_type(lua, -1);
+    if (vt == LUA_TNIL) {
+      if (c->pn->is_required()) {
+        stringstream ss;
+        ss << "column '" << c->n->name << "' is required (row " << i << ")";
+        throw pq::ParquetException(ss.str());
+      }
+    } else if (vt != expected) {
+      stringstream ss;
+      ss << "column '" << c->n->name << "' data type mismatch (" <<
+          lua_typename(lua, vt) << ") row " << i;
+      throw pq::ParquetException(ss.str());
+    } else if (expected == LUA_TSTRING) {
+      size_t len = lua_objlen(lua, -1);
+      if (fixed_len && len != fixed_len) {
+        stringstream ss;
+        ss << "column '" << c->n->name << "' expected " << fixed_len <<
+            " bytes but received " << len << " (row " << i << ")";
+        throw pq::ParquetException(ss.str());
+      }
+      bytes += len;
+    }
+    lua_pop(lua, 1);
+  }
+  return bytes;
 }
 
 
-static void dissect_fields(pq_writer *pw, const lsb_heka_message *m, pq_node *n)
+// Appends the validated column array at the top of the stack
+static void append_column(lua_State *lua, pq_column *c, int nrows, size_t bytes)
 {
-  size_t len = n->group->fields.size();
-  for (size_t i = 0; i < len; ++i) {
-    pq_node *cn = n->group->fields[i];
-    if (cn->nt == pq::schema::Node::PRIMITIVE) {
-      pq_column *c = pw->columns[cn->column];
-      if (c->rec_num != pw->num_records) {
-        c->rec_num = pw->num_records;
-        c->rec_r_items = 0;
-        c->rec_d_items = 0;
-        c->rec_v_items = 0;
-      }
+  size_t before = column_bytes(c);
+  bool empty = lua_isnil(lua, -1);
+  if (c->dlevels) {
+    c->dlevels->reserve(c->dlevels->size() + nrows);
+  }
+  if (c->bytes && !c->intern) {
+    c->bytes->reserve(c->bytes->size() + bytes);
+  }
 
-      bool repeated = cn->node->is_repeated();
-      bool found = false;
-      for (int i = 0; i < m->fields_len && !found; ++i) {
-        if (cn->name.size() == m->fields[i].name.len
-            && strncmp(cn->name.c_str(), m->fields[i].name.s, m->fields[i].name.len) == 0) {
-          found = true;
-          const char *p = m->fields[i].value.s;
-          const char *e = p + m->fields[i].value.len;
-          int16_t cr = 0;
-          int cnt = 0;
-          while (p && p < e) {
-            if (cnt++ && !repeated) {
-              stringstream ss;
-              ss << "column '" << cn->name << "' data is repeated";
-              throw pq::ParquetException(ss.str());
-            }
-            switch (m->fields[i].value_type) {
-            case LSB_PB_STRING:
-            case LSB_PB_BYTES:
-              {
-                lsb_const_string cs;
-                p = read_string(p, e, &cs);
-                add_string(c, cs.s, cs.len, cr, cn->dl);
-              }
-              break;
-            case LSB_PB_INTEGER:
-            case LSB_PB_BOOL:
-              {
-                long long n;
-                p = lsb_pb_read_varint(p, e, &n);
-                if (!p) {
-                  stringstream ss;
-                  ss << "column '" << cn->name << "' invalid protobuf varint";
-                  throw pq::ParquetException(ss.str());
-                }
-                if (m->fields[i].value_type == LSB_PB_INTEGER) {
-                  add_integer(c, n, cr, cn->dl);
-                } else {
-                  add_boolean(c, n, cr, cn->dl);
-                }
-              }
-              break;
-            case LSB_PB_DOUBLE:
-              {
-                if (p + (sizeof(double)) > e) {
-                  stringstream ss;
-                  ss << "column '" << cn->name << "' invalid protobuf double";
-                  throw pq::ParquetException(ss.str());
-                }
-                double d;
-                memcpy(&d, p, sizeof(double));
-                p += sizeof(double);
-                add_number(c, d, cr, cn->dl);
-              }
-              break;
-            }
-            cr = cn->rl;
-          }
+  auto pt = c->pn->physical_type();
+  for (int i = 1; i <= nrows; ++i) {
+    if (empty) {
+      c->dlevels->push_back(0);
+      continue;
+    }
+    lua_rawgeti(lua, -1, i);
+    if (lua_isnil(lua, -1)) {
+      c->dlevels->push_back(0);
+      lua_pop(lua, 1);
+      continue;
+    }
+    switch (pt) {
+    case pq::Type::BOOLEAN:
+      c->bytes->push_back(lua_toboolean(lua, -1));
+      break;
+    case pq::Type::INT32:
+      c->i32->push_back(static_cast<int32_t>(lua_tonumber(lua, -1)));
+      break;
+    case pq::Type::INT64:
+      c->i64->push_back(static_cast<int64_t>(lua_tonumber(lua, -1)));
+      break;
+    case pq::Type::FLOAT:
+      c->f->push_back(static_cast<float>(lua_tonumber(lua, -1)));
+      break;
+    case pq::Type::DOUBLE:
+      c->d->push_back(lua_tonumber(lua, -1));
+      break;
+    case pq::Type::INT96:
+      c->i96->push_back(*reinterpret_cast<const pq::Int96 *>(lua_tostring(lua, -1)));
+      break;
+    case pq::Type::BYTE_ARRAY:
+      {
+        size_t len;
+        const uint8_t *s = reinterpret_cast<const uint8_t *>(lua_tolstring(lua, -1, &len));
+        if (c->intern) {
+          intern_string(c, s, len);
+        } else {
+          size_t pos = c->bytes->size();
+          c->bytes->insert(c->bytes->end(), s, s + len);
+          c->ba->emplace_back(static_cast<uint32_t>(len),
+                              reinterpret_cast<uint8_t *>(pos));
         }
       }
-      if (!found) {
-        add_null(c, n->rl, n->dl);
+      break;
+    case pq::Type::FIXED_LEN_BYTE_ARRAY:
+      {
+        size_t len;
+        const uint8_t *s = reinterpret_cast<const uint8_t *>(lua_tolstring(lua, -1, &len));
+        size_t pos = c->bytes->size();
+        c->bytes->insert(c->bytes->end(), s, s + len);
+        c->flba->emplace_back(reinterpret_cast<uint8_t *>(pos));
       }
-    } else {
-      stringstream ss;
-      ss << "group '" << cn->name << "' not allowed in " << LSB_FIELDS;
-      throw pq::ParquetException(ss.str());
+      break;
+    }
+    if (c->dlevels) {
+      c->dlevels->push_back(1);
     }
+    lua_pop(lua, 1);
   }
+  c->num_values += nrows;
+  *c->buffered += column_bytes(c) - before;
 }
 
 
-static int pq_writer_dissect_message(lua_State *lua)
+static int pq_writer_append_columns(lua_State *lua)
 {
   pq_writer_ud *pw = static_cast<pq_writer_ud *>
       (luaL_checkudata(lua, 1, mozsvc_parquet_writer));
-  int n = lua_gettop(lua);
-  luaL_argcheck(lua, n == 1, n, "invalid number of arguments");
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  lua_Integer nrows = luaL_checkinteger(lua, 3);
+  luaL_argcheck(lua, nrows >= 0 && nrows <= INT_MAX, 3, "invalid row count");
   if (!pw->w->writer) {
     luaL_error(lua, "writer closed");
   }
-
-  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_HEKA_THIS_PTR);
-  lsb_heka_sandbox *hsb =
-      static_cast<lsb_heka_sandbox *>(lua_touserdata(lua, -1));
-  lua_pop(lua, 1); // remove this ptr
-  if (!hsb) {
-    return luaL_error(lua, "dissect_message() invalid " LSB_HEKA_THIS_PTR);
-  }
-
-  const lsb_heka_message *msg = lsb_heka_get_message(hsb);
-  if (!msg || !msg->raw.s) {
-    return luaL_error(lua, "dissect_message() no active message");
-  }
+  lua_settop(lua, 2);
 
   bool err = false;
   try {
-    size_t len = pw->w->node->group->fields.size();
+    pq_writer *w = pw->w;
+    check_flat(w);
+    int n = static_cast<int>(nrows);
+    size_t len = w->columns.size();
+    vector<size_t> bytes(len);
+    lua_checkstack(lua, static_cast<int>(len) + 2);
     for (size_t i = 0; i < len; ++i) {
-      pq_node *cn = pw->w->node->group->fields[i];
-      if (cn->nt == pq::schema::Node::PRIMITIVE && !cn->node->is_repeated()) {
-        pq_column *c = pw->w->columns[cn->column];
-        if (c->rec_num != pw->w->num_records) {
-          c->rec_num = pw->w->num_records;
-          c->rec_r_items = 0;
-          c->rec_d_items = 0;
-          c->rec_v_items = 0;
-        }
+      lua_getfield(lua, 2, w->columns[i]->n->name.c_str());
+      bytes[i] = validate_column(lua, w->columns[i], n);
+    }
+
+    poll_rowgroup(w);
+    deliver_output(lua, w);
+    for (size_t i = 0; i < len; ++i) {
+      lua_pushvalue(lua, 3 + static_cast<int>(i));
+      append_column(lua, w->columns[i], n, bytes[i]);
+      lua_pop(lua, 1);
+    }
+    w->num_records += n;
+    check_rowgroup_size(w);
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown append_columns error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 0;
+}
+
+
+#ifdef LUA_SANDBOX
+static const char*
+read_string(const char *p, const char *e, lsb_const_string *s)
+{
+  int tag = 0;
+  int wiretype = 0;
+  p = lsb_pb_read_key(p, &tag, &wiretype);
+  if (wiretype != LSB_PB_WT_LENGTH) {
+    throw pq::ParquetException("invalid protobuf wiretype");
+  }
+
+  long long len;
+  p = lsb_pb_read_varint(p, e, &len);
+  if (!p || len < 0 || p + len > e) {
+    throw pq::ParquetException("invalid protobuf length");
+  }
+  s->s = p;
+  s->len = (size_t)len;
+  return p + len;
+}
+
+
+static bool field_ref_less(const pq_field_ref &a, const pq_field_ref &b)
+{
+  if (a.len != b.len) {
+    return a.len < b.len;
+  }
+  return memcmp(a.name, b.name, a.len) < 0;
+}
+
+
+static void index_fields(pq_writer *pw, pq_node *n)
+{
+  size_t len = n->group->fields.size();
+  pw->fields.reserve(len);
+  for (size_t i = 0; i < len; ++i) {
+    pq_node *cn = n->group->fields[i];
+    if (cn->nt != pq::schema::Node::PRIMITIVE) {
+      pw->fields.clear();
+      stringstream ss;
+      ss << "group '" << cn->name << "' not allowed in " << LSB_FIELDS;
+      throw pq::ParquetException(ss.str());
+    }
+    pq_field_ref fr = { cn->name.c_str(), cn->name.size(), cn->column, 0 };
+    pw->fields.push_back(fr);
+  }
+  sort(pw->fields.begin(), pw->fields.end(), field_ref_less);
+  pw->fields_indexed = true;
+}
+
+
+static pq_field_ref* find_field(pq_writer *pw, const lsb_const_string *name)
+{
+  pq_field_ref key = { name->s, name->len, 0, 0 };
+  auto it = lower_bound(pw->fields.begin(), pw->fields.end(), key,
+                        field_ref_less);
+  if (it != pw->fields.end() && it->len == name->len
+      && memcmp(it->name, name->s, name->len) == 0) {
+    return &*it;
+  }
+  return nullptr;
+}
+
+
+static void reset_column_record(pq_writer *pw, pq_column *c)
+{
+  if (c->rec_num != pw->num_records) {
+    c->rec_num = pw->num_records;
+    c->rec_r_items = 0;
+    c->rec_d_items = 0;
+    c->rec_v_items = 0;
+  }
+}
+
+
+static void dissect_heka_field(pq_column *c, const lsb_heka_field *f)
+{
+  pq_node *cn = c->n;
+  bool repeated = cn->node->is_repeated();
+  const char *p = f->value.s;
+  const char *e = p + f->value.len;
+  int16_t cr = 0;
+  int cnt = 0;
+  while (p && p < e) {
+    if (cnt++ && !repeated) {
+      stringstream ss;
+      ss << "column '" << cn->name << "' data is repeated";
+      throw pq::ParquetException(ss.str());
+    }
+    switch (f->value_type) {
+    case LSB_PB_STRING:
+    case LSB_PB_BYTES:
+      {
+        lsb_const_string cs;
+        p = read_string(p, e, &cs);
+        add_string(c, cs.s, cs.len, cr, cn->dl);
+      }
+      break;
+    case LSB_PB_INTEGER:
+    case LSB_PB_BOOL:
+      {
+        long long n;
+        p = lsb_pb_read_varint(p, e, &n);
+        if (!p) {
+          stringstream ss;
+          ss << "column '" << cn->name << "' invalid protobuf varint";
+          throw pq::ParquetException(ss.str());
+        }
+        if (f->value_type == LSB_PB_INTEGER) {
+          add_integer(c, n, cr, cn->dl);
+        } else {
+          add_boolean(c, n, cr, cn->dl);
+        }
+      }
+      break;
+    case LSB_PB_DOUBLE:
+      {
+        if (p + (sizeof(double)) > e) {
+          stringstream ss;
+          ss << "column '" << cn->name << "' invalid protobuf double";
+          throw pq::ParquetException(ss.str());
+        }
+        double d;
+        memcpy(&d, p, sizeof(double));
+        p += sizeof(double);
+        add_number(c, d, cr, cn->dl);
+      }
+      break;
+    }
+    cr = cn->rl;
+  }
+}
+
+
+static void dissect_fields(pq_writer *pw, const lsb_heka_message *m, pq_node *n)
+{
+  if (!pw->fields_indexed) {
+    index_fields(pw, n);
+  }
+
+  // route each message field to its column in a single pass, only the first
+  // occurrence of a field name is used
+  size_t seq = ++pw->fields_seq;
+  for (int i = 0; i < m->fields_len; ++i) {
+    pq_field_ref *fr = find_field(pw, &m->fields[i].name);
+    if (fr && fr->seen != seq) {
+      fr->seen = seq;
+      pq_column *c = pw->columns[fr->column];
+      reset_column_record(pw, c);
+      dissect_heka_field(c, &m->fields[i]);
+    }
+  }
+
+  size_t len = pw->fields.size();
+  for (size_t i = 0; i < len; ++i) {
+    pq_field_ref *fr = &pw->fields[i];
+    if (fr->seen != seq) {
+      pq_column *c = pw->columns[fr->column];
+      reset_column_record(pw, c);
+      add_null(c, n->rl, n->dl);
+    }
+  }
+}
+
+
+static void dissect_message(pq_writer *pw, const lsb_heka_message *msg)
+{
+  poll_rowgroup(pw);
+  size_t len = pw->node->group->fields.size();
+  for (size_t i = 0; i < len; ++i) {
+    pq_node *cn = pw->node->group->fields[i];
+    if (cn->nt == pq::schema::Node::PRIMITIVE && !cn->node->is_repeated()) {
+      pq_column *c = pw->columns[cn->column];
+      if (c->rec_num != pw->num_records) {
+        c->rec_num = pw->num_records;
+        c->rec_r_items = 0;
+        c->rec_d_items = 0;
+        c->rec_v_items = 0;
+      }
+
+      if (cn->name == LSB_UUID) {
+        add_string(c, msg->uuid.s, msg->uuid.len, cn->rl, cn->dl);
+      } else if (cn->name == LSB_TIMESTAMP) {
+        add_integer(c, msg->timestamp, cn->rl, cn->dl);
+      } else if (cn->name == LSB_TYPE) {
+        if (msg->type.s) {
+          add_string(c, msg->type.s, msg->type.len, cn->rl, cn->dl);
+        } else {
+          add_null(c, 0, 0);
+        }
+      } else if (cn->name == LSB_LOGGER) {
+        if (msg->logger.s) {
+          add_string(c, msg->logger.s, msg->logger.len, cn->rl, cn->dl);
+        } else {
+          add_null(c, 0, 0);
+        }
+      } else if (cn->name == LSB_SEVERITY) {
+        add_integer(c, msg->severity, cn->rl, cn->dl);
+      } else if (cn->name == LSB_PAYLOAD) {
+        if (msg->payload.s) {
+          add_string(c, msg->payload.s, msg->payload.len, cn->rl, cn->dl);
+        } else {
+          add_null(c, 0, 0);
+        }
+      } else if (cn->name == LSB_ENV_VERSION) {
+        if (msg->env_version.s) {
+          add_string(c, msg->env_version.s, msg->env_version.len, cn->rl, cn->dl);
+        } else {
+          add_null(c, 0, 0);
+        }
+      } else if (cn->name == LSB_PID) {
+        if (msg->pid == INT_MIN) {
+          add_null(c, 0, 0);
+        } else {
+          add_integer(c, msg->pid, cn->rl, cn->dl);
+        }
+      } else if (cn->name == LSB_HOSTNAME) {
+        if (msg->hostname.s) {
+          add_string(c, msg->hostname.s, msg->hostname.len, cn->rl, cn->dl);
+        } else {
+          add_null(c, 0, 0);
+        }
+      } else {
+        stringstream ss;
+        ss << "column '" << cn->name << "' invalid schema";
+        throw pq::ParquetException(ss.str());
+      }
+    } else if (cn->name == LSB_FIELDS && !cn->node->is_repeated()) {
+      dissect_fields(pw, msg, cn);
+    } else {
+      stringstream ss;
+      ss << "group '" << cn->name << "' invalid schema";
+      throw pq::ParquetException(ss.str());
+    }
+  }
+  ++pw->num_records;
+  check_rowgroup_size(pw);
+}
+
+
+static int pq_writer_dissect_message(lua_State *lua)
+{
+  pq_writer_ud *pw = static_cast<pq_writer_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_writer));
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n == 1, n, "invalid number of arguments");
+  if (!pw->w->writer) {
+    luaL_error(lua, "writer closed");
+  }
+
+  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_HEKA_THIS_PTR);
+  lsb_heka_sandbox *hsb =
+      static_cast<lsb_heka_sandbox *>(lua_touserdata(lua, -1));
+  lua_pop(lua, 1); // remove this ptr
+  if (!hsb) {
+    return luaL_error(lua, "dissect_message() invalid " LSB_HEKA_THIS_PTR);
+  }
+
+  const lsb_heka_message *msg = lsb_heka_get_message(hsb);
+  if (!msg || !msg->raw.s) {
+    return luaL_error(lua, "dissect_message() no active message");
+  }
+
+  bool err = false;
+  try {
+    deliver_output(lua, pw->w);
+    dissect_message(pw->w, msg);
+  } catch (exception &e) {
+    rollback_record(pw->w);
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    rollback_record(pw->w);
+    lua_pushstring(lua, "unknown dissect_message error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 0;
+}
+
+
+enum pq_dim_source {
+  DIM_UUID,
+  DIM_TIMESTAMP,
+  DIM_TYPE,
+  DIM_LOGGER,
+  DIM_SEVERITY,
+  DIM_PAYLOAD,
+  DIM_ENV_VERSION,
+  DIM_PID,
+  DIM_HOSTNAME,
+  DIM_FIELD,
+  DIM_RECORD
+};
+
+
+typedef struct pq_dim
+{
+  string          name;
+  pq_dim_source   source;
+  string          field;  // DIM_FIELD name
+  vector<string>  path;   // DIM_RECORD table path
+  string          dateformat;
+  double          scaling_factor;
+} pq_dim;
+
+
+typedef struct pq_dim_value
+{
+  int         type; // LUA_TNIL, LUA_TNUMBER or LUA_TSTRING
+  const char  *s;
+  size_t      len;
+  double      d;
+} pq_dim_value;
+
+
+typedef struct pq_partition
+{
+  string    key;
+  pq_writer *w;
+  time_t    created;
+  size_t    records;  // records in the current row group
+  size_t    bytes;    // buffered bytes at the last check
+} pq_partition;
+
+typedef list<pq_partition> pq_partition_list;
+
+
+typedef struct pq_partitioned
+{
+  pq_node           *node;
+  vector<pq_dim>    dims;
+  string            dir;
+  string            done_dir;
+  string            hostname;
+  string            default_nil;
+  int               props_ref;
+  int               callback_ref;
+  size_t            max_writers;
+  size_t            max_bytes;
+  size_t            max_rowgroup_size;
+  size_t            max_file_size;
+  time_t            max_file_age;
+  pq_partition_list lru; // most recently used first
+  unordered_map<string, pq_partition_list::iterator> index;
+  size_t            bytes;
+  time_t            done_time;
+  int               done_cnt;
+
+  pq_partitioned() : node(nullptr), props_ref(LUA_NOREF),
+      callback_ref(LUA_NOREF), max_writers(0), max_bytes(0),
+      max_rowgroup_size(0), max_file_size(0), max_file_age(0), bytes(0),
+      done_time(0), done_cnt(0) { }
+} pq_partitioned;
+
+
+typedef struct pq_partitioned_ud
+{
+  pq_partitioned *p;
+} pq_partitioned_ud;
+
+
+static void add_dim_value(pq_partitioned *pp, const pq_dim &d,
+                          const pq_dim_value &v, string &key)
+{
+  char buf[256];
+  const char *s = nullptr;
+  size_t len = 0;
+  if (!d.dateformat.empty() && v.type != LUA_TNIL) {
+    double n = v.type == LUA_TNUMBER ? v.d : strtod(string(v.s, v.len).c_str(), nullptr);
+    time_t t = static_cast<time_t>(n * d.scaling_factor);
+    const char *fmt = d.dateformat.c_str();
+    struct tm tms;
+    if (*fmt == '!') {
+      ++fmt;
+      gmtime_r(&t, &tms);
+    } else {
+      localtime_r(&t, &tms);
+    }
+    len = strftime(buf, sizeof(buf), fmt, &tms);
+    s = buf;
+  } else {
+    switch (v.type) {
+    case LUA_TNUMBER:
+      len = snprintf(buf, sizeof(buf), "%.14g", v.d);
+      s = buf;
+      break;
+    case LUA_TSTRING:
+      s = v.s;
+      len = v.len;
+      break;
+    default:
+      s = pp->default_nil.c_str();
+      len = pp->default_nil.size();
+      break;
+    }
+  }
+
+  if (!key.empty()) {
+    key.push_back('+'); // converted to a path separator when uploaded to S3
+  }
+  key.append(d.name);
+  key.push_back('=');
+  for (size_t i = 0; i < len; ++i) {
+    char c = s[i];
+    if (isalnum(static_cast<unsigned char>(c)) || (c && strchr("!-_.*'()", c))) {
+      key.push_back(c);
+    } else {
+      key.push_back('-');
+    }
+  }
+}
+
+
+static void read_dim_message(const pq_dim &d, const lsb_heka_message *m,
+                             pq_dim_value &v)
+{
+  v.type = LUA_TNIL;
+  const lsb_const_string *cs = nullptr;
+  switch (d.source) {
+  case DIM_UUID:
+    cs = &m->uuid;
+    break;
+  case DIM_TIMESTAMP:
+    v.type = LUA_TNUMBER;
+    v.d = static_cast<double>(m->timestamp);
+    break;
+  case DIM_TYPE:
+    cs = &m->type;
+    break;
+  case DIM_LOGGER:
+    cs = &m->logger;
+    break;
+  case DIM_SEVERITY:
+    v.type = LUA_TNUMBER;
+    v.d = m->severity;
+    break;
+  case DIM_PAYLOAD:
+    cs = &m->payload;
+    break;
+  case DIM_ENV_VERSION:
+    cs = &m->env_version;
+    break;
+  case DIM_PID:
+    if (m->pid != INT_MIN) {
+      v.type = LUA_TNUMBER;
+      v.d = m->pid;
+    }
+    break;
+  case DIM_HOSTNAME:
+    cs = &m->hostname;
+    break;
+  case DIM_FIELD:
+    {
+      lsb_const_string name = { d.field.c_str(), d.field.size() };
+      lsb_read_value rv;
+      lsb_read_heka_field(m, &name, 0, 0, &rv);
+      switch (rv.type) {
+      case LSB_READ_STRING:
+        cs = &rv.u.s;
+        break;
+      case LSB_READ_NUMERIC:
+        v.type = LUA_TNUMBER;
+        v.d = rv.u.d;
+        break;
+      case LSB_READ_BOOL:
+        v.type = LUA_TSTRING;
+        v.s = rv.u.d ? "true" : "false";
+        v.len = strlen(v.s);
+        break;
+      default:
+        break;
+      }
+    }
+    break;
+  case DIM_RECORD:
+    break;
+  }
+  if (cs && cs->s) {
+    v.type = LUA_TSTRING;
+    v.s = cs->s;
+    v.len = cs->len;
+  }
+}
+
+
+// Walks the dimension path in the record table at idx, only scalar leaves are
+// used.
+static void read_dim_record(lua_State *lua, const pq_dim &d, int idx,
+                            pq_dim_value &v)
+{
+  v.type = LUA_TNIL;
+  if (!idx) {return;}
+
+  lua_pushvalue(lua, idx);
+  size_t len = d.path.size();
+  for (size_t i = 0; i < len; ++i) {
+    lua_getfield(lua, -1, d.path[i].c_str());
+    lua_remove(lua, -2);
+    int t = lua_type(lua, -1);
+    if ((i + 1 < len && t != LUA_TTABLE) || (i + 1 == len && t == LUA_TTABLE)) {
+      lua_pop(lua, 1);
+      return;
+    }
+  }
+
+  switch (lua_type(lua, -1)) {
+  case LUA_TNUMBER:
+    v.type = LUA_TNUMBER;
+    v.d = lua_tonumber(lua, -1);
+    break;
+  case LUA_TSTRING:
+    // the string stays referenced by the record while the key is built
+    v.type = LUA_TSTRING;
+    v.s = lua_tolstring(lua, -1, &v.len);
+    break;
+  case LUA_TBOOLEAN:
+    v.type = LUA_TSTRING;
+    v.s = lua_toboolean(lua, -1) ? "true" : "false";
+    v.len = strlen(v.s);
+    break;
+  }
+  lua_pop(lua, 1);
+}
+
+
+static string partition_key(lua_State *lua, pq_partitioned *pp,
+                            const lsb_heka_message *m, int record)
+{
+  string key;
+  size_t len = pp->dims.size();
+  for (size_t i = 0; i < len; ++i) {
+    const pq_dim &d = pp->dims[i];
+    pq_dim_value v;
+    if (d.source == DIM_RECORD) {
+      read_dim_record(lua, d, record, v);
+    } else {
+      read_dim_message(d, m, v);
+    }
+    add_dim_value(pp, d, v, key);
+  }
+  return key;
+}
+
+
+static void deliver_partition(lua_State *lua, pq_partitioned *pp,
+                              const string &key)
+{
+  string src = pp->dir + "/" + key;
+  if (pp->callback_ref != LUA_NOREF) {
+    lua_rawgeti(lua, LUA_REGISTRYINDEX, pp->callback_ref);
+    lua_pushlstring(lua, src.c_str(), src.size());
+    lua_pushlstring(lua, key.c_str(), key.size());
+    if (lua_pcall(lua, 2, 0, 0)) {
+      string err = lua_tostring(lua, -1) ? lua_tostring(lua, -1) : "";
+      lua_pop(lua, 1);
+      throw pq::ParquetException("partition callback failed: " + err);
+    }
+    return;
+  }
+
+  time_t t = time(NULL);
+  if (t == pp->done_time) {
+    ++pp->done_cnt;
+  } else {
+    pp->done_time = t;
+    pp->done_cnt = 0;
+  }
+  stringstream ss;
+  ss << pp->done_dir << "/" << key << "+" << static_cast<long long>(t) << "_"
+      << pp->done_cnt << "_" << pp->hostname << ".done";
+  string dest = ss.str();
+  if (rename(src.c_str(), dest.c_str())) {
+    stringstream es;
+    es << "rename('" << src << "','" << dest << "') failed: " << strerror(errno);
+    throw pq::ParquetException(es.str());
+  }
+}
+
+
+// Closes the partition file and hands it off; a failed file is left in dir.
+static void finish_partition(lua_State *lua, pq_partitioned *pp,
+                             pq_partition_list::iterator it)
+{
+  pq_writer *w = it->w;
+  string err;
+  try {
+    write_rowgroup(w);
+    wait_rowgroup(w);
+  } catch (exception &e) {
+    clear_columns(w);
+    err = e.what();
+  }
+  try {
+    writer_close(w);
+  } catch (exception &e) {
+    if (err.empty()) {err = e.what();}
+  }
+  free_writer(w);
+
+  string key = it->key;
+  pp->bytes -= it->bytes;
+  pp->index.erase(key);
+  pp->lru.erase(it);
+  if (!err.empty()) {
+    throw pq::ParquetException(err);
+  }
+  deliver_partition(lua, pp, key);
+}
+
+
+static pq_partition_list::iterator
+get_partition(lua_State *lua, pq_partitioned *pp, const string &key)
+{
+  auto idx = pp->index.find(key);
+  if (idx != pp->index.end()) {
+    pp->lru.splice(pp->lru.begin(), pp->lru, idx->second);
+    return pp->lru.begin();
+  }
+
+  if (pp->max_writers && pp->lru.size() >= pp->max_writers) {
+    finish_partition(lua, pp, --pp->lru.end());
+  }
+
+  string filename = pp->dir + "/" + key;
+  int props = 0;
+  if (pp->props_ref != LUA_NOREF) {
+    lua_rawgeti(lua, LUA_REGISTRYINDEX, pp->props_ref);
+    props = lua_gettop(lua);
+  }
+  shared_ptr<pq::OutputStream> sink(new pq::LocalFileOutputStream(filename));
+  pq_partition p = { key, create_writer(lua, sink, pp->node, props),
+    time(NULL), 0, 0 };
+  if (props) {
+    lua_pop(lua, 1);
+  }
+  pp->lru.push_front(p);
+  pp->index[key] = pp->lru.begin();
+  return pp->lru.begin();
+}
+
+
+// Row group, file size and memory budget checks after a successful dissection.
+static void update_partition(lua_State *lua, pq_partitioned *pp,
+                             pq_partition_list::iterator it)
+{
+  pq_writer *w = it->w;
+  it->records = w->num_records; // max_rowgroup_bytes may have flushed
+  if (it->records >= pp->max_rowgroup_size) {
+    it->records = 0;
+    try {
+      write_rowgroup(w);
+    } catch (...) {
+      clear_columns(w);
+      throw;
+    }
+    struct stat st;
+    string filename = pp->dir + "/" + it->key;
+    if (stat(filename.c_str(), &st) == 0
+        && static_cast<size_t>(st.st_size) >= pp->max_file_size) {
+      finish_partition(lua, pp, it);
+      return;
+    }
+  }
+
+  size_t bytes = buffered_bytes(w);
+  pp->bytes = pp->bytes - it->bytes + bytes;
+  it->bytes = bytes;
+  if (!pp->max_bytes) {return;}
+
+  while (pp->bytes > pp->max_bytes && pp->lru.size() > 1) {
+    finish_partition(lua, pp, --pp->lru.end());
+  }
+  if (pp->bytes > pp->max_bytes) {
+    try {
+      write_rowgroup(w);
+    } catch (...) {
+      clear_columns(w);
+      throw;
+    }
+    it->records = 0;
+    pp->bytes -= it->bytes;
+    it->bytes = 0;
+  }
+}
+
+
+static const lsb_heka_message* active_message(lua_State *lua)
+{
+  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_HEKA_THIS_PTR);
+  lsb_heka_sandbox *hsb =
+      static_cast<lsb_heka_sandbox *>(lua_touserdata(lua, -1));
+  lua_pop(lua, 1); // remove this ptr
+  if (!hsb) {
+    luaL_error(lua, "invalid " LSB_HEKA_THIS_PTR);
+  }
+  const lsb_heka_message *msg = lsb_heka_get_message(hsb);
+  if (!msg || !msg->raw.s) {
+    return nullptr;
+  }
+  return msg;
+}
+
+
+static pq_partitioned* check_partitioned(lua_State *lua)
+{
+  pq_partitioned_ud *ud = static_cast<pq_partitioned_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_partitioned));
+  if (!ud->p) {
+    luaL_error(lua, "writer closed");
+  }
+  return ud->p;
+}
+
+
+static void parse_dims(lua_State *lua, pq_partitioned *pp)
+{
+  size_t len = lua_objlen(lua, 2);
+  if (len == 0) {
+    throw pq::ParquetException("at least one dimension must be specified");
+  }
+  for (size_t i = 1; i <= len; ++i) {
+    lua_rawgeti(lua, 2, static_cast<int>(i));
+    if (lua_type(lua, -1) != LUA_TTABLE) {
+      throw pq::ParquetException("dimensions must be tables");
+    }
+    pq_dim d;
+    d.scaling_factor = 1e-9;
+
+    lua_getfield(lua, -1, "name");
+    const char *name = lua_tostring(lua, -1);
+    if (!name || !*name) {
+      throw pq::ParquetException("dimension name must be a string");
+    }
+    d.name = name;
+    lua_pop(lua, 1);
+
+    lua_getfield(lua, -1, "source");
+    switch (lua_type(lua, -1)) {
+    case LUA_TSTRING:
+      {
+        size_t slen;
+        const char *s = lua_tolstring(lua, -1, &slen);
+        if (slen > 8 && memcmp(s, LSB_FIELDS "[", 7) == 0 && s[slen - 1] == ']') {
+          d.source = DIM_FIELD;
+          d.field.assign(s + 7, slen - 8);
+        } else if (strcmp(s, LSB_UUID) == 0) {
+          d.source = DIM_UUID;
+        } else if (strcmp(s, LSB_TIMESTAMP) == 0) {
+          d.source = DIM_TIMESTAMP;
+        } else if (strcmp(s, LSB_TYPE) == 0) {
+          d.source = DIM_TYPE;
+        } else if (strcmp(s, LSB_LOGGER) == 0) {
+          d.source = DIM_LOGGER;
+        } else if (strcmp(s, LSB_SEVERITY) == 0) {
+          d.source = DIM_SEVERITY;
+        } else if (strcmp(s, LSB_PAYLOAD) == 0) {
+          d.source = DIM_PAYLOAD;
+        } else if (strcmp(s, LSB_ENV_VERSION) == 0) {
+          d.source = DIM_ENV_VERSION;
+        } else if (strcmp(s, LSB_PID) == 0) {
+          d.source = DIM_PID;
+        } else if (strcmp(s, LSB_HOSTNAME) == 0) {
+          d.source = DIM_HOSTNAME;
+        } else {
+          stringstream ss;
+          ss << "dimension '" << d.name << "' invalid source:" << s;
+          throw pq::ParquetException(ss.str());
+        }
+      }
+      break;
+    case LUA_TTABLE:
+      {
+        d.source = DIM_RECORD;
+        size_t plen = lua_objlen(lua, -1);
+        for (size_t j = 1; j <= plen; ++j) {
+          lua_rawgeti(lua, -1, static_cast<int>(j));
+          const char *s = lua_tostring(lua, -1);
+          if (!s) {
+            stringstream ss;
+            ss << "dimension '" << d.name << "' path must be strings";
+            throw pq::ParquetException(ss.str());
+          }
+          d.path.push_back(s);
+          lua_pop(lua, 1);
+        }
+        if (d.path.empty()) {
+          stringstream ss;
+          ss << "dimension '" << d.name << "' path cannot be empty";
+          throw pq::ParquetException(ss.str());
+        }
+      }
+      break;
+    default:
+      {
+        stringstream ss;
+        ss << "dimension '" << d.name << "' source must be a string or table";
+        throw pq::ParquetException(ss.str());
+      }
+    }
+    lua_pop(lua, 1);
+
+    lua_getfield(lua, -1, "dateformat");
+    if (lua_type(lua, -1) == LUA_TSTRING) {
+      d.dateformat = lua_tostring(lua, -1);
+    }
+    lua_pop(lua, 1);
+
+    lua_getfield(lua, -1, "scaling_factor");
+    if (lua_type(lua, -1) == LUA_TNUMBER) {
+      d.scaling_factor = lua_tonumber(lua, -1);
+    }
+    lua_pop(lua, 1);
+
+    pp->dims.push_back(d);
+    lua_pop(lua, 1); // dimension table
+  }
+}
+
+
+static size_t opt_size(lua_State *lua, const char *key, size_t dflt)
+{
+  lua_getfield(lua, 3, key);
+  if (lua_type(lua, -1) == LUA_TNUMBER) {
+    lua_Number n = lua_tonumber(lua, -1);
+    if (n < 0) {
+      stringstream ss;
+      ss << key << " must be >= 0";
+      throw pq::ParquetException(ss.str());
+    }
+    dflt = static_cast<size_t>(n);
+  }
+  lua_pop(lua, 1);
+  return dflt;
+}
+
+
+static string opt_string(lua_State *lua, const char *key, const string &dflt)
+{
+  string s = dflt;
+  lua_getfield(lua, 3, key);
+  if (lua_type(lua, -1) == LUA_TSTRING) {
+    s = lua_tostring(lua, -1);
+  }
+  lua_pop(lua, 1);
+  return s;
+}
+
+
+static int pq_new_partitioned(lua_State *lua)
+{
+  pq_node_ud *ud = static_cast<pq_node_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_schema));
+  luaL_argcheck(lua, ud->n->node, 1, "the schema has not been finalized");
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  luaL_checktype(lua, 3, LUA_TTABLE);
+  lua_settop(lua, 3);
+
+  pq_partitioned_ud *pud = static_cast<pq_partitioned_ud *>
+      (lua_newuserdata(lua, sizeof*pud));
+  pud->p = NULL;
+  luaL_getmetatable(lua, mozsvc_parquet_partitioned);
+  lua_setmetatable(lua, -2);
+
+  bool err = false;
+  try {
+    pq_partitioned *pp = new pq_partitioned;
+    pp->node = ud->n;
+    ++pp->node->ref_cnt;
+    pud->p = pp;
+
+    parse_dims(lua, pp);
+    pp->dir = opt_string(lua, "dir", "");
+    if (pp->dir.empty()) {
+      throw pq::ParquetException("dir must be specified");
+    }
+    pp->done_dir = opt_string(lua, "done_dir", pp->dir);
+    char hostname[256] = { 0 };
+    gethostname(hostname, sizeof(hostname) - 1);
+    pp->hostname = opt_string(lua, "hostname", hostname);
+    pp->default_nil = opt_string(lua, "default_nil", "UNKNOWN");
+    pp->max_writers = opt_size(lua, "max_writers", 100);
+    pp->max_bytes = opt_size(lua, "max_bytes", 0);
+    pp->max_rowgroup_size = opt_size(lua, "max_rowgroup_size", 10000);
+    if (pp->max_rowgroup_size == 0) {
+      pp->max_rowgroup_size = 1;
+    }
+    pp->max_file_size = opt_size(lua, "max_file_size", 1024 * 1024 * 300);
+    pp->max_file_age = static_cast<time_t>(opt_size(lua, "max_file_age", 60 * 60));
+
+    lua_getfield(lua, 3, "properties");
+    if (lua_type(lua, -1) == LUA_TTABLE) {
+      pp->props_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+    } else {
+      lua_pop(lua, 1);
+    }
+
+    lua_getfield(lua, 3, "callback");
+    if (lua_type(lua, -1) == LUA_TFUNCTION) {
+      pp->callback_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+    } else {
+      lua_pop(lua, 1);
+    }
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown partitioned writer creation error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 1;
+}
+
+
+static int pq_partitioned_dissect_message(lua_State *lua)
+{
+  pq_partitioned *pp = check_partitioned(lua);
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n == 1, n, "invalid number of arguments");
+  const lsb_heka_message *msg = active_message(lua);
+  if (!msg) {
+    return luaL_error(lua, "dissect_message() no active message");
+  }
+
+  bool err = false;
+  pq_writer *w = nullptr;
+  try {
+    auto it = get_partition(lua, pp, partition_key(lua, pp, msg, 0));
+    w = it->w;
+    dissect_message(w, msg);
+    w = nullptr;
+    update_partition(lua, pp, it);
+  } catch (exception &e) {
+    if (w) {rollback_record(w);}
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    if (w) {rollback_record(w);}
+    lua_pushstring(lua, "unknown dissect_message error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 0;
+}
+
+
+static int pq_partitioned_dissect(lua_State *lua)
+{
+  pq_partitioned *pp = check_partitioned(lua);
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  lua_settop(lua, 2);
+  const lsb_heka_message *msg = active_message(lua);
+
+  bool err = false;
+  pq_writer *w = nullptr;
+  try {
+    for (size_t i = 0; i < pp->dims.size(); ++i) {
+      if (pp->dims[i].source != DIM_RECORD && !msg) {
+        throw pq::ParquetException("dissect_record() no active message for the "
+                                   "message dimensions");
+      }
+    }
+    auto it = get_partition(lua, pp, partition_key(lua, pp, msg, 2));
+    w = it->w;
+    poll_rowgroup(w);
+    dissect_record(w, lua, w->node, 0, 0);
+    ++w->num_records;
+    check_rowgroup_size(w);
+    w = nullptr;
+    update_partition(lua, pp, it);
+  } catch (exception &e) {
+    if (w) {rollback_record(w);}
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    if (w) {rollback_record(w);}
+    lua_pushstring(lua, "unknown dissect_record error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 0;
+}
+
+
+static int pq_partitioned_rotate(lua_State *lua)
+{
+  pq_partitioned *pp = check_partitioned(lua);
+  bool all = lua_toboolean(lua, 2);
+
+  bool err = false;
+  int cnt = 0;
+  try {
+    time_t t = time(NULL);
+    auto it = pp->lru.begin();
+    while (it != pp->lru.end()) {
+      auto cur = it++;
+      if (all || t - cur->created >= pp->max_file_age) {
+        finish_partition(lua, pp, cur);
+        ++cnt;
+      }
+    }
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown rotate error");
+    err = true;
+  }
+  if (err) {
+    return lua_error(lua);
+  }
+  lua_pushinteger(lua, cnt);
+  return 1;
+}
+
+
+static int pq_partitioned_stats(lua_State *lua)
+{
+  pq_partitioned *pp = check_partitioned(lua);
+  lua_pushinteger(lua, static_cast<lua_Integer>(pp->lru.size()));
+  lua_pushnumber(lua, static_cast<lua_Number>(pp->bytes));
+  return 2;
+}
+
+
+static void free_partitioned(lua_State *lua, pq_partitioned *pp)
+{
+  for (auto it = pp->lru.begin(); it != pp->lru.end(); ++it) {
+    try {
+      write_rowgroup(it->w);
+      wait_rowgroup(it->w);
+    } catch (...) {
+      clear_columns(it->w);
+    }
+    try {
+      writer_close(it->w);
+    } catch (...) {}
+    free_writer(it->w);
+  }
+  luaL_unref(lua, LUA_REGISTRYINDEX, pp->props_ref);
+  luaL_unref(lua, LUA_REGISTRYINDEX, pp->callback_ref);
+  if (--pp->node->ref_cnt == 0) {
+    free_children(pp->node);
+  }
+  delete pp;
+}
+
+
+static int pq_partitioned_close(lua_State *lua)
+{
+  pq_partitioned_ud *ud = static_cast<pq_partitioned_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_partitioned));
+  if (!ud->p) {return 0;}
+
+  bool err = false;
+  try {
+    while (!ud->p->lru.empty()) {
+      finish_partition(lua, ud->p, ud->p->lru.begin());
+    }
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown close error");
+    err = true;
+  }
+  if (!err) {
+    free_partitioned(lua, ud->p);
+    ud->p = NULL;
+  }
+  return err ? lua_error(lua) : 0;
+}
+
+
+static int pq_partitioned_gc(lua_State *lua)
+{
+  pq_partitioned_ud *ud = static_cast<pq_partitioned_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_partitioned));
+  if (!ud->p) {return 0;}
+  // unfinished files are left in dir
+  free_partitioned(lua, ud->p);
+  ud->p = NULL;
+  return 0;
+}
+
+
+static const struct luaL_reg pq_partitionedlib_m[] = {
+  { "dissect_message", pq_partitioned_dissect_message },
+  { "dissect_record", pq_partitioned_dissect },
+  { "rotate", pq_partitioned_rotate },
+  { "stats", pq_partitioned_stats },
+  { "close", pq_partitioned_close },
+  { "__gc", pq_partitioned_gc },
+  { NULL, NULL }
+};
+#endif
+
+
+static const int pq_read_batch = 1024;
+static const char *heka_headers[] = { "Uuid", "Timestamp", "Type", "Logger",
+  "Severity", "Payload", "EnvVersion", "Pid", "Hostname", NULL };
+static const char *predicate_ops[] = { "==", "~=", "<", "<=", ">", ">=", NULL };
+enum pq_predicate_op { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+
+
+// One node on the path from the schema root to a leaf column
+typedef struct pq_read_step
+{
+  string  name;
+  int16_t r;
+  int16_t d;
+  bool    repeated;
+  bool    collapse; // repeated child of a LIST/MAP group, the elements are
+                    // stored directly in the group table
+  bool    slot;     // LIST element, stored directly in the list slot
+} pq_read_step;
+
+
+typedef struct pq_read_column
+{
+  string                path;
+  size_t                leaf;
+  pq::Type::type        type;
+  int                   type_length;
+  int16_t               max_r;
+  int16_t               max_d;
+  bool                  projected; // false for predicate only columns
+  vector<pq_read_step>  steps;
+  vector<size_t>        idx; // current element index of each repeated step
+
+  // read_message mapping: the table key of the first step, or the path below
+  // the Fields table
+  string  msg_key;
+  bool    msg_fields;
+  size_t  msg_skip;
+
+  shared_ptr<pq::ColumnReader> reader;
+  vector<int16_t> dlevels;
+  vector<int16_t> rlevels;
+  size_t          levels;
+  size_t          pos;  // next level entry
+  size_t          vpos; // next value
+
+  // only the vector matching the physical type is used; BYTE_ARRAY/FLBA
+  // values point into the column reader page and are only valid until the
+  // next batch is read
+  vector<uint8_t>       b;
+  vector<int32_t>       i32;
+  vector<int64_t>       i64;
+  vector<pq::Int96>     i96;
+  vector<float>         f;
+  vector<double>        d;
+  vector<pq::ByteArray> ba;
+  vector<pq::FLBA>      flba;
+
+  pq_read_column() : leaf(0), type(pq::Type::BOOLEAN), type_length(0), max_r(0),
+      max_d(0), projected(true), msg_fields(false), msg_skip(0), levels(0),
+      pos(0), vpos(0) { }
+} pq_read_column;
+
+
+typedef struct pq_predicate
+{
+  size_t          column;
+  pq_predicate_op op;
+  double          num; // numeric and boolean columns
+  string          str; // binary columns
+} pq_predicate;
+
+
+typedef struct pq_reader
+{
+  unique_ptr<pq::ParquetFileReader> reader;
+  const pq::schema::GroupNode       *root;
+  bool                              has_map;
+  vector<pq_read_column>            columns;
+  vector<pq_predicate>              predicates;
+  shared_ptr<pq::RowGroupReader>    rg;
+  int                               num_rowgroups;
+  int                               next_rowgroup;
+  int                               skipped;
+  int64_t                           rows_left; // in the current row group
+  size_t                            records;
+
+  pq_reader() : root(nullptr), has_map(false), num_rowgroups(0),
+      next_rowgroup(0), skipped(0), rows_left(0), records(0) { }
+} pq_reader;
+
+
+typedef struct pq_reader_ud
+{
+  pq_reader *r;
+} pq_reader_ud;
+
+
+static bool is_selected(const string &path, const vector<string> &columns)
+{
+  if (columns.empty()) {return true;}
+
+  size_t len = columns.size();
+  for (size_t i = 0; i < len; ++i) {
+    const string &c = columns[i];
+    if (path == c || (path.size() > c.size() && path.compare(0, c.size(), c) == 0
+                      && path[c.size()] == '.')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static void set_message_mapping(pq_read_column &c)
+{
+  const string &top = c.steps[0].name;
+  if (c.steps.size() == 1) {
+    for (int i = 0; heka_headers[i]; ++i) {
+      if (top == heka_headers[i] || top == hive_name(heka_headers[i])) {
+        c.msg_key = heka_headers[i];
+        return;
+      }
+    }
+  }
+
+  c.msg_fields = true;
+  if (c.steps.size() > 1 && (top == "Fields" || top == "fields")) {
+    c.msg_skip = 1;
+  }
+  c.msg_key = c.steps[c.msg_skip].name;
+}
+
+
+static void add_read_columns(pq_reader *pr, const pq::schema::GroupNode *n,
+                             pq::LogicalType::type parent_lt,
+                             vector<pq_read_step> &steps, const string &path,
+                             const vector<string> &selected,
+                             const vector<string> &filtered, size_t &leaf)
+{
+  auto lt = n->logical_type();
+  bool list_parent = !steps.empty() && steps.back().collapse
+      && parent_lt == pq::LogicalType::LIST && n->field_count() == 1;
+  int16_t r = steps.empty() ? 0 : steps.back().r;
+  int16_t d = steps.empty() ? 0 : steps.back().d;
+
+  int len = n->field_count();
+  for (int i = 0; i < len; ++i) {
+    const pq::schema::Node *cn = n->field(i).get();
+    pq_read_step s;
+    s.name = cn->name();
+    s.repeated = cn->is_repeated();
+    s.r = s.repeated ? r + 1 : r;
+    s.d = cn->is_required() ? d : d + 1;
+    s.collapse = s.repeated && (lt == pq::LogicalType::LIST || lt == pq::LogicalType::MAP);
+    s.slot = list_parent && !s.repeated;
+    steps.push_back(s);
+
+    string cpath = path.empty() ? s.name : path + "." + s.name;
+    if (cn->is_group()) {
+      if (cn->logical_type() == pq::LogicalType::MAP) {
+        pr->has_map = true;
+      }
+      add_read_columns(pr, static_cast<const pq::schema::GroupNode *>(cn), lt,
+                       steps, cpath, selected, filtered, leaf);
+    } else {
+      bool projected = is_selected(cpath, selected);
+      if (projected || find(filtered.begin(), filtered.end(), cpath) != filtered.end()) {
+        const pq::ColumnDescriptor *cd = pr->reader->metadata()->schema()->Column(leaf);
+        pr->columns.push_back(pq_read_column());
+        pq_read_column &c = pr->columns.back();
+        c.path = cpath;
+        c.leaf = leaf;
+        c.type = cd->physical_type();
+        c.type_length = cd->type_length();
+        c.max_r = cd->max_repetition_level();
+        c.max_d = cd->max_definition_level();
+        c.projected = projected;
+        c.steps = steps;
+        c.idx.resize(steps.size(), 0);
+        set_message_mapping(c);
+      }
+      ++leaf;
+    }
+    steps.pop_back();
+  }
+}
+
+
+template<typename DType>
+static int64_t read_batch(pq_read_column &c, typename DType::c_type *values)
+{
+  int64_t values_read = 0;
+  auto cr = static_cast<pq::TypedColumnReader<DType> *>(c.reader.get());
+  return cr->ReadBatch(pq_read_batch, c.dlevels.data(), c.rlevels.data(),
+                       values, &values_read);
+}
+
+
+static void start_column(pq_reader *pr, pq_read_column &c)
+{
+  c.reader = pr->rg->Column(static_cast<int>(c.leaf));
+  c.levels = c.pos = c.vpos = 0;
+  if (c.dlevels.empty()) {
+    c.dlevels.resize(pq_read_batch);
+    c.rlevels.resize(pq_read_batch);
+    switch (c.type) {
+    case pq::Type::BOOLEAN:
+      c.b.resize(pq_read_batch);
+      break;
+    case pq::Type::INT32:
+      c.i32.resize(pq_read_batch);
+      break;
+    case pq::Type::INT64:
+      c.i64.resize(pq_read_batch);
+      break;
+    case pq::Type::INT96:
+      c.i96.resize(pq_read_batch);
+      break;
+    case pq::Type::FLOAT:
+      c.f.resize(pq_read_batch);
+      break;
+    case pq::Type::DOUBLE:
+      c.d.resize(pq_read_batch);
+      break;
+    case pq::Type::BYTE_ARRAY:
+      c.ba.resize(pq_read_batch);
+      break;
+    case pq::Type::FIXED_LEN_BYTE_ARRAY:
+      c.flba.resize(pq_read_batch);
+      break;
+    }
+  }
+}
+
+
+// Makes sure c.pos references a level entry, returns false at the end of the
+// row group
+static bool fill_column(pq_read_column &c)
+{
+  if (c.pos < c.levels) {return true;}
+
+  c.levels = c.pos = c.vpos = 0;
+  while (c.levels == 0 && c.reader->HasNext()) {
+    int64_t n = 0;
+    switch (c.type) {
+    case pq::Type::BOOLEAN:
+      n = read_batch<pq::BooleanType>(c, reinterpret_cast<bool *>(c.b.data()));
+      break;
+    case pq::Type::INT32:
+      n = read_batch<pq::Int32Type>(c, c.i32.data());
+      break;
+    case pq::Type::INT64:
+      n = read_batch<pq::Int64Type>(c, c.i64.data());
+      break;
+    case pq::Type::INT96:
+      n = read_batch<pq::Int96Type>(c, c.i96.data());
+      break;
+    case pq::Type::FLOAT:
+      n = read_batch<pq::FloatType>(c, c.f.data());
+      break;
+    case pq::Type::DOUBLE:
+      n = read_batch<pq::DoubleType>(c, c.d.data());
+      break;
+    case pq::Type::BYTE_ARRAY:
+      n = read_batch<pq::ByteArrayType>(c, c.ba.data());
+      break;
+    case pq::Type::FIXED_LEN_BYTE_ARRAY:
+      n = read_batch<pq::FLBAType>(c, c.flba.data());
+      break;
+    }
+    c.levels = static_cast<size_t>(n);
+  }
+  return c.levels > 0;
+}
+
+
+static void push_read_value(lua_State *lua, const pq_read_column &c)
+{
+  size_t i = c.vpos;
+  switch (c.type) {
+  case pq::Type::BOOLEAN:
+    lua_pushboolean(lua, c.b[i]);
+    break;
+  case pq::Type::INT32:
+    lua_pushnumber(lua, c.i32[i]);
+    break;
+  case pq::Type::INT64:
+    lua_pushnumber(lua, static_cast<lua_Number>(c.i64[i]));
+    break;
+  case pq::Type::INT96:
+    lua_pushlstring(lua, reinterpret_cast<const char *>(&c.i96[i]), sizeof(pq::Int96));
+    break;
+  case pq::Type::FLOAT:
+    lua_pushnumber(lua, c.f[i]);
+    break;
+  case pq::Type::DOUBLE:
+    lua_pushnumber(lua, c.d[i]);
+    break;
+  case pq::Type::BYTE_ARRAY:
+    lua_pushlstring(lua, reinterpret_cast<const char *>(c.ba[i].ptr), c.ba[i].len);
+    break;
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    lua_pushlstring(lua, reinterpret_cast<const char *>(c.flba[i].ptr), c.type_length);
+    break;
+  }
+}
+
+
+static int compare_number(double a, double b)
+{
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+
+static int compare_bytes(const uint8_t *a, size_t alen, const string &b)
+{
+  int rv = memcmp(a, b.data(), alen < b.size() ? alen : b.size());
+  if (rv == 0) {
+    return alen < b.size() ? -1 : (alen > b.size() ? 1 : 0);
+  }
+  return rv < 0 ? -1 : 1;
+}
+
+
+static bool test_predicate(pq_predicate_op op, int cmp)
+{
+  switch (op) {
+  case OP_EQ:
+    return cmp == 0;
+  case OP_NE:
+    return cmp != 0;
+  case OP_LT:
+    return cmp < 0;
+  case OP_LE:
+    return cmp <= 0;
+  case OP_GT:
+    return cmp > 0;
+  case OP_GE:
+    return cmp >= 0;
+  }
+  return false;
+}
+
+
+// Compares the current value of a flat column to the predicate value, null
+// values never match
+static bool match_predicate(const pq_predicate &p, const pq_read_column &c)
+{
+  int16_t d = c.max_d ? c.dlevels[c.pos] : 0;
+  if (d < c.max_d) {return false;}
+
+  size_t i = c.vpos;
+  int cmp = 0;
+  switch (c.type) {
+  case pq::Type::BOOLEAN:
+    cmp = compare_number(c.b[i] ? 1 : 0, p.num);
+    break;
+  case pq::Type::INT32:
+    cmp = compare_number(c.i32[i], p.num);
+    break;
+  case pq::Type::INT64:
+    cmp = compare_number(static_cast<double>(c.i64[i]), p.num);
+    break;
+  case pq::Type::FLOAT:
+    cmp = compare_number(c.f[i], p.num);
+    break;
+  case pq::Type::DOUBLE:
+    cmp = compare_number(c.d[i], p.num);
+    break;
+  case pq::Type::BYTE_ARRAY:
+    cmp = compare_bytes(c.ba[i].ptr, c.ba[i].len, p.str);
+    break;
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    cmp = compare_bytes(c.flba[i].ptr, c.type_length, p.str);
+    break;
+  default:
+    return false;
+  }
+  return test_predicate(p.op, cmp);
+}
+
+
+// cmin/cmax are the comparisons of the predicate value to the row group
+// min/max statistics
+static bool excludes_range(pq_predicate_op op, int cmin, int cmax)
+{
+  switch (op) {
+  case OP_EQ:
+    return cmin < 0 || cmax > 0;
+  case OP_NE:
+    return cmin == 0 && cmax == 0;
+  case OP_LT:
+    return cmin <= 0;
+  case OP_LE:
+    return cmin < 0;
+  case OP_GT:
+    return cmax >= 0;
+  case OP_GE:
+    return cmax > 0;
+  }
+  return false;
+}
+
+
+template<typename DType>
+static const pq::TypedRowGroupStatistics<DType>*
+typed_stats(const shared_ptr<pq::RowGroupStatistics> &stats)
+{
+  auto ts = static_cast<const pq::TypedRowGroupStatistics<DType> *>(stats.get());
+  return ts->HasMinMax() ? ts : nullptr;
+}
+
+
+static bool skip_rowgroup(pq_reader *pr)
+{
+  auto rgm = pr->rg->metadata();
+  size_t len = pr->predicates.size();
+  for (size_t i = 0; i < len; ++i) {
+    const pq_predicate &p = pr->predicates[i];
+    const pq_read_column &c = pr->columns[p.column];
+    auto ccm = rgm->ColumnChunk(static_cast<int>(c.leaf));
+    if (!ccm->is_stats_set()) {continue;}
+
+    shared_ptr<pq::RowGroupStatistics> stats = ccm->statistics();
+    if (stats->null_count() == rgm->num_rows()) {
+      return true;
+    }
+
+    int cmin = 0;
+    int cmax = 0;
+    switch (c.type) {
+    case pq::Type::BOOLEAN:
+      {
+        auto ts = typed_stats<pq::BooleanType>(stats);
+        if (!ts) {continue;}
+        cmin = compare_number(p.num, ts->min() ? 1 : 0);
+        cmax = compare_number(p.num, ts->max() ? 1 : 0);
+      }
+      break;
+    case pq::Type::INT32:
+      {
+        auto ts = typed_stats<pq::Int32Type>(stats);
+        if (!ts) {continue;}
+        cmin = compare_number(p.num, ts->min());
+        cmax = compare_number(p.num, ts->max());
+      }
+      break;
+    case pq::Type::INT64:
+      {
+        auto ts = typed_stats<pq::Int64Type>(stats);
+        if (!ts) {continue;}
+        cmin = compare_number(p.num, static_cast<double>(ts->min()));
+        cmax = compare_number(p.num, static_cast<double>(ts->max()));
+      }
+      break;
+    case pq::Type::FLOAT:
+      {
+        auto ts = typed_stats<pq::FloatType>(stats);
+        if (!ts) {continue;}
+        cmin = compare_number(p.num, ts->min());
+        cmax = compare_number(p.num, ts->max());
+      }
+      break;
+    case pq::Type::DOUBLE:
+      {
+        auto ts = typed_stats<pq::DoubleType>(stats);
+        if (!ts) {continue;}
+        cmin = compare_number(p.num, ts->min());
+        cmax = compare_number(p.num, ts->max());
+      }
+      break;
+    default: // parquet-cpp computes the byte array min/max with a signed
+             // comparison so they cannot bound an unsigned one
+      continue;
+    }
+    if (excludes_range(p.op, cmin, cmax)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static bool next_rowgroup(pq_reader *pr)
+{
+  while (pr->next_rowgroup < pr->num_rowgroups) {
+    pr->rg = pr->reader->RowGroup(pr->next_rowgroup++);
+    if (skip_rowgroup(pr)) {
+      ++pr->skipped;
+      continue;
+    }
+    pr->rows_left = pr->rg->metadata()->num_rows();
+    if (pr->rows_left == 0) {continue;}
+
+    size_t len = pr->columns.size();
+    for (size_t i = 0; i < len; ++i) {
+      start_column(pr, pr->columns[i]);
+    }
+    return true;
+  }
+  pr->rg = nullptr;
+  return false;
+}
+
+
+// Pushes the table stored at key/ikey of the table on the top of the stack,
+// creating it if necessary
+static void push_child_table(lua_State *lua, const char *key, int ikey)
+{
+  lua_checkstack(lua, 3);
+  if (key) {
+    lua_getfield(lua, -1, key);
+  } else {
+    lua_rawgeti(lua, -1, ikey);
+  }
+  if (lua_type(lua, -1) != LUA_TTABLE) {
+    lua_pop(lua, 1);
+    lua_newtable(lua);
+    lua_pushvalue(lua, -1);
+    if (key) {
+      lua_setfield(lua, -3, key);
+    } else {
+      lua_rawseti(lua, -3, ikey);
+    }
+  }
+}
+
+
+// Places a single level entry into the record table at index rec
+static void assemble_value(lua_State *lua, pq_read_column &c, int rec,
+                           int16_t r, int16_t d, bool message)
+{
+  size_t len = c.steps.size();
+  for (size_t i = 0; i < len; ++i) {
+    const pq_read_step &s = c.steps[i];
+    if (s.repeated && r <= s.r) {
+      c.idx[i] = r < s.r ? 1 : c.idx[i] + 1;
+    }
+  }
+
+  int top = lua_gettop(lua);
+  lua_pushvalue(lua, rec);
+  size_t start = 0;
+  const char *key = c.steps[0].name.c_str();
+  int ikey = 0;
+  if (message) {
+    if (c.msg_fields) {
+      if (c.msg_skip && d < c.steps[0].d) {
+        lua_settop(lua, top);
+        return;
+      }
+      push_child_table(lua, "Fields", 0);
+      start = c.msg_skip;
+    }
+    key = c.msg_key.c_str();
+  }
+
+  for (size_t i = start; i < len; ++i) {
+    const pq_read_step &s = c.steps[i];
+    if (d < s.d) {
+      if (s.repeated && !s.collapse && d == s.d - 1) {
+        push_child_table(lua, key, ikey); // empty array
+      }
+      break;
+    }
+    if (s.repeated) {
+      if (!s.collapse) {
+        push_child_table(lua, key, ikey);
+      }
+      key = nullptr;
+      ikey = static_cast<int>(c.idx[i]);
+    }
+    if (i + 1 == len) {
+      push_read_value(lua, c);
+      if (key) {
+        lua_setfield(lua, -2, key);
+      } else {
+        lua_rawseti(lua, -2, ikey);
+      }
+      break;
+    }
+    const pq_read_step &ns = c.steps[i + 1];
+    if (!ns.slot) {
+      push_child_table(lua, key, ikey);
+      key = ns.name.c_str();
+      ikey = 0;
+    }
+  }
+  lua_settop(lua, top);
+}
+
+
+// Consumes all level entries of the current record, rec == 0 skips them
+static void read_column_record(lua_State *lua, pq_read_column &c, int rec,
+                               bool message)
+{
+  bool first = true;
+  while (fill_column(c)) {
+    int16_t r = c.max_r ? c.rlevels[c.pos] : 0;
+    if (!first && r == 0) {break;}
+    first = false;
+
+    int16_t d = c.max_d ? c.dlevels[c.pos] : 0;
+    if (rec && c.projected) {
+      assemble_value(lua, c, rec, r, d, message);
+    }
+    if (d == c.max_d) {++c.vpos;}
+    ++c.pos;
+  }
+
+  if (first) {
+    stringstream ss;
+    ss << "column '" << c.path << "' ended before the row group";
+    throw pq::ParquetException(ss.str());
+  }
+}
+
+
+static void fixup_field(lua_State *lua, const pq::schema::Node *n);
+
+// MAP groups are assembled as arrays of key/value tables, this converts them
+// to key/value pairs to match what dissect_record accepts. Groups not written in
+// the standard MAP/LIST layout (e.g. a legacy two level list or a MAP without a
+// value) are left as they were assembled.
+static void fixup_maps(lua_State *lua, const pq::schema::Node *n)
+{
+  if (!n->is_group() || lua_type(lua, -1) != LUA_TTABLE) {return;}
+
+  lua_checkstack(lua, 4);
+  auto g = static_cast<const pq::schema::GroupNode *>(n);
+  auto lt = g->logical_type();
+  const pq::schema::GroupNode *rg = nullptr; // repeated key_value/list group
+  if (g->field_count() == 1 && g->field(0)->is_group()) {
+    rg = static_cast<const pq::schema::GroupNode *>(g->field(0).get());
+  }
+
+  if (lt == pq::LogicalType::MAP && rg && rg->field_count() == 2) {
+    const pq::schema::Node *vn = rg->field(1).get();
+    lua_newtable(lua);
+    size_t len = lua_objlen(lua, -2);
+    for (size_t i = 1; i <= len; ++i) {
+      lua_rawgeti(lua, -2, i);
+      if (lua_type(lua, -1) == LUA_TTABLE) {
+        lua_getfield(lua, -1, "key");
+        if (!lua_isnil(lua, -1)) {
+          lua_getfield(lua, -2, "value");
+          fixup_maps(lua, vn);
+          lua_settable(lua, -4);
+        } else {
+          lua_pop(lua, 1);
+        }
+      }
+      lua_pop(lua, 1);
+    }
+    lua_replace(lua, -2);
+  } else if (lt == pq::LogicalType::LIST && g->field_count() == 1) {
+    // a two level list repeats the element itself
+    const pq::schema::Node *en = g->field(0).get();
+    if (rg && rg->field_count() == 1) {
+      en = rg->field(0).get();
+    }
+    if (!en->is_group()) {return;}
+    size_t len = lua_objlen(lua, -1);
+    for (size_t i = 1; i <= len; ++i) {
+      lua_rawgeti(lua, -1, i);
+      fixup_maps(lua, en);
+      lua_rawseti(lua, -2, i);
+    }
+  } else {
+    int len = g->field_count();
+    for (int i = 0; i < len; ++i) {
+      fixup_field(lua, g->field(i).get());
+    }
+  }
+}
+
+
+static void fixup_field(lua_State *lua, const pq::schema::Node *n)
+{
+  if (!n->is_group()) {return;}
+
+  lua_getfield(lua, -1, n->name().c_str());
+  if (n->is_repeated() && lua_type(lua, -1) == LUA_TTABLE) {
+    size_t len = lua_objlen(lua, -1);
+    for (size_t i = 1; i <= len; ++i) {
+      lua_rawgeti(lua, -1, i);
+      fixup_maps(lua, n);
+      lua_rawseti(lua, -2, i);
+    }
+    lua_pop(lua, 1);
+  } else if (!lua_isnil(lua, -1)) {
+    fixup_maps(lua, n);
+    lua_setfield(lua, -2, n->name().c_str());
+  } else {
+    lua_pop(lua, 1);
+  }
+}
 
-        if (cn->name == LSB_UUID) {
-          add_string(c, msg->uuid.s, msg->uuid.len, cn->rl, cn->dl);
-        } else if (cn->name == LSB_TIMESTAMP) {
-          add_integer(c, msg->timestamp, cn->rl, cn->dl);
-        } else if (cn->name == LSB_TYPE) {
-          if (msg->type.s) {
-            add_string(c, msg->type.s, msg->type.len, cn->rl, cn->dl);
-          } else {
-            add_null(c, 0, 0);
-          }
-        } else if (cn->name == LSB_LOGGER) {
-          if (msg->logger.s) {
-            add_string(c, msg->logger.s, msg->logger.len, cn->rl, cn->dl);
-          } else {
-            add_null(c, 0, 0);
-          }
-        } else if (cn->name == LSB_SEVERITY) {
-          add_integer(c, msg->severity, cn->rl, cn->dl);
-        } else if (cn->name == LSB_PAYLOAD) {
-          if (msg->payload.s) {
-            add_string(c, msg->payload.s, msg->payload.len, cn->rl, cn->dl);
-          } else {
-            add_null(c, 0, 0);
-          }
-        } else if (cn->name == LSB_ENV_VERSION) {
-          if (msg->env_version.s) {
-            add_string(c, msg->env_version.s, msg->env_version.len, cn->rl, cn->dl);
-          } else {
-            add_null(c, 0, 0);
-          }
-        } else if (cn->name == LSB_PID) {
-          if (msg->pid == INT_MIN) {
-            add_null(c, 0, 0);
-          } else {
-            add_integer(c, msg->pid, cn->rl, cn->dl);
-          }
-        } else if (cn->name == LSB_HOSTNAME) {
-          if (msg->hostname.s) {
-            add_string(c, msg->hostname.s, msg->hostname.len, cn->rl, cn->dl);
-          } else {
-            add_null(c, 0, 0);
-          }
+
+// read_message moves the top level columns into the Fields table
+static void fixup_message_maps(lua_State *lua, pq_reader *pr)
+{
+  lua_getfield(lua, -1, "Fields");
+  if (lua_type(lua, -1) == LUA_TTABLE) {
+    int len = pr->root->field_count();
+    for (int i = 0; i < len; ++i) {
+      const pq::schema::Node *cn = pr->root->field(i).get();
+      if (cn->name() == "Fields" || cn->name() == "fields") {
+        fixup_maps(lua, cn);
+        lua_pushvalue(lua, -1);
+        lua_setfield(lua, -3, "Fields");
+      } else {
+        fixup_field(lua, cn);
+      }
+    }
+  }
+  lua_pop(lua, 1);
+}
+
+
+// Pushes the next matching record, returns false when the file is exhausted
+static bool read_record(lua_State *lua, pq_reader *pr, bool message)
+{
+  size_t len = pr->columns.size();
+  size_t plen = pr->predicates.size();
+  for (;;) {
+    if (pr->rows_left == 0 && !next_rowgroup(pr)) {
+      return false;
+    }
+
+    bool match = true;
+    for (size_t i = 0; i < plen && match; ++i) {
+      const pq_predicate &p = pr->predicates[i];
+      pq_read_column &c = pr->columns[p.column];
+      if (!fill_column(c)) {
+        stringstream ss;
+        ss << "column '" << c.path << "' ended before the row group";
+        throw pq::ParquetException(ss.str());
+      }
+      match = match_predicate(p, c);
+    }
+
+    int rec = 0;
+    if (match) {
+      lua_newtable(lua);
+      rec = lua_gettop(lua);
+    }
+    for (size_t i = 0; i < len; ++i) {
+      read_column_record(lua, pr->columns[i], rec, message);
+    }
+    --pr->rows_left;
+
+    if (match) {
+      if (pr->has_map) {
+        if (message) {
+          fixup_message_maps(lua, pr);
         } else {
-          stringstream ss;
-          ss << "column '" << cn->name << "' invalid schema";
-          throw pq::ParquetException(ss.str());
+          fixup_maps(lua, pr->root);
         }
-      } else if (cn->name == LSB_FIELDS && !cn->node->is_repeated()) {
-        dissect_fields(pw->w, msg, cn);
-      } else {
+      }
+      ++pr->records;
+      return true;
+    }
+  }
+}
+
+
+static void parse_predicates(lua_State *lua, int idx, vector<string> &paths)
+{
+  size_t len = lua_objlen(lua, idx);
+  for (size_t i = 1; i <= len; ++i) {
+    lua_rawgeti(lua, idx, i);
+    if (lua_type(lua, -1) != LUA_TTABLE) {
+      throw pq::ParquetException("predicate must be an array of {column, op, value} tables");
+    }
+    lua_rawgeti(lua, -1, 1);
+    const char *path = lua_tostring(lua, -1);
+    if (!path) {
+      throw pq::ParquetException("predicate column must be a string");
+    }
+    paths.push_back(path);
+    lua_pop(lua, 2);
+  }
+}
+
+
+static void setup_predicates(lua_State *lua, pq_reader *pr, int idx,
+                             const vector<string> &paths)
+{
+  size_t len = paths.size();
+  size_t clen = pr->columns.size();
+  for (size_t i = 0; i < len; ++i) {
+    pq_predicate p;
+    p.num = 0;
+    p.column = clen;
+    for (size_t j = 0; j < clen; ++j) {
+      if (pr->columns[j].path == paths[i]) {
+        p.column = j;
+        break;
+      }
+    }
+    if (p.column == clen) {
+      stringstream ss;
+      ss << "predicate column not found:" << paths[i];
+      throw pq::ParquetException(ss.str());
+    }
+    const pq_read_column &c = pr->columns[p.column];
+    if (c.max_r > 0 || c.type == pq::Type::INT96) {
+      stringstream ss;
+      ss << "predicate column must be a non repeated, non int96 primitive:" << paths[i];
+      throw pq::ParquetException(ss.str());
+    }
+
+    lua_rawgeti(lua, idx, i + 1);
+    lua_rawgeti(lua, -1, 2);
+    const char *op = lua_tostring(lua, -1);
+    int o = 0;
+    for (; op && predicate_ops[o]; ++o) {
+      if (strcmp(op, predicate_ops[o]) == 0) {break;}
+    }
+    if (!op || !predicate_ops[o]) {
+      stringstream ss;
+      ss << "predicate invalid operator:" << (op ? op : "nil");
+      throw pq::ParquetException(ss.str());
+    }
+    p.op = static_cast<pq_predicate_op>(o);
+    lua_pop(lua, 1);
+
+    lua_rawgeti(lua, -1, 3);
+    int t = lua_type(lua, -1);
+    bool valid = false;
+    switch (c.type) {
+    case pq::Type::BOOLEAN:
+      valid = t == LUA_TBOOLEAN;
+      p.num = lua_toboolean(lua, -1) ? 1 : 0;
+      break;
+    case pq::Type::BYTE_ARRAY:
+    case pq::Type::FIXED_LEN_BYTE_ARRAY:
+      valid = t == LUA_TSTRING;
+      if (valid) {
+        size_t slen;
+        const char *s = lua_tolstring(lua, -1, &slen);
+        p.str.assign(s, slen);
+      }
+      break;
+    default:
+      valid = t == LUA_TNUMBER;
+      p.num = lua_tonumber(lua, -1);
+      break;
+    }
+    lua_pop(lua, 2);
+    if (!valid) {
+      stringstream ss;
+      ss << "predicate value type mismatch:" << paths[i];
+      throw pq::ParquetException(ss.str());
+    }
+    pr->predicates.push_back(p);
+  }
+}
+
+
+static int pq_new_reader(lua_State *lua)
+{
+  size_t len;
+  const char *name = luaL_checklstring(lua, 1, &len);
+  luaL_argcheck(lua, len > 0, 1, "filename cannot be empty");
+
+  int t = lua_type(lua, 2);
+  luaL_argcheck(lua, t == LUA_TTABLE || t == LUA_TNONE || t == LUA_TNIL, 2,
+                "columns must be a table");
+  int pt = lua_type(lua, 3);
+  luaL_argcheck(lua, pt == LUA_TTABLE || pt == LUA_TNONE || pt == LUA_TNIL, 3,
+                "predicate must be a table");
+
+  pq_reader_ud *ud = static_cast<pq_reader_ud *>(lua_newuserdata(lua, sizeof*ud));
+  ud->r = NULL;
+  luaL_getmetatable(lua, mozsvc_parquet_reader);
+  lua_setmetatable(lua, -2);
+
+  bool err = false;
+  try {
+    vector<string> selected;
+    if (t == LUA_TTABLE) {
+      size_t clen = lua_objlen(lua, 2);
+      for (size_t i = 1; i <= clen; ++i) {
+        lua_rawgeti(lua, 2, i);
+        const char *c = lua_tostring(lua, -1);
+        if (!c) {
+          throw pq::ParquetException("columns must be an array of column paths");
+        }
+        selected.push_back(c);
+        lua_pop(lua, 1);
+      }
+    }
+    vector<string> filtered;
+    if (pt == LUA_TTABLE) {
+      parse_predicates(lua, 3, filtered);
+    }
+
+    ud->r = new pq_reader;
+    pq_reader *pr = ud->r;
+    pr->reader = pq::ParquetFileReader::OpenFile(name);
+    pr->num_rowgroups = pr->reader->metadata()->num_row_groups();
+    pr->root = pr->reader->metadata()->schema()->group_node();
+
+    vector<pq_read_step> steps;
+    size_t leaf = 0;
+    add_read_columns(pr, pr->root, pq::LogicalType::NONE, steps, "", selected,
+                     filtered, leaf);
+    size_t slen = selected.size();
+    for (size_t i = 0; i < slen; ++i) {
+      bool found = false;
+      for (size_t j = 0; j < pr->columns.size() && !found; ++j) {
+        found = pr->columns[j].projected && is_selected(pr->columns[j].path,
+                                                        vector<string>(1, selected[i]));
+      }
+      if (!found) {
         stringstream ss;
-        ss << "group '" << cn->name << "' invalid schema";
+        ss << "column not found:" << selected[i];
         throw pq::ParquetException(ss.str());
       }
     }
-    ++pw->w->num_records;
+    if (pt == LUA_TTABLE) {
+      setup_predicates(lua, pr, 3, filtered);
+    }
   } catch (exception &e) {
-    rollback_record(pw->w);
     lua_pushstring(lua, e.what());
     err = true;
   } catch (...) {
-    rollback_record(pw->w);
-    lua_pushstring(lua, "unknown dissect_message error");
+    lua_pushstring(lua, "unknown reader creation error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 1;
+}
+
+
+static int reader_read(lua_State *lua, bool message)
+{
+  pq_reader_ud *ud = static_cast<pq_reader_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_reader));
+  if (!ud->r) {
+    return luaL_error(lua, "reader closed");
+  }
+
+  bool err = false;
+  try {
+    if (!read_record(lua, ud->r, message)) {
+      lua_pushnil(lua);
+    }
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown read error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 1;
+}
+
+
+static int pq_reader_read(lua_State *lua)
+{
+  return reader_read(lua, false);
+}
+
+
+static int pq_reader_read_message(lua_State *lua)
+{
+  return reader_read(lua, true);
+}
+
+
+static int pq_reader_stats(lua_State *lua)
+{
+  pq_reader_ud *ud = static_cast<pq_reader_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_reader));
+  if (!ud->r) {
+    return luaL_error(lua, "reader closed");
+  }
+  lua_pushinteger(lua, ud->r->num_rowgroups);
+  lua_pushinteger(lua, ud->r->skipped);
+  lua_pushnumber(lua, static_cast<lua_Number>(ud->r->records));
+  return 3;
+}
+
+
+static const char* compression_name(pq::Compression::type c)
+{
+  switch (c) {
+  case pq::Compression::UNCOMPRESSED:
+    return "uncompressed";
+  case pq::Compression::SNAPPY:
+    return "snappy";
+  case pq::Compression::GZIP:
+    return "gzip";
+  case pq::Compression::LZO:
+    return "lzo";
+  case pq::Compression::BROTLI:
+    return "brotli";
+  }
+  return "unknown";
+}
+
+
+static const char* encoding_name(pq::Encoding::type e)
+{
+  switch (e) {
+  case pq::Encoding::PLAIN:
+    return "plain";
+  case pq::Encoding::PLAIN_DICTIONARY:
+    return "plain_dictionary";
+  case pq::Encoding::RLE:
+    return "rle";
+  case pq::Encoding::BIT_PACKED:
+    return "bit_packed";
+  case pq::Encoding::DELTA_BINARY_PACKED:
+    return "delta_binary_packed";
+  case pq::Encoding::DELTA_LENGTH_BYTE_ARRAY:
+    return "delta_length_byte_array";
+  case pq::Encoding::DELTA_BYTE_ARRAY:
+    return "delta_byte_array";
+  case pq::Encoding::RLE_DICTIONARY:
+    return "rle_dictionary";
+  default:
+    break;
+  }
+  return "unknown";
+}
+
+
+template<typename DType>
+static void push_stats_number(lua_State *lua,
+                              const shared_ptr<pq::RowGroupStatistics> &stats)
+{
+  auto ts = typed_stats<DType>(stats);
+  if (!ts) {return;}
+  lua_pushnumber(lua, static_cast<lua_Number>(ts->min()));
+  lua_setfield(lua, -2, "min");
+  lua_pushnumber(lua, static_cast<lua_Number>(ts->max()));
+  lua_setfield(lua, -2, "max");
+}
+
+
+static void push_stats(lua_State *lua, const pq::ColumnDescriptor *cd,
+                       const shared_ptr<pq::RowGroupStatistics> &stats)
+{
+  lua_createtable(lua, 0, 3);
+  lua_pushnumber(lua, static_cast<lua_Number>(stats->null_count()));
+  lua_setfield(lua, -2, "null_count");
+  switch (cd->physical_type()) {
+  case pq::Type::BOOLEAN:
+    {
+      auto ts = typed_stats<pq::BooleanType>(stats);
+      if (ts) {
+        lua_pushboolean(lua, ts->min());
+        lua_setfield(lua, -2, "min");
+        lua_pushboolean(lua, ts->max());
+        lua_setfield(lua, -2, "max");
+      }
+    }
+    break;
+  case pq::Type::INT32:
+    push_stats_number<pq::Int32Type>(lua, stats);
+    break;
+  case pq::Type::INT64:
+    push_stats_number<pq::Int64Type>(lua, stats);
+    break;
+  case pq::Type::FLOAT:
+    push_stats_number<pq::FloatType>(lua, stats);
+    break;
+  case pq::Type::DOUBLE:
+    push_stats_number<pq::DoubleType>(lua, stats);
+    break;
+  case pq::Type::BYTE_ARRAY:
+    {
+      auto ts = typed_stats<pq::ByteArrayType>(stats);
+      if (ts) {
+        lua_pushlstring(lua, reinterpret_cast<const char *>(ts->min().ptr), ts->min().len);
+        lua_setfield(lua, -2, "min");
+        lua_pushlstring(lua, reinterpret_cast<const char *>(ts->max().ptr), ts->max().len);
+        lua_setfield(lua, -2, "max");
+      }
+    }
+    break;
+  case pq::Type::FIXED_LEN_BYTE_ARRAY:
+    {
+      auto ts = typed_stats<pq::FLBAType>(stats);
+      if (ts) {
+        lua_pushlstring(lua, reinterpret_cast<const char *>(ts->min().ptr), cd->type_length());
+        lua_setfield(lua, -2, "min");
+        lua_pushlstring(lua, reinterpret_cast<const char *>(ts->max().ptr), cd->type_length());
+        lua_setfield(lua, -2, "max");
+      }
+    }
+    break;
+  default: // INT96 has no defined sort order
+    break;
+  }
+}
+
+
+static void push_column_chunk(lua_State *lua, const pq::ColumnDescriptor *cd,
+                              const pq::ColumnChunkMetaData *ccm)
+{
+  lua_createtable(lua, 0, 9);
+  lua_pushstring(lua, cd->path()->ToDotString().c_str());
+  lua_setfield(lua, -2, "path");
+  lua_pushnumber(lua, static_cast<lua_Number>(ccm->num_values()));
+  lua_setfield(lua, -2, "num_values");
+  lua_pushstring(lua, compression_name(ccm->compression()));
+  lua_setfield(lua, -2, "compression");
+
+  const vector<pq::Encoding::type> &encodings = ccm->encodings();
+  size_t len = encodings.size();
+  lua_createtable(lua, static_cast<int>(len), 0);
+  for (size_t i = 0; i < len; ++i) {
+    lua_pushstring(lua, encoding_name(encodings[i]));
+    lua_rawseti(lua, -2, static_cast<int>(i + 1));
+  }
+  lua_setfield(lua, -2, "encodings");
+
+  lua_pushnumber(lua, static_cast<lua_Number>(ccm->total_compressed_size()));
+  lua_setfield(lua, -2, "total_compressed_size");
+  lua_pushnumber(lua, static_cast<lua_Number>(ccm->total_uncompressed_size()));
+  lua_setfield(lua, -2, "total_uncompressed_size");
+  lua_pushnumber(lua, static_cast<lua_Number>(ccm->data_page_offset()));
+  lua_setfield(lua, -2, "data_page_offset");
+  if (ccm->has_dictionary_page()) {
+    lua_pushnumber(lua, static_cast<lua_Number>(ccm->dictionary_page_offset()));
+    lua_setfield(lua, -2, "dictionary_page_offset");
+  }
+  if (ccm->is_stats_set()) {
+    push_stats(lua, cd, ccm->statistics());
+    lua_setfield(lua, -2, "statistics");
+  }
+}
+
+
+static int pq_reader_metadata(lua_State *lua)
+{
+  pq_reader_ud *ud = static_cast<pq_reader_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_reader));
+  if (!ud->r) {
+    return luaL_error(lua, "reader closed");
+  }
+
+  bool err = false;
+  try {
+    auto fmd = ud->r->reader->metadata();
+    const pq::SchemaDescriptor *sd = fmd->schema();
+    lua_createtable(lua, 0, 4);
+    lua_pushnumber(lua, static_cast<lua_Number>(fmd->num_rows()));
+    lua_setfield(lua, -2, "num_rows");
+    lua_pushstring(lua, fmd->created_by().c_str());
+    lua_setfield(lua, -2, "created_by");
+
+    int nrg = fmd->num_row_groups();
+    lua_createtable(lua, nrg, 0);
+    for (int i = 0; i < nrg; ++i) {
+      auto rgm = fmd->RowGroup(i);
+      lua_createtable(lua, 0, 3);
+      lua_pushnumber(lua, static_cast<lua_Number>(rgm->num_rows()));
+      lua_setfield(lua, -2, "num_rows");
+      lua_pushnumber(lua, static_cast<lua_Number>(rgm->total_byte_size()));
+      lua_setfield(lua, -2, "total_byte_size");
+
+      int nc = rgm->num_columns();
+      lua_createtable(lua, nc, 0);
+      for (int j = 0; j < nc; ++j) {
+        push_column_chunk(lua, sd->Column(j), rgm->ColumnChunk(j).get());
+        lua_rawseti(lua, -2, j + 1);
+      }
+      lua_setfield(lua, -2, "columns");
+      lua_rawseti(lua, -2, i + 1);
+    }
+    lua_setfield(lua, -2, "row_groups");
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown metadata error");
+    err = true;
+  }
+  return err ? lua_error(lua) : 1;
+}
+
+
+static int pq_reader_close(lua_State *lua)
+{
+  pq_reader_ud *ud = static_cast<pq_reader_ud *>
+      (luaL_checkudata(lua, 1, mozsvc_parquet_reader));
+  if (!ud->r) {return 0;}
+
+  bool err = false;
+  try {
+    ud->r->rg = nullptr;
+    ud->r->columns.clear();
+    if (ud->r->reader) {
+      ud->r->reader->Close();
+    }
+  } catch (exception &e) {
+    lua_pushstring(lua, e.what());
+    err = true;
+  } catch (...) {
+    lua_pushstring(lua, "unknown reader close error");
     err = true;
   }
+  delete ud->r;
+  ud->r = nullptr;
   return err ? lua_error(lua) : 0;
 }
-#endif
+
+
+static const struct luaL_reg pq_readerlib_m[] = {
+  { "read", pq_reader_read },
+  { "read_message", pq_reader_read_message },
+  { "stats", pq_reader_stats },
+  { "metadata", pq_reader_metadata },
+  { "close", pq_reader_close },
+  { "__gc", pq_reader_close },
+  { NULL, NULL }
+};
+
+
+static int pq_pool_gc(lua_State *lua)
+{
+  pq_pool_ud *pp = static_cast<pq_pool_ud *>(lua_touserdata(lua, 1));
+  if (!pp->p) {return 0;}
+
+  {
+    lock_guard<mutex> lock(pp->p->mtx);
+    pp->p->stop = true;
+    pp->p->work_cv.notify_all();
+  }
+  size_t len = pp->p->threads.size();
+  for (size_t i = 0; i < len; ++i) {
+    pp->p->threads[i].join();
+  }
+  delete pp->p;
+  pp->p = nullptr;
+  return 0;
+}
 
 
 static const struct luaL_reg pq_writerlib_m[] = {
   { "dissect_record", pq_writer_dissect },
+  { "append_columns", pq_writer_append_columns },
   { "write_rowgroup", pq_writer_rowgroup },
+  { "buffered_bytes", pq_writer_buffered_bytes },
+  { "contents", pq_writer_contents },
   { "close", pq_writer_close },
   { "__gc", pq_writer_gc },
   { NULL, NULL }
@@ -1893,6 +5012,29 @@ static const struct luaL_reg pq_writerlib_m[] = {
 
 int luaopen_parquet(lua_State *lua)
 {
+  lua_getfield(lua, LUA_REGISTRYINDEX, mozsvc_parquet_pool);
+  if (lua_isnil(lua, -1)) {
+    pq_pool_ud *pp = static_cast<pq_pool_ud *>(lua_newuserdata(lua, sizeof*pp));
+    pp->p = NULL;
+    lua_createtable(lua, 0, 1);
+    lua_pushcfunction(lua, pq_pool_gc);
+    lua_setfield(lua, -2, "__gc");
+    lua_setmetatable(lua, -2);
+    bool err = false;
+    try {
+      pp->p = new pq_pool;
+      unsigned hc = thread::hardware_concurrency();
+      pp->p->max_threads = hc ? hc : 1;
+    } catch (...) {
+      err = true;
+    }
+    if (err) {
+      return luaL_error(lua, "parquet pool allocation failed");
+    }
+    lua_setfield(lua, LUA_REGISTRYINDEX, mozsvc_parquet_pool);
+  }
+  lua_pop(lua, 1);
+
   luaL_newmetatable(lua, mozsvc_parquet_schema);
   lua_pushvalue(lua, -1);
   lua_setfield(lua, -2, "__index");
@@ -1920,6 +5062,24 @@ int luaopen_parquet(lua_State *lua)
 #endif
   lua_pop(lua, 1);
 
+  luaL_newmetatable(lua, mozsvc_parquet_reader);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, pq_readerlib_m);
+  lua_pop(lua, 1);
+
   luaL_register(lua, "parquet", pq_lib_f);
+#ifdef LUA_SANDBOX
+  if (hsb) {
+    luaL_newmetatable(lua, mozsvc_parquet_partitioned);
+    lua_pushvalue(lua, -1);
+    lua_setfield(lua, -2, "__index");
+    luaL_register(lua, NULL, pq_partitionedlib_m);
+    lua_pop(lua, 1);
+
+    lua_pushcfunction(lua, pq_new_partitioned);
+    lua_setfield(lua, -2, "partitioned_writer");
+  }
+#endif
   return 1;
 }
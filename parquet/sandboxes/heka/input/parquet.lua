@@ -0,0 +1,67 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+--[[
+# Parquet File Input
+
+Replays a Parquet file as Heka messages using the reader `read_message`
+mapping (header columns become headers, everything else is placed in Fields).
+Only the listed columns are decoded and row groups that cannot match the
+predicate are skipped using their statistics.
+
+## Sample Configuration
+```lua
+filename = "parquet.lua"
+
+-- Name of the Parquet file to replay
+input_filename = "/var/tmp/telemetry.parquet"
+
+-- Column paths to read (nil for all)
+-- Default:
+-- columns = nil
+
+-- Array of {column, op, value} conditions a record must match
+-- Default:
+-- predicate = nil
+-- e.g. predicate = {{"Timestamp", ">=", 1.5e18}}
+
+-- Heka message table containing the default header values to use, if they are
+-- not populated by the reader.
+-- Default:
+-- default_headers = nil
+```
+--]]
+require "parquet"
+require "string"
+
+local input_filename  = read_config("input_filename") or error("input_filename must be set")
+local columns         = read_config("columns")
+local predicate       = read_config("predicate")
+local default_headers = read_config("default_headers")
+assert(default_headers == nil or type(default_headers) == "table", "invalid default_headers cfg")
+
+function process_message(checkpoint)
+    local skip = checkpoint or 0
+    local reader = parquet.reader(input_filename, columns, predicate)
+
+    local cnt, processed = 0, 0
+    local msg = reader:read_message()
+    while msg do
+        cnt = cnt + 1
+        if cnt > skip then
+            if default_headers then
+                for k,v in pairs(default_headers) do
+                    if msg[k] == nil then msg[k] = v end
+                end
+            end
+            inject_message(msg, cnt)
+            processed = processed + 1
+        end
+        msg = reader:read_message()
+    end
+
+    local rowgroups, skipped = reader:stats()
+    reader:close()
+    return 0, string.format("processed %d records, skipped %d/%d row groups", processed, skipped, rowgroups)
+end
@@ -82,16 +82,26 @@ s3_path_dimensions  = {
 batch_dir       = "/var/tmp/parquet"
 
 -- Specifies how many parquet writers can be opened at once. If this value is
--- exceeded the least-recently used writer will have its data finalize and be
+-- exceeded the least-recently used writer will have its data finalized and be
 -- closed. The default is 100. A value of 0 means no maximum **warning** if
 -- there are a large number of partitions this can easily run the system out of
 -- file handles and/or memory.
 max_writers         = 100
 
+-- Specifies how much column data (in bytes) can be buffered across all of the
+-- open writers. When it is exceeded the least-recently used writers are
+-- finalized and closed (default 0, no limit).
+max_buffered_bytes  = 1024 * 1024 * 1024
+
 -- Specifies how many records to aggregate before creating a rowgroup
 -- (default 10000)
 max_rowgroup_size   = 10000
 
+-- Specifies how much column data (in bytes) can be buffered before a rowgroup
+-- is created, bounding the writer memory when the record sizes vary
+-- (default 0, no limit).
+max_rowgroup_bytes  = 64 * 1024 * 1024
+
 -- Specifies how much data (in bytes) can be written to a single file before
 -- it is finalized. The file size is only checked after each rowgroup write
 -- (default 300MiB).
@@ -107,21 +117,18 @@ max_file_age        = 60 * 60
 -- e.g. FooBar? -> foo_bar_
 hive_compatible     = true -- default false
 
+-- Encodes and writes the rowgroups on a background thread so message
+-- processing is not stalled by the flush. The max_file_size check will lag
+-- by one rowgroup.
+async_rowgroups     = true -- default false
+
 ```
 --]]
 
-require "io"
 require "os"
 require "parquet"
 local load_schema = require "lpeg.parquet".load_parquet_schema
 require "string"
-require "table"
-local date = require "os".date
-
-local writers       = {}
-local writers_cnt   = 0
-local buffer_cnt    = 0
-local time_t        = 0
 
 local hostname              = read_config("Hostname")
 local metadata_group        = read_config("metadata_group")
@@ -136,10 +143,6 @@ if not json_objects and metadata_group then error("metadata_group cannot be conf
 local parquet_schema        = read_config("parquet_schema") or error("parquet_schema must be specified")
 local s3_path_dimensions    = read_config("s3_path_dimensions") or error("s3_path_dimensions must be specified")
 local batch_dir             = read_config("batch_dir") or error("batch_dir must be specified")
-local max_writers           = read_config("max_writers") or 100
-local max_rowgroup_size     = read_config("max_rowgroup_size") or 10000
-local max_file_size         = read_config("max_file_size") or 1024 * 1024 * 300
-local max_file_age          = read_config("max_file_age") or 60 * 60
 local hive_compatible       = read_config("hive_compatible")
 local hindsight_admin       = read_config("hindsight_admin")
 
@@ -149,73 +152,6 @@ if hive_compatible then
 end
 parquet_schema, load_metadata = load_schema(parquet_schema, hive_compatible, metadata_group)
 
-
-local function get_fqfn(path)
-    return string.format("%s/%s", batch_dir, path)
-end
-
-
-local function close_writer(path, writer)
-    writer[1]:close()
-    local t = os.time()
-    local cmd
-    if t == time_t then
-        buffer_cnt = buffer_cnt + 1
-    else
-        time_t = t
-        buffer_cnt = 0
-    end
-
-    local src = get_fqfn(path)
-    local dest
-    if hindsight_admin then
-        dest = string.format("%s/%s.parquet", batch_dir, read_config("Logger")) -- only save off one for debugging
-    else
-        dest = string.format("%s+%d_%d_%s.done", src, time_t, buffer_cnt, hostname)
-    end
-
-    local ok, err = os.rename(src, dest)
-    if not ok then
-        error(string.format("os.rename('%s','%s') failed: %s", src, dest, err))
-    end
-    writers[path] = nil
-    writers_cnt = writers_cnt - 1
-end
-
-
-local function get_writer(path)
-    local ct = os.time()
-    local writer = writers[path]
-    if not writer then
-        -- writer, creation_time, last_active, record_cnt
-        local src = get_fqfn(path)
-        writer = {parquet.writer(src, parquet_schema), ct, ct, 0}
-        writers[path] = writer
-        writers_cnt = writers_cnt + 1
-    else
-        writer[3] = ct
-    end
-
-    if max_writers ~= 0 then
-        if writers_cnt >= max_writers then
-            local oldest = ct + 60
-            local oldest_path
-            local oldest_writer
-            -- if we max out writers a lot we will want to make this more efficient
-            for k,v in pairs(writers) do
-                local et = v[3]
-                if et < oldest then
-                    oldest = et
-                    oldest_path = k
-                    oldest_writer = v
-                end
-            end
-            if oldest_writer then close_writer(oldest_path, oldest_writer) end
-        end
-    end
-    return writer
-end
-
 -- create the batch directory if it does not exist
 local cmd = string.format("mkdir -p %s", batch_dir)
 local ret = os.execute(cmd)
@@ -223,37 +159,32 @@ if ret ~= 0 then
     error(string.format("ret: %d, cmd: %s", ret, cmd))
 end
 
-
-local function read_json(json, path)
-    local len = #path
-    local v = json
-    for i=1, len do
-        v = v[path[i]]
-        local t = type(v)
-        if t == "nil" or (t ~= "table" and i ~= len) or (t == "table" and i == len) then
-            return nil
+local callback
+if hindsight_admin then
+    callback = function(src)
+        local dest = string.format("%s/%s.parquet", batch_dir, read_config("Logger")) -- only save off one for debugging
+        local ok, err = os.rename(src, dest)
+        if not ok then
+            error(string.format("os.rename('%s','%s') failed: %s", src, dest, err))
         end
     end
-    return tostring(v)
 end
 
-
-local function get_s3_path(json)
-    local dims = {}
-    local v
-    for i,d in ipairs(s3_path_dimensions) do
-        if type(d.source) == "string" then
-            v = read_message(d.source) or default_nil
-        else
-            v = read_json(json, d.source) or default_nil
-        end
-        if d.dateformat then
-            v = date(d.dateformat, v*(d.scaling_factor or 1e-9))
-        end
-        dims[i] = string.format("%s=%s", d.name, string.gsub(v, "[^%w!%-_.*'()]", "-"))
-    end
-    return table.concat(dims, "+") -- the plus will be converted to a path separator '/' when uploaded to S3
-end
+local writer = parquet.partitioned_writer(parquet_schema, s3_path_dimensions, {
+    dir                 = batch_dir,
+    hostname            = hostname,
+    default_nil         = default_nil,
+    max_writers         = read_config("max_writers") or 100,
+    max_bytes           = read_config("max_buffered_bytes") or 0,
+    max_rowgroup_size   = read_config("max_rowgroup_size") or 10000,
+    max_file_size       = read_config("max_file_size") or 1024 * 1024 * 300,
+    max_file_age        = read_config("max_file_age") or 60 * 60,
+    properties          = {
+        async = read_config("async_rowgroups"),
+        max_rowgroup_bytes = read_config("max_rowgroup_bytes")
+    },
+    callback            = callback
+})
 
 
 local function load_json_objects()
@@ -299,43 +230,15 @@ function process_message()
         if load_metadata then
             record[metadata_group] = load_metadata()
         end
-    end
-
-    local path = get_s3_path(record)
-    local writer = get_writer(path)
-    local w = writer[1]
-
-    if json_objects then
-        ok, err = pcall(w.dissect_record, w, record)
+        ok, err = pcall(writer.dissect_record, writer, record)
     else
-        ok, err = pcall(w.dissect_message, w)
+        ok, err = pcall(writer.dissect_message, writer)
     end
     if not ok then return -1, err end
-
-    local record_cnt = writer[4] + 1
-    writer[4] = record_cnt
-
-    if record_cnt >= max_rowgroup_size then
-        w:write_rowgroup()
-        writer[4] = 0
-        -- todo we may want to create a dependency on LFS so we can just stat the file
-        local src = get_fqfn(path)
-        local fh = assert(io.open(src))
-        local file_size = fh:seek("end")
-        fh:close()
-        if file_size >= max_file_size then
-            close_writer(path, writer)
-        end
-    end
     return 0
 end
 
 
 function timer_event(ns, shutdown)
-    local ct = os.time()
-    for path, writer in pairs(writers) do
-        if shutdown or (ct - writer[2] >= max_file_age) then
-            close_writer(path, writer)
-        end
-    end
+    writer:rotate(shutdown)
 end
@@ -6,8 +6,10 @@
 
 /** @brief parquet luasandox tests @file */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <luasandbox/heka/sandbox.h>
 #include <luasandbox/test/mu_test.h>
@@ -124,11 +126,118 @@ local msg = {
 
 
 
+static char* test_parquet_partitioned()
+{
+  static char pb[] = "\x0a\x10" "abcdefghijklmnop" "\x10\x80\x94\xeb\xdc\x03"
+      "\x22\x06" "logger" "\x52\x0c\x0a\x06" "binary" "\x22\x02" "s1";
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof pb - 1, NULL), "failed");
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_output(NULL, "test_sandbox_partitioned.lua", NULL,
+                               TEST_MODULE_PATH "log_level = 7\n",
+                               &logger, ucp);
+  mu_assert(hsb, "lsb_heka_create_output failed");
+  mu_assert(0 == lsb_heka_pm_output(hsb, &m, (void *)1, false), "err: %s",
+            lsb_heka_get_error(hsb));
+  e = lsb_heka_destroy_sandbox(hsb);
+  mu_assert(!e, "%s", e);
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static double elapsed(const struct timespec *t0)
+{
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+
+// Wall time to flush one wide row group per writer. The columns of a row
+// group are encoded one after another (parquet-cpp's RowGroupWriter writes
+// each chunk straight into the file), the pool only runs the row groups of
+// different writers in parallel.
+static char* benchmark_flush()
+{
+  static const int writers[] = { 1, 4 };
+  static char pb[] = "\x0a\x10" "abcdefghijklmnop" "\x10\x80\x94\xeb\xdc\x03";
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof pb - 1, NULL), "failed");
+  for (size_t i = 0; i < sizeof writers / sizeof writers[0]; ++i) {
+    char cfg[1024];
+    snprintf(cfg, sizeof cfg, "%sinstruction_limit = 0\nwriters = %d\n",
+             TEST_MODULE_PATH, writers[i]);
+    lsb_heka_sandbox *hsb;
+    hsb = lsb_heka_create_output(NULL, "benchmark_flush.lua", NULL, cfg,
+                                 &logger, ucp);
+    mu_assert(hsb, "lsb_heka_create_output failed");
+    mu_assert(0 == lsb_heka_pm_output(hsb, &m, (void *)1, false), "err: %s",
+              lsb_heka_get_error(hsb));
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    mu_assert(0 == lsb_heka_timer_event(hsb, 0, false), "err: %s",
+              lsb_heka_get_error(hsb));
+    double s = elapsed(&t);
+    e = lsb_heka_destroy_sandbox(hsb);
+    mu_assert(!e, "%s", e);
+    printf("benchmark_flush %d writer(s) %g row groups/sec\n", writers[i],
+           writers[i] / s);
+  }
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+// Rows per second collected by dissect_record vs the append_columns batch API
+static char* benchmark_append()
+{
+  static const char *modes[] = { "dissect", "append" };
+  static char pb[] = "\x0a\x10" "abcdefghijklmnop" "\x10\x80\x94\xeb\xdc\x03";
+  int iter = 20, rows = 10000;
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof pb - 1, NULL), "failed");
+  for (size_t i = 0; i < sizeof modes / sizeof modes[0]; ++i) {
+    char cfg[1024];
+    snprintf(cfg, sizeof cfg,
+             "%smemory_limit = 0\ninstruction_limit = 0\nmode = '%s'\n",
+             TEST_MODULE_PATH, modes[i]);
+    lsb_heka_sandbox *hsb;
+    hsb = lsb_heka_create_output(NULL, "benchmark_append.lua", NULL, cfg,
+                                 &logger, ucp);
+    mu_assert(hsb, "lsb_heka_create_output failed");
+
+    double s = 0;
+    for (int x = 0; x < iter; ++x) {
+      struct timespec t;
+      clock_gettime(CLOCK_MONOTONIC, &t);
+      mu_assert(0 == lsb_heka_pm_output(hsb, &m, (void *)1, false), "err: %s",
+                lsb_heka_get_error(hsb));
+      s += elapsed(&t);
+      mu_assert(0 == lsb_heka_timer_event(hsb, 0, false), "err: %s",
+                lsb_heka_get_error(hsb));
+    }
+    e = lsb_heka_destroy_sandbox(hsb);
+    mu_assert(!e, "%s", e);
+    printf("benchmark_append %s %g rows/sec\n", modes[i], iter * rows / s);
+  }
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
 static char* all_tests()
 {
   mu_run_test(test_parquet);
   mu_run_test(test_parquet_min);
   mu_run_test(test_parquet_full);
+  mu_run_test(test_parquet_partitioned);
+  mu_run_test(benchmark_flush);
+  mu_run_test(benchmark_append);
   return NULL;
 }
 
@@ -0,0 +1,53 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Collects the same rows with dissect_record or append_columns (cfg mode) in
+-- process_message (the timed part), timer_event writes them out.
+require "parquet"
+require "string"
+local parser = require "lpeg.parquet"
+
+local mode = read_config("mode")
+local rows = 10000
+
+local schema = parser.load_parquet_schema([[
+message benchmark {
+    required int64 id;
+    required double value;
+    required binary name (UTF8);
+    optional binary host (UTF8);
+    optional int32 status;
+    optional boolean ok;
+}
+]])
+
+local records = {}
+local columns = {id = {}, value = {}, name = {}, host = {}, status = {}, ok = {}}
+for i = 1, rows do
+    local r = {
+        id      = i,
+        value   = i * 1.5,
+        name    = string.format("name%d", i % 100),
+        host    = i % 3 ~= 0 and string.format("host%d", i % 7) or nil,
+        status  = i % 5 ~= 0 and 200 + i % 4 or nil,
+        ok      = i % 2 == 0,
+    }
+    records[i] = r
+    for k, v in pairs(r) do columns[k][i] = v end
+end
+
+local writer = parquet.writer("benchmark_append.parquet", schema)
+
+function process_message()
+    if mode == "append" then
+        writer:append_columns(columns, rows)
+    else
+        for i = 1, rows do writer:dissect_record(records[i]) end
+    end
+    return 0
+end
+
+function timer_event(ns, shutdown)
+    writer:write_rowgroup()
+end
@@ -0,0 +1,45 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Collects one wide gzip row group per writer in process_message, timer_event
+-- hands all of them to the pool and waits for them (the timed part).
+require "parquet"
+require "string"
+require "table"
+local parser = require "lpeg.parquet"
+
+local writers = read_config("writers")
+local cols    = 32
+local records = 10000
+
+local s = {"message benchmark {"}
+for i = 1, cols do
+    s[#s + 1] = string.format("required double d%d; required binary s%d;", i, i)
+end
+s[#s + 1] = "}"
+local schema = parser.load_parquet_schema(table.concat(s, "\n"))
+
+local ws = {}
+
+function process_message()
+    parquet.set_threads(writers)
+    for i = 1, writers do
+        ws[i] = parquet.writer(string.format("benchmark_flush%d.parquet", i),
+                               schema, {compression = "gzip", async = true})
+    end
+    local rec = {}
+    for j = 1, records do
+        for c = 1, cols do
+            rec["d" .. c] = j * c * 1.37
+            rec["s" .. c] = string.format("%d:%d", j * 7919 % 65521, c)
+        end
+        for i = 1, writers do ws[i]:dissect_record(rec) end
+    end
+    return 0
+end
+
+function timer_event(ns, shutdown)
+    for i = 1, writers do ws[i]:write_rowgroup() end
+    for i = 1, writers do ws[i]:close() end
+end
@@ -2,9 +2,11 @@
 -- License, v. 2.0. If a copy of the MPL was not distributed with this
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+require "io"
 require "string"
+require "table"
 require "parquet"
-assert(parquet.version() == "0.0.6", parquet.version())
+assert(parquet.version() == "0.0.15", parquet.version())
 local parser = require "lpeg.parquet"
 
 local r1 = {
@@ -401,3 +403,435 @@ local function test_tuple_dissection()
 end
 
 test_tuple_dissection()
+
+
+local function test_async_writer()
+    local w = parquet.writer("async.parquet", doc, {async = true})
+    for i = 1, 10 do
+        w:dissect_record(r1)
+        w:dissect_record(r2)
+        w:write_rowgroup() -- returns while the previous row group is encoded
+    end
+    local ok, err = pcall(w.dissect_record, w, r2bad)
+    assert(not ok)
+    w:dissect_record(r2)
+    w:close() -- waits for the pending row group
+    local ok, err = pcall(w.dissect_record, w, r1)
+    assert(not ok, "writer closed")
+
+    local r = parquet.reader("async.parquet")
+    local cnt = 0
+    for rec in r.read, r do
+        cnt = cnt + 1
+        local expected = (cnt % 2 == 1 and cnt < 21) and 10 or 20
+        assert(rec.DocId == expected, string.format("record: %d DocId: %d", cnt, rec.DocId))
+    end
+    assert(cnt == 21, cnt)
+    local rowgroups = r:stats()
+    assert(rowgroups == 11, rowgroups)
+    r:close()
+end
+
+test_async_writer()
+
+local function test_async_writers()
+    local ok, err = pcall(parquet.set_threads, 0)
+    assert(not ok)
+    parquet.set_threads(4)
+    local ws = {}
+    for i = 1, 8 do
+        ws[i] = parquet.writer(string.format("async%d.parquet", i), doc, {async = true})
+    end
+    for j = 1, 5 do
+        for i, w in ipairs(ws) do
+            w:dissect_record(r1)
+            w:dissect_record(r2)
+            w:write_rowgroup()
+        end
+    end
+    for i, w in ipairs(ws) do
+        w:close()
+        local r = parquet.reader(string.format("async%d.parquet", i))
+        local cnt = 0
+        for rec in r.read, r do cnt = cnt + 1 end
+        assert(cnt == 10, cnt)
+        assert(r:stats() == 5)
+        r:close()
+    end
+end
+
+test_async_writers()
+
+local function test_rowgroup_bytes()
+    local w = parquet.writer("rowgroup_bytes.parquet", doc, {max_rowgroup_bytes = 1024})
+    assert(w:buffered_bytes() == 0)
+    w:dissect_record(r1)
+    local n = w:buffered_bytes()
+    assert(n > 0 and n < 1024, n)
+    local ok = pcall(w.dissect_record, w, r2bad)
+    assert(not ok and w:buffered_bytes() == n, "the rolled back record was counted")
+    for i = 1, 100 do
+        w:dissect_record(r1)
+        assert(w:buffered_bytes() < 1024, "row group was not flushed")
+    end
+    w:write_rowgroup()
+    assert(w:buffered_bytes() == 0)
+    w:close()
+
+    local ok, err = pcall(parquet.writer, "rowgroup_bytes.parquet", doc, {max_rowgroup_bytes = -1})
+    assert(not ok)
+end
+
+test_rowgroup_bytes()
+
+local function test_interning()
+    local w = parquet.writer("intern.parquet", doc, {
+        columns = {
+            ["Name.Url"] = {intern = true},
+            ["Name.Language.Country"] = {intern = 2} -- interns "us" and "gb", copies the rest
+        }
+    })
+    local r = {DocId = 1, Name = {Url = "", Language = {Code = "en", Country = "ca"}}}
+    for i = 1, 3 do
+        w:dissect_record(r1)
+        w:dissect_record(r2)
+        w:dissect_record(r)
+    end
+    local n = w:buffered_bytes()
+    w:write_rowgroup()
+    for i = 1, 3 do
+        w:dissect_record(r1)
+        w:dissect_record(r2)
+        w:dissect_record(r)
+    end
+    assert(n == w:buffered_bytes(), "intern table was not reset")
+    w:close()
+
+    local ok, err = pcall(parquet.writer, "intern.parquet", doc, {columns = {DocId = {intern = true}}})
+    assert(err == "intern requires a binary column:DocId", err)
+    ok, err = pcall(parquet.writer, "intern.parquet", doc, {columns = {["Name.Url"] = {intern = -1}}})
+    assert(err == "intern must be a boolean or a number 0-4294967295:Name.Url", err)
+
+    -- each distinct value is stored once per row group
+    local plain = parquet.writer("intern_plain.parquet", doc)
+    local interned = parquet.writer("intern_dedup.parquet", doc, {columns = {["Name.Url"] = {intern = true}}})
+    for i = 1, 100 do
+        plain:dissect_record(r2)
+        interned:dissect_record(r2)
+    end
+    local saved = plain:buffered_bytes() - interned:buffered_bytes()
+    assert(saved == 99 * #"http://C", saved)
+    plain:close()
+    interned:close()
+
+    local r = parquet.reader("intern_dedup.parquet", {"Name.Url"})
+    local cnt = 0
+    for rec in r.read, r do
+        cnt = cnt + 1
+        assert(rec.Name[1].Url == "http://C", tostring(rec.Name[1].Url))
+    end
+    assert(cnt == 100, cnt)
+    r:close()
+end
+
+test_interning()
+
+local function same(a, b)
+    if type(a) ~= "table" or type(b) ~= "table" then return a == b end
+    for k,v in pairs(a) do
+        if not same(v, b[k]) then return false end
+    end
+    for k in pairs(b) do
+        if a[k] == nil then return false end
+    end
+    return true
+end
+
+local function test_reader()
+    local e1 = {
+        DocId = 10,
+        Links = {Backward = {}, Forward = {20, 40, 60}},
+        Name = {
+            {Language = {{Code = "en-us", Country = "us"}, {Code = "en"}}, Url = "http://A"},
+            {Language = {}, Url = "http://B"},
+            {Language = {{Code = "en-gb", Country = "gb"}}}
+        }
+    }
+    local e2 = {
+        DocId = 20,
+        Links = {Backward = {10, 30}, Forward = {80}},
+        Name = {{Language = {}, Url = "http://C"}}
+    }
+
+    local r = parquet.reader("example.parquet")
+    assert(same(r:read(), e1))
+    assert(same(r:read(), e2))
+    assert(r:read() == nil)
+    r:close()
+    local ok, err = pcall(r.read, r)
+    assert(err == "reader closed", err)
+
+    -- the first row group only contains DocId 10
+    r = parquet.reader("example.parquet", {"DocId", "Name.Url"}, {{"DocId", ">", 15}})
+    assert(same(r:read(), {DocId = 20, Name = {{Url = "http://C"}}}))
+    assert(r:read() == nil)
+    local rowgroups, skipped, records = r:stats()
+    assert(rowgroups == 2 and skipped == 1 and records == 1, string.format("%d %d %d", rowgroups, skipped, records))
+
+    r = parquet.reader("shared1.parquet", {"Links"}, {{"DocId", "==", 20}})
+    assert(same(r:read(), {Links = {Backward = {10, 30}, Forward = {80}}}))
+    assert(r:read() == nil)
+
+    local errs = {
+        {{"Foo"}, nil, "column not found:Foo"},
+        {nil, {{"Name.Url", "==", "x"}}, "predicate column must be a non repeated, non int96 primitive:Name.Url"},
+        {nil, {{"DocId", "=", 1}}, "predicate invalid operator:="},
+        {nil, {{"DocId", "==", "1"}}, "predicate value type mismatch:DocId"},
+        {nil, {"DocId"}, "predicate must be an array of {column, op, value} tables"},
+    }
+    for i,v in ipairs(errs) do
+        local ok, err = pcall(parquet.reader, "example.parquet", v[1], v[2])
+        assert(err == v[3], string.format("Test: %d expected: %s received: %s", i, v[3], tostring(err)))
+    end
+end
+
+test_reader()
+
+local function test_reader_nested()
+    local tests = {
+        {maps_schema, {
+            {my_map = {foo = 1, bar = 2}},
+            {my_map = {foo = 2}, omap = {bar = 3}},
+            {my_map = {foo = 2}, omap = {}},
+            {my_map = {foo = 99}, mom = {m1 = {nm1a = 100, nm1b = 101}, m2 = {nm2a = 200}}},
+        }},
+        {lists_schema, {
+            {my_list = {1,2,3}},
+            {my_list = {1,2,3}, olist = {10}},
+            {my_list = {1,2,3}, lol = {{100, 101}, {200}}},
+            {my_list = {1,2,3}, lol = {{}}},
+        }},
+    }
+    for i,t in ipairs(tests) do
+        local w = parquet.writer("read_nested.parquet", parser.load_parquet_schema(t[1]))
+        for _,v in ipairs(t[2]) do w:dissect_record(v) end
+        w:close()
+
+        local r = parquet.reader("read_nested.parquet")
+        for j,v in ipairs(t[2]) do
+            assert(same(r:read(), v), string.format("Test: %d record: %d", i, j))
+        end
+        assert(r:read() == nil)
+        r:close()
+    end
+end
+
+test_reader_nested()
+
+local function test_reader_legacy()
+    -- legacy_nested.parquet (written outside of this module)
+    -- optional group l (LIST) {repeated int32 element;}
+    -- optional group m (MAP) {repeated group key_value {required binary key;}}
+    local r = parquet.reader("legacy_nested.parquet")
+    assert(same(r:read(), {l = {1, 2}, m = {{key = "a"}, {key = "b"}}}))
+    assert(same(r:read(), {l = {}}))
+    assert(r:read() == nil)
+    r:close()
+end
+
+test_reader_legacy()
+
+local function test_reader_binary_stats()
+    local s = parquet.schema("binary_stats")
+    s:add_column("s", "required", "binary")
+    s:finalize()
+
+    local w = parquet.writer("binary_stats.parquet", s)
+    w:dissect_record({s = "a"})
+    w:dissect_record({s = "\233"})
+    w:close()
+
+    -- a signed min/max would exclude "a" from this row group
+    local r = parquet.reader("binary_stats.parquet", nil, {{"s", "==", "a"}})
+    assert(same(r:read(), {s = "a"}))
+    assert(r:read() == nil)
+    local rowgroups, skipped, records = r:stats()
+    assert(rowgroups == 1 and skipped == 0 and records == 1, string.format("%d %d %d", rowgroups, skipped, records))
+    r:close()
+end
+
+test_reader_binary_stats()
+
+local function test_reader_message()
+    local s = parquet.schema("message")
+    s:add_column("Timestamp", "required", "int64")
+    s:add_column("Logger", "optional", "binary")
+    local f = s:add_group("Fields", "required")
+    f:add_column("host", "optional", "binary")
+    f:add_column("ids", "repeated", "int32")
+    s:add_column("extra", "optional", "int32")
+    s:finalize()
+
+    local w = parquet.writer("read_message.parquet", s)
+    w:dissect_record({Timestamp = 1e9, Logger = "logger", Fields = {host = "h1", ids = {1, 2}}, extra = 5})
+    w:dissect_record({Timestamp = 2e9, Fields = {}})
+    w:close()
+
+    local r = parquet.reader("read_message.parquet")
+    assert(same(r:read_message(), {Timestamp = 1e9, Logger = "logger", Fields = {host = "h1", ids = {1, 2}, extra = 5}}))
+    assert(same(r:read_message(), {Timestamp = 2e9, Fields = {ids = {}}}))
+    assert(r:read_message() == nil)
+end
+
+test_reader_message()
+
+local function test_append_columns()
+    local s = parquet.schema("flat")
+    s:add_column("id", "required", "int64")
+    s:add_column("name", "optional", "binary")
+    s:add_column("score", "optional", "double")
+    s:add_column("ok", "required", "boolean")
+    s:finalize()
+
+    local w = parquet.writer("append.parquet", s)
+    w:append_columns({id = {1, 2, 3}, name = {"a", nil, "c"}, ok = {true, false, true}}, 3)
+    w:dissect_record({id = 4, score = 1.5, ok = false})
+    local errs = {
+        {{id = {5}, ok = {"x"}}, "column 'ok' data type mismatch (string) row 1"},
+        {{ok = {true}}, "column 'id' is required"},
+        {{id = {5, nil}, ok = {true, true}}, "column 'id' is required (row 2)"},
+        {{id = 5, ok = {true}}, "column 'id' expected an array"},
+    }
+    for i,v in ipairs(errs) do
+        local ok, err = pcall(w.append_columns, w, v[1], #v[1].ok)
+        assert(err == v[2], string.format("Test: %d expected: %s received: %s", i, v[2], tostring(err)))
+    end
+    w:append_columns({id = {5}, name = {"e"}, score = {2.5}, ok = {true}}, 1)
+    w:close()
+
+    local expected = {
+        {id = 1, name = "a", ok = true},
+        {id = 2, ok = false},
+        {id = 3, name = "c", ok = true},
+        {id = 4, score = 1.5, ok = false},
+        {id = 5, name = "e", score = 2.5, ok = true},
+    }
+    local r = parquet.reader("append.parquet")
+    for i,v in ipairs(expected) do
+        assert(same(r:read(), v), string.format("Test: %d", i))
+    end
+    assert(r:read() == nil)
+
+    local w = parquet.writer("append_nested.parquet", doc)
+    local ok, err = pcall(w.append_columns, w, {}, 0)
+    assert(err == "append_columns requires a flat schema, found 'Links'", err)
+end
+
+test_append_columns()
+
+local function test_sinks()
+    local function write(sink)
+        local w = parquet.writer(sink, doc, {created_by = "hindsight"})
+        w:dissect_record(r1)
+        w:write_rowgroup()
+        w:dissect_record(r2)
+        w:close()
+        return w
+    end
+
+    write("sink.parquet")
+    local fh = assert(io.open("sink.parquet", "rb"))
+    local expected = fh:read("*a")
+    fh:close()
+
+    local mw = write(nil)
+    assert(mw:contents() == expected)
+
+    local parts, offset = {}, 0
+    write(function(data, off)
+        assert(off == offset, string.format("expected: %d received: %d", offset, off))
+        offset = offset + #data
+        parts[#parts + 1] = data
+    end)
+    assert(#parts == 2, #parts) -- first row group, second row group + footer
+    assert(table.concat(parts) == expected)
+
+    local w = parquet.writer(function() error("boom") end, doc)
+    w:dissect_record(r1)
+    local ok, err = pcall(w.write_rowgroup, w)
+    assert(not ok and err:match("^output callback failed: .*boom$"), err)
+    assert(not pcall(w.close, w)) -- the footer delivery fails too
+
+    w = parquet.writer(function() error({}) end, doc)
+    w:dissect_record(r1)
+    local ok, err = pcall(w.write_rowgroup, w)
+    assert(err == "output callback failed: table", err)
+
+    -- a failed range is delivered again, from the same offset, with the next one
+    local fail = true
+    parts, offset = {}, 0
+    w = parquet.writer(function(data, off)
+        if fail then fail = false; error("retry") end
+        assert(off == offset, string.format("expected: %d received: %d", offset, off))
+        offset = offset + #data
+        parts[#parts + 1] = data
+    end, doc, {created_by = "hindsight"})
+    w:dissect_record(r1)
+    local ok, err = pcall(w.write_rowgroup, w)
+    assert(not ok and err:match("retry$"), err)
+    w:dissect_record(r2)
+    w:close()
+    assert(#parts == 1, #parts)
+    assert(table.concat(parts) == expected)
+
+    local fw = parquet.writer("sink2.parquet", doc)
+    local ok, err = pcall(fw.contents, fw)
+    assert(err == "contents() requires an in memory writer", err)
+    fw:close()
+
+    local ok, err = pcall(parquet.writer, 1, doc)
+    assert(not ok)
+end
+
+test_sinks()
+
+local function test_footer()
+    local w = parquet.writer("footer.parquet", doc, {
+        enable_statistics = false,
+        columns = {
+            DocId = {enable_statistics = true},
+            ["Name.Url"] = {compression = "gzip"}
+        }
+    })
+    w:dissect_record(r1)
+    w:write_rowgroup()
+    w:dissect_record(r2)
+    w:close()
+
+    local r = parquet.reader("footer.parquet")
+    local md = r:metadata()
+    assert(md.num_rows == 2 and #md.row_groups == 2)
+    for i,v in ipairs({10, 20}) do
+        local rg = md.row_groups[i]
+        assert(rg.num_rows == 1 and #rg.columns == 6)
+        local stats = rg.columns[1].statistics
+        assert(rg.columns[1].path == "DocId")
+        assert(stats and stats.min == v and stats.max == v and stats.null_count == 0, i)
+        for j = 2, 6 do
+            assert(not rg.columns[j].statistics, rg.columns[j].path)
+        end
+        assert(rg.columns[6].path == "Name.Url" and rg.columns[6].compression == "gzip")
+    end
+    r:close()
+
+    for _,k in ipairs({"column_index", "offset_index", "bloom_filter"}) do
+        local expected = k .. " is not supported by this parquet-cpp version"
+        local ok, err = pcall(parquet.writer, nil, doc, {[k] = true})
+        assert(err == expected, err)
+        ok, err = pcall(parquet.writer, nil, doc, {columns = {DocId = {[k] = true}}})
+        assert(err == expected, err)
+        parquet.writer(nil, doc, {[k] = false}):close()
+    end
+end
+
+test_footer()
@@ -39,13 +39,62 @@ message test {
 }
 ]]
 
+-- the Fields columns are populated in message order; 'missing' is only null
+-- filled after the message fields and 'int' fails the type check last
+local rollback_schema = [[
+message rollback {
+    required int64 Timestamp;
+    required group Fields {
+        optional binary missing;
+        required boolean bool;
+        required double double;
+        required binary binary;
+        optional binary int;
+    }
+}
+]]
+
 local s = parser.load_parquet_schema(schema)
 local hs = parser.load_parquet_schema(schema, true)
+local rs = parser.load_parquet_schema(rollback_schema)
+
+local function test_rollback()
+    local w = parquet.writer("hm_rollback.parquet", rs)
+    w:dissect_record({Timestamp = 1, Fields = {bool = true, double = 1.5, binary = "r1", int = "i1"}})
+    local ok, err = pcall(w.dissect_message, w)
+    assert(err == "column 'int' data type mismatch (integer)", err)
+    w:dissect_record({Timestamp = 2, Fields = {bool = false, double = 2.5, binary = "r2"}})
+    w:close()
+
+    local r = parquet.reader("hm_rollback.parquet")
+    local rec = r:read()
+    assert(rec.Timestamp == 1, rec.Timestamp)
+    assert(rec.Fields.bool == true and rec.Fields.double == 1.5, tostring(rec.Fields.double))
+    assert(rec.Fields.binary == "r1" and rec.Fields.int == "i1", rec.Fields.binary)
+    rec = r:read()
+    assert(rec.Timestamp == 2, rec.Timestamp)
+    assert(rec.Fields.bool == false and rec.Fields.double == 2.5, tostring(rec.Fields.double))
+    assert(rec.Fields.binary == "r2" and rec.Fields.int == nil, rec.Fields.binary)
+    assert(rec.Fields.missing == nil)
+    assert(r:read() == nil)
+    r:close()
+end
+
 function process_message()
     local w = parquet.writer("hm.parquet", s)
     w:dissect_message()
+    w:dissect_message()
     w:close()
 
+    local r = parquet.reader("hm.parquet")
+    local rec = r:read()
+    assert(rec.Fields.int == 1 and rec.Fields.binary == "s1", tostring(rec.Fields.int))
+    assert(r:read().Fields.double == 101.1)
+    assert(r:read() == nil)
+    r:close()
+
+    test_rollback()
+
     w = parquet.writer("hm_hive.parquet", hs)
     w:dissect_message()
     w:close()
@@ -0,0 +1,82 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "parquet"
+require "table"
+local parser = require "lpeg.parquet"
+
+local schema = [[
+message test {
+    required int64 Timestamp;
+    required binary Logger;
+    required group Fields {
+        required binary binary;
+        optional binary missing;
+    }
+}
+]]
+
+local dims = {
+    {name = "logger", source = "Logger"},
+    {name = "date", source = "Timestamp", dateformat = "!%Y-%m-%d"},
+    {name = "bin", source = "Fields[binary]"},
+    {name = "miss", source = "Fields[missing]"},
+    {name = "rec", source = {"a", "b"}},
+}
+
+local s = parser.load_parquet_schema(schema)
+local done = {}
+local pw = parquet.partitioned_writer(s, dims, {
+    dir = "partitioned",
+    max_rowgroup_size = 1,
+    callback = function(fn, key) done[#done + 1] = {key = key, fn = fn} end
+})
+
+local ok, err = pcall(parquet.partitioned_writer, s, {{name = "x", source = "Foo"}}, {dir = "."})
+assert(err == "dimension 'x' invalid source:Foo", err)
+local ok, err = pcall(parquet.partitioned_writer, s, dims, {})
+assert(err == "dir must be specified", err)
+
+function process_message()
+    pw:dissect_message()
+    pw:dissect_message()
+    local n, bytes = pw:stats()
+    assert(n == 1, n)
+    assert(bytes == 0, bytes) -- max_rowgroup_size = 1
+
+    pw:dissect_record({Timestamp = 1, Logger = "l", Fields = {binary = "b"}, a = {b = "c d"}})
+    n = pw:stats()
+    assert(n == 2, n)
+
+    assert(pw:rotate() == 0)
+    assert(pw:rotate(true) == 2)
+    table.sort(done, function(a, b) return a.key < b.key end)
+    assert(done[1].key == "logger=logger+date=1970-01-01+bin=s1+miss=UNKNOWN+rec=UNKNOWN", tostring(done[1].key))
+    assert(done[2].key == "logger=logger+date=1970-01-01+bin=s1+miss=UNKNOWN+rec=c-d", tostring(done[2].key))
+    assert(done[1].fn == "partitioned/" .. done[1].key, done[1].fn)
+
+    local r = parquet.reader(done[1].fn)
+    for i = 1, 2 do
+        local rec = r:read()
+        assert(rec.Timestamp == 1e9, rec.Timestamp)
+        assert(rec.Logger == "logger", rec.Logger)
+        assert(rec.Fields.binary == "s1" and rec.Fields.missing == nil, rec.Fields.binary)
+    end
+    assert(r:read() == nil)
+    assert(r:stats() == 2) -- max_rowgroup_size = 1
+    r:close()
+
+    r = parquet.reader(done[2].fn)
+    local rec = r:read()
+    assert(rec.Timestamp == 1 and rec.Logger == "l" and rec.Fields.binary == "b", rec.Logger)
+    assert(r:read() == nil)
+    r:close()
+    pw:close()
+    local ok = pcall(pw.dissect_message, pw)
+    assert(not ok)
+    return 0
+end
+
+function timer_event()
+end
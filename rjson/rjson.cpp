@@ -9,16 +9,20 @@
 #include <rapidjson/document.h>
 #include <rapidjson/encodings.h>
 #include <rapidjson/error/en.h>
+#include <rapidjson/filereadstream.h>
 #include <rapidjson/memorystream.h>
 #include <rapidjson/schema.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
+#include <climits>
+#include <cmath>
 #include <unordered_map>
 
 extern "C"
 {
 #include "lauxlib.h"
 #include "lua.h"
+#include "lualib.h"
 
 int luaopen_rjson(lua_State *lua);
 }
@@ -50,13 +54,34 @@ typedef struct rjson
   rj::Value                             *val;
   std::unordered_map<rj::Value *, bool> *refs;
   rjson_buffer                          insitu;
+  rjson_buffer                          chunk; // user buffer backing the mpa
 } rjson;
 
+typedef struct rjson_pool
+{
+  rjson   *items;
+  int     cnt;
+  int     max_items;
+  size_t  retained;
+  size_t  max_retained;
+  bool    closed;
+} rjson_pool;
+
 typedef struct rjson_schema
 {
   rj::SchemaDocument *doc;
 } rjson_schema;
 
+typedef struct rjson_stream
+{
+  rj::MemoryStream    *ms;
+  rj::FileReadStream  *fs;
+  FILE                *fh;
+  char                *buf;
+  size_t              base;
+  bool                validate;
+} rjson_stream;
+
 typedef struct rjson_object_iterator
 {
   rj::Value::MemberIterator *it;
@@ -66,6 +91,12 @@ typedef struct rjson_object_iterator
 static const char *mozsvc_rjson             = "mozsvc.rjson";
 static const char *mozsvc_rjson_schema      = "mozsvc.rjson_schema";
 static const char *mozsvc_rjson_object_iter = "mozsvc.rjson_object_iter";
+static const char *mozsvc_rjson_stream      = "mozsvc.rjson_stream";
+static const char *mozsvc_rjson_pool        = "mozsvc.rjson_pool";
+
+static const size_t STREAM_BUFFER_SIZE = 64 * 1024;
+static const int    POOL_MAX_DOCUMENTS = 16;
+static const size_t POOL_MAX_RETAINED  = 8 * 1024 * 1024;
 
 
 static void init_rjson_buffer(rjson_buffer *b)
@@ -83,6 +114,28 @@ static void init_rjson(rjson *j)
   j->val = NULL;
   j->refs = new std::unordered_map<rj::Value *, bool>;
   init_rjson_buffer(&j->insitu);
+  init_rjson_buffer(&j->chunk);
+}
+
+
+static rjson_pool* get_pool(lua_State *lua)
+{
+  lua_getfield(lua, LUA_REGISTRYINDEX, mozsvc_rjson_pool);
+  rjson_pool *p = static_cast<rjson_pool *>(lua_touserdata(lua, -1));
+  lua_pop(lua, 1);
+  return p && !p->closed ? p : NULL;
+}
+
+
+static void acquire_rjson(lua_State *lua, rjson *j)
+{
+  rjson_pool *p = get_pool(lua);
+  if (p && p->cnt > 0) {
+    *j = p->items[--p->cnt];
+    p->retained -= j->chunk.capacity + j->insitu.capacity;
+    return;
+  }
+  init_rjson(j);
 }
 
 
@@ -126,6 +179,17 @@ static int iter_gc(lua_State *lua)
 }
 
 
+static int stream_gc(lua_State *lua)
+{
+  rjson_stream *rs = static_cast<rjson_stream *>
+      (luaL_checkudata(lua, 1, mozsvc_rjson_stream));
+  delete(rs->ms);
+  delete(rs->fs);
+  free(rs->buf);
+  return 0;
+}
+
+
 static void delete_owned_refs(std::unordered_map<rj::Value *, bool> *refs)
 {
   auto end = refs->end();
@@ -138,19 +202,142 @@ static void delete_owned_refs(std::unordered_map<rj::Value *, bool> *refs)
 }
 
 
-static int rjson_gc(lua_State *lua)
+static void reset_rjson(rjson *j)
+{
+  delete(j->val);
+  j->val = NULL;
+  j->insitu.len = 0;
+  delete_owned_refs(j->refs);
+  j->refs->clear();
+  if (j->doc) j->doc->SetNull(); // don't leave the root pointing into the pool
+  j->mpa->Clear();
+}
+
+
+static void free_rjson(rjson *j)
 {
-  rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
   delete_owned_refs(j->refs);
   delete(j->refs);
   delete(j->val);
   delete(j->doc);
   RAPIDJSON_DELETE(j->mpa);
   free(j->insitu.buf);
+  free(j->chunk.buf);
+}
+
+
+static void trim_pool(rjson_pool *p)
+{
+  while (p->cnt > 0 && (p->cnt > p->max_items
+                        || p->retained > p->max_retained)) {
+    rjson *j = &p->items[--p->cnt];
+    p->retained -= j->chunk.capacity + j->insitu.capacity;
+    free_rjson(j);
+  }
+}
+
+
+/**
+ * Returns a parsed document's resources to the pool. The allocator is rebuilt
+ * on a single user buffer sized to the previous high-water mark so the chunks
+ * are retained by MemoryPoolAllocator::Clear() on the next parse.
+ */
+static bool release_rjson(lua_State *lua, rjson *j)
+{
+  if (!j->doc) return false;
+  rjson_pool *p = get_pool(lua);
+  if (!p || p->cnt >= p->max_items) return false;
+
+  size_t hwm = j->mpa->Capacity();
+  reset_rjson(j);
+  size_t avail = p->max_retained - p->retained;
+  if (hwm > j->chunk.capacity && hwm + j->insitu.capacity <= avail) {
+    delete(j->doc);
+    RAPIDJSON_DELETE(j->mpa);
+    unsigned char *tmp = static_cast<unsigned char *>(realloc(j->chunk.buf, hwm));
+    if (tmp) {
+      j->chunk.buf = tmp;
+      j->chunk.capacity = hwm;
+      j->mpa = new rj::MemoryPoolAllocator<>(j->chunk.buf, j->chunk.capacity);
+    } else {
+      free(j->chunk.buf);
+      init_rjson_buffer(&j->chunk);
+      j->mpa = new rj::MemoryPoolAllocator<>;
+    }
+    j->doc = new rj::Document(j->mpa);
+  }
+
+  size_t size = j->chunk.capacity + j->insitu.capacity;
+  if (size > avail) return false;
+  p->items[p->cnt++] = *j;
+  p->retained += size;
+  return true;
+}
+
+
+static int rjson_gc(lua_State *lua)
+{
+  rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
+  if (!release_rjson(lua, j)) {
+    free_rjson(j);
+  }
   return 0;
 }
 
 
+static int pool_gc(lua_State *lua)
+{
+  rjson_pool *p = static_cast<rjson_pool *>
+      (luaL_checkudata(lua, 1, mozsvc_rjson_pool));
+  p->max_items = 0;
+  trim_pool(p);
+  free(p->items);
+  p->items = NULL;
+  p->closed = true; // documents finalized after this point are freed directly
+  return 0;
+}
+
+
+static int rjson_set_pool_limits(lua_State *lua)
+{
+  lua_Integer max_items = luaL_checkinteger(lua, 1);
+  luaL_argcheck(lua, max_items >= 0 && max_items <= 1024, 1,
+                "must be between 0 and 1024");
+  lua_Number max_retained = luaL_checknumber(lua, 2);
+  luaL_argcheck(lua, max_retained >= 0, 2, "must be >= 0");
+
+  rjson_pool *p = get_pool(lua);
+  if (!p) return luaL_error(lua, "pool is not available");
+  p->max_items = static_cast<int>(max_items);
+  p->max_retained = static_cast<size_t>(max_retained);
+  trim_pool(p);
+
+  if (max_items == 0) {
+    free(p->items);
+    p->items = NULL;
+    return 0;
+  }
+  rjson *tmp = static_cast<rjson *>
+      (realloc(p->items, sizeof(rjson) * static_cast<size_t>(max_items)));
+  if (!tmp) {
+    p->max_items = p->cnt; // the original allocation is still intact
+    return luaL_error(lua, "memory allocation failed");
+  }
+  p->items = tmp;
+  return 0;
+}
+
+
+static int rjson_pool_stats(lua_State *lua)
+{
+  rjson_pool *p = get_pool(lua);
+  if (!p) return luaL_error(lua, "pool is not available");
+  lua_pushinteger(lua, p->cnt);
+  lua_pushnumber(lua, (lua_Number)p->retained);
+  return 2;
+}
+
+
 static int rjson_parse_schema(lua_State *lua)
 {
   const char *json = luaL_checkstring(lua, 1);
@@ -188,7 +375,7 @@ static int rjson_parse(lua_State *lua)
     luaL_typerror(lua, 2, "boolean");
   }
   rjson *j = static_cast<rjson *>(lua_newuserdata(lua, sizeof*j));
-  init_rjson(j);
+  acquire_rjson(lua, j);
   luaL_getmetatable(lua, mozsvc_rjson);
   lua_setmetatable(lua, -2);
 
@@ -220,12 +407,7 @@ static int rjson_parse(lua_State *lua)
 static int rjson_dparse(lua_State *lua)
 {
   rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
-  delete(j->val);
-  j->val = NULL;
-  j->insitu.len = 0;
-  delete_owned_refs(j->refs);
-  j->refs->clear();
-  j->mpa->Clear();
+  reset_rjson(j);
 
   const char *json = luaL_checkstring(lua, 2);
   bool validate = false;
@@ -257,6 +439,150 @@ static int rjson_dparse(lua_State *lua)
 }
 
 
+static size_t resync_stream(rjson_stream *rs, rj::MemoryStream &s,
+                            size_t start)
+{
+  s.src_ = s.begin_ + start;
+  while (s.Peek() != '\0' && s.Take() != '\n') { }
+  return rs->base + s.Tell();
+}
+
+
+static size_t resync_stream(rjson_stream *rs, rj::FileReadStream &s,
+                            size_t start)
+{
+  size_t pos = rs->base + start;
+  if (fseek(rs->fh, static_cast<long>(pos), SEEK_SET) == 0) {
+    s = rj::FileReadStream(rs->fh, rs->buf, STREAM_BUFFER_SIZE);
+    rs->base = pos;
+  } // else not seekable, resynchronize from the error position
+  while (s.Peek() != '\0' && s.Take() != '\n') { }
+  return rs->base + s.Tell();
+}
+
+
+template<typename Stream>
+static int stream_next(lua_State *lua, rjson_stream *rs, rjson *j, Stream &s)
+{
+  reset_rjson(j);
+  for (char c = s.Peek(); c == ' ' || c == '\n' || c == '\r' || c == '\t';
+       c = s.Peek()) {
+    s.Take();
+  }
+  size_t start = s.Tell();
+  if (rs->validate) {
+    j->doc->ParseStream<rj::kParseValidateEncodingFlag | rj::kParseStopWhenDoneFlag>(s);
+  } else {
+    j->doc->ParseStream<rj::kParseStopWhenDoneFlag>(s);
+  }
+
+  if (!j->doc->HasParseError()) {
+    j->refs->insert(std::make_pair(j->doc, false));
+    lua_pushvalue(lua, lua_upvalueindex(2));
+    lua_pushnumber(lua, (lua_Number)(rs->base + s.Tell()));
+    return 2;
+  }
+
+  // the input is exhausted; any partial document is left unconsumed so it can
+  // be picked up from the last reported offset once it is complete
+  if (s.Peek() == '\0') {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  lua_pushboolean(lua, false);
+  size_t eo = rs->base + j->doc->GetErrorOffset();
+  // resynchronize on the line after the start of the failed document, the
+  // error may be reported on the following line (e.g. a truncated line)
+  lua_pushnumber(lua, (lua_Number)resync_stream(rs, s, start));
+  lua_pushfstring(lua, "failed to parse offset:%f %s", (lua_Number)eo,
+                  rj::GetParseError_En(j->doc->GetParseError()));
+  return 3;
+}
+
+
+static int rjson_stream_iter(lua_State *lua)
+{
+  rjson_stream *rs = static_cast<rjson_stream *>
+      (lua_touserdata(lua, lua_upvalueindex(1)));
+  rjson *j = static_cast<rjson *>(lua_touserdata(lua, lua_upvalueindex(2)));
+
+  if (rs->fs) {
+    FILE **fh = static_cast<FILE **>(lua_touserdata(lua, lua_upvalueindex(3)));
+    if (*fh != rs->fh) {
+      return luaL_error(lua, "iterator has been invalidated");
+    }
+    return stream_next(lua, rs, j, *rs->fs);
+  }
+  return stream_next(lua, rs, j, *rs->ms);
+}
+
+
+static int rjson_parse_stream(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= 1 && n <= 3, 0, "invalid number of arguments");
+  lua_Number offset = luaL_optnumber(lua, 2, 0);
+  luaL_argcheck(lua, offset >= 0, 2, "offset must be >= 0");
+  bool validate = false;
+  int t = lua_type(lua, 3);
+  if (t == LUA_TNONE || t == LUA_TNIL || t == LUA_TBOOLEAN) {
+    validate = lua_toboolean(lua, 3);
+  } else {
+    luaL_typerror(lua, 3, "boolean");
+  }
+
+  rjson_stream *rs = static_cast<rjson_stream *>(lua_newuserdata(lua, sizeof*rs));
+  rs->ms = NULL;
+  rs->fs = NULL;
+  rs->fh = NULL;
+  rs->buf = NULL;
+  rs->base = 0;
+  rs->validate = validate;
+  luaL_getmetatable(lua, mozsvc_rjson_stream);
+  lua_setmetatable(lua, -2);
+
+  if (lua_type(lua, 1) == LUA_TSTRING) {
+    size_t len;
+    const char *json = lua_tolstring(lua, 1, &len);
+    rs->base = offset < len ? static_cast<size_t>(offset) : len;
+    rs->ms = new rj::MemoryStream(json + rs->base, len - rs->base);
+  } else {
+    FILE **fh = static_cast<FILE **>(luaL_checkudata(lua, 1, LUA_FILEHANDLE));
+    if (!*fh) {
+      return luaL_error(lua, "attempt to use a closed file");
+    }
+    if (n >= 2 && !lua_isnil(lua, 2)) {
+      if (fseek(*fh, static_cast<long>(offset), SEEK_SET)) {
+        return luaL_error(lua, "seek failed");
+      }
+    }
+    long pos = ftell(*fh);
+    rs->base = pos > 0 ? static_cast<size_t>(pos) : 0;
+    rs->fh = *fh;
+    rs->buf = static_cast<char *>(malloc(STREAM_BUFFER_SIZE));
+    if (rs->buf) {
+      rs->fs = new rj::FileReadStream(rs->fh, rs->buf, STREAM_BUFFER_SIZE);
+    }
+  }
+  if (!rs->ms && !rs->fs) {
+    return luaL_error(lua, "memory allocation failed");
+  }
+
+  rjson *j = static_cast<rjson *>(lua_newuserdata(lua, sizeof*j));
+  acquire_rjson(lua, j);
+  luaL_getmetatable(lua, mozsvc_rjson);
+  lua_setmetatable(lua, -2);
+  if (!j->doc || !j->refs) {
+    return luaL_error(lua, "memory allocation failed");
+  }
+
+  lua_pushvalue(lua, 1); // keep the source alive for the life of the iterator
+  lua_pushcclosure(lua, rjson_stream_iter, 3);
+  return 1;
+}
+
+
 static int rjson_validate(lua_State *lua)
 {
   rjson *j = static_cast<rjson *>
@@ -619,6 +945,7 @@ static int rjson_remove(lua_State *lua)
   nv->val = new rj::Value(*v, *nv->mpa); // deep copy
   nv->refs = new std::unordered_map<rj::Value *, bool>;
   init_rjson_buffer(&nv->insitu);
+  init_rjson_buffer(&nv->chunk);
   luaL_getmetatable(lua, mozsvc_rjson);
   lua_setmetatable(lua, -2);
   delete(v);
@@ -644,6 +971,501 @@ static int rjson_remove_shallow(lua_State *lua)
 }
 
 
+static void erase_child_refs(std::unordered_map<rj::Value *, bool> *refs,
+                             rj::Value *v, bool recurse)
+{
+  if (refs->size() <= 1) return; // nothing but the root has been referenced
+
+  if (v->IsObject()) {
+    for (rj::Value::MemberIterator it = v->MemberBegin(); it != v->MemberEnd();
+         ++it) {
+      refs->erase(&it->value);
+      if (recurse) erase_child_refs(refs, &it->value, recurse);
+    }
+  } else if (v->IsArray()) {
+    for (rj::Value::ValueIterator it = v->Begin(); it != v->End(); ++it) {
+      refs->erase(it);
+      if (recurse) erase_child_refs(refs, it, recurse);
+    }
+  }
+}
+
+
+static const int MAX_NESTING = 128;
+
+static const char* lua_to_value(lua_State *lua, int idx, rjson *j,
+                                rj::Value *v, int depth)
+{
+  switch (lua_type(lua, idx)) {
+  case LUA_TNIL:
+    v->SetNull();
+    break;
+  case LUA_TBOOLEAN:
+    v->SetBool(lua_toboolean(lua, idx));
+    break;
+  case LUA_TNUMBER:
+    {
+      lua_Number d = lua_tonumber(lua, idx);
+      if (!std::isfinite(d)) {
+        return "NaN and Inf are not valid JSON numbers";
+      }
+      if (d == std::floor(d) && d >= -9223372036854775808.0
+          && d < 9223372036854775808.0) {
+        v->SetInt64(static_cast<int64_t>(d));
+      } else {
+        v->SetDouble(d);
+      }
+    }
+    break;
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(lua, idx, &len);
+      v->SetString(s, static_cast<rj::SizeType>(len), *j->mpa);
+    }
+    break;
+  case LUA_TLIGHTUSERDATA:
+    {
+      rj::Value *src = static_cast<rj::Value *>(lua_touserdata(lua, idx));
+      if (j->refs->find(src) == j->refs->end()) {
+        return "invalid value";
+      }
+      v->CopyFrom(*src, *j->mpa);
+    }
+    break;
+  case LUA_TUSERDATA:
+    {
+      rjson *src = static_cast<rjson *>(luaL_checkudata(lua, idx, mozsvc_rjson));
+      rj::Value *sv = src->doc ? src->doc : src->val;
+      v->CopyFrom(*sv, *j->mpa);
+    }
+    break;
+  case LUA_TTABLE:
+    {
+      if (depth >= MAX_NESTING) {
+        return "maximum nesting depth exceeded";
+      }
+      if (!lua_checkstack(lua, 3)) {
+        return "stack overflow";
+      }
+      if (idx < 0) idx = lua_gettop(lua) + idx + 1;
+
+      // a table is an array when its keys are exactly 1..n
+      size_t n = lua_objlen(lua, idx);
+      size_t cnt = 0;
+      bool is_array = n > 0;
+      lua_pushnil(lua);
+      while (lua_next(lua, idx) != 0) {
+        ++cnt;
+        if (lua_type(lua, -2) != LUA_TNUMBER) {
+          is_array = false;
+        }
+        lua_pop(lua, 1);
+      }
+      if (cnt != n) is_array = false;
+
+      if (is_array) {
+        v->SetArray();
+        v->Reserve(static_cast<rj::SizeType>(n), *j->mpa);
+        for (size_t i = 1; i <= n; ++i) {
+          lua_rawgeti(lua, idx, static_cast<int>(i));
+          rj::Value item;
+          const char *err = lua_to_value(lua, -1, j, &item, depth + 1);
+          lua_pop(lua, 1);
+          if (err) return err;
+          v->PushBack(item, *j->mpa);
+        }
+      } else {
+        v->SetObject();
+        lua_pushnil(lua);
+        while (lua_next(lua, idx) != 0) {
+          if (lua_type(lua, -2) != LUA_TSTRING) {
+            lua_pop(lua, 2);
+            return "object keys must be strings";
+          }
+          size_t len;
+          const char *key = lua_tolstring(lua, -2, &len);
+          rj::Value name(key, static_cast<rj::SizeType>(len), *j->mpa);
+          rj::Value item;
+          const char *err = lua_to_value(lua, -1, j, &item, depth + 1);
+          lua_pop(lua, 1);
+          if (err) {
+            lua_pop(lua, 1);
+            return err;
+          }
+          v->AddMember(name, item, *j->mpa);
+        }
+      }
+    }
+    break;
+  default:
+    return "unsupported type";
+  }
+  return NULL;
+}
+
+
+static rjson* check_mutable(lua_State *lua, int nargs, rj::Value **v)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n == nargs || n == nargs + 1, 0,
+                "invalid number of arguments");
+  rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
+  if (n == nargs) {
+    *v = j->doc ? j->doc : j->val;
+  } else {
+    luaL_checktype(lua, 2, LUA_TLIGHTUSERDATA);
+    *v = static_cast<rj::Value *>(lua_touserdata(lua, 2));
+    if (j->refs->find(*v) == j->refs->end()) {
+      luaL_error(lua, "invalid value");
+    }
+  }
+  return j;
+}
+
+
+static void push_ref(lua_State *lua, rjson *j, rj::Value *v)
+{
+  j->refs->insert(std::make_pair(v, false));
+  lua_pushlightuserdata(lua, v);
+}
+
+
+static int rjson_set(lua_State *lua)
+{
+  rj::Value *v;
+  rjson *j = check_mutable(lua, 2, &v);
+
+  const char *err;
+  { // allows the value to be destroyed before the longjmp
+    rj::Value nv;
+    err = lua_to_value(lua, lua_gettop(lua), j, &nv, 0);
+    if (!err) {
+      erase_child_refs(j->refs, v, true);
+      *v = nv;
+    }
+  }
+  if (err) return luaL_error(lua, "set() %s", err);
+  push_ref(lua, j, v);
+  return 1;
+}
+
+
+static int rjson_add_member(lua_State *lua)
+{
+  rj::Value *v;
+  rjson *j = check_mutable(lua, 3, &v);
+  int n = lua_gettop(lua);
+  size_t len;
+  const char *key = luaL_checklstring(lua, n - 1, &len);
+  if (!v->IsObject()) {
+    return luaL_error(lua, "add_member() not allowed on a non object");
+  }
+
+  rj::Value *rv = NULL;
+  const char *err;
+  {
+    rj::Value nv;
+    err = lua_to_value(lua, n, j, &nv, 0);
+    if (!err) {
+      rj::Value name(key, static_cast<rj::SizeType>(len), *j->mpa);
+      rj::Value::MemberIterator it = v->FindMember(name);
+      if (it != v->MemberEnd()) {
+        erase_child_refs(j->refs, &it->value, true);
+        it->value = nv;
+        rv = &it->value;
+      } else {
+        erase_child_refs(j->refs, v, false); // the members may be relocated
+        v->AddMember(name, nv, *j->mpa);
+        rv = &(v->MemberEnd() - 1)->value;
+      }
+    }
+  }
+  if (err) return luaL_error(lua, "add_member() %s", err);
+  push_ref(lua, j, rv);
+  return 1;
+}
+
+
+static int rjson_push_back(lua_State *lua)
+{
+  rj::Value *v;
+  rjson *j = check_mutable(lua, 2, &v);
+  if (!v->IsArray()) {
+    return luaL_error(lua, "push_back() not allowed on a non array");
+  }
+
+  rj::Value *rv = NULL;
+  const char *err;
+  {
+    rj::Value nv;
+    err = lua_to_value(lua, lua_gettop(lua), j, &nv, 0);
+    if (!err) {
+      if (v->Size() == v->Capacity()) {
+        erase_child_refs(j->refs, v, false); // the elements will be relocated
+      }
+      v->PushBack(nv, *j->mpa);
+      rv = &(*v)[v->Size() - 1];
+    }
+  }
+  if (err) return luaL_error(lua, "push_back() %s", err);
+  push_ref(lua, j, rv);
+  return 1;
+}
+
+
+static int rjson_rename(lua_State *lua)
+{
+  rj::Value *v;
+  rjson *j = check_mutable(lua, 3, &v);
+  int n = lua_gettop(lua);
+  size_t olen, nlen;
+  const char *okey = luaL_checklstring(lua, n - 1, &olen);
+  const char *nkey = luaL_checklstring(lua, n, &nlen);
+  if (!v->IsObject()) {
+    return luaL_error(lua, "rename() not allowed on a non object");
+  }
+
+  rj::Value oname(rj::StringRef(okey, static_cast<rj::SizeType>(olen)));
+  rj::Value nname(rj::StringRef(nkey, static_cast<rj::SizeType>(nlen)));
+  rj::Value::MemberIterator it = v->FindMember(oname);
+  if (it == v->MemberEnd()) {
+    lua_pushboolean(lua, false);
+    return 1;
+  }
+  if (oname != nname) {
+    rj::Value::MemberIterator dup = v->FindMember(nname);
+    if (dup != v->MemberEnd()) {
+      erase_child_refs(j->refs, v, false); // the members will be shifted
+      v->EraseMember(dup);
+      it = v->FindMember(oname);
+    }
+    it->name.SetString(nkey, static_cast<rj::SizeType>(nlen), *j->mpa);
+  }
+  lua_pushboolean(lua, true);
+  return 1;
+}
+
+
+typedef struct flatten_cfg
+{
+  rj::MemoryPoolAllocator<> *mpa;
+  const char                *delim;
+  size_t                    dlen;
+  int                       max_depth;
+  int                       scrub;  // stack index of the scrub key set (0 none)
+  int                       fields; // stack index of the output table
+} flatten_cfg;
+
+
+static int field_type(const rj::Value &v)
+{
+  switch (v.GetType()) {
+  case rj::kStringType:
+    return 1;
+  case rj::kNumberType:
+    return 2;
+  case rj::kFalseType:
+  case rj::kTrueType:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+
+static void push_json_string(lua_State *lua, rj::MemoryPoolAllocator<> *mpa,
+                             const rj::Value &v)
+{
+  typedef rj::GenericStringBuffer<rj::UTF8<>, rj::MemoryPoolAllocator<> > pool_buffer;
+  const char *json;
+  size_t len;
+  { // allows the buffers to be destroyed before the longjmp, the output is
+    // allocated from the document pool and remains valid until it is reset
+    pool_buffer sb(mpa);
+    rj::Writer<pool_buffer, rj::UTF8<>, rj::UTF8<>, rj::MemoryPoolAllocator<> >
+        writer(sb, mpa);
+    v.Accept(writer);
+    json = sb.GetString();
+    len = sb.GetSize();
+  }
+  lua_pushlstring(lua, json, len);
+}
+
+
+static void push_primitive(lua_State *lua, const rj::Value &v)
+{
+  switch (v.GetType()) {
+  case rj::kStringType:
+    lua_pushlstring(lua, v.GetString(), (size_t)v.GetStringLength());
+    break;
+  case rj::kNumberType:
+    lua_pushnumber(lua, (lua_Number)v.GetDouble());
+    break;
+  default:
+    lua_pushboolean(lua, v.GetBool());
+    break;
+  }
+}
+
+
+// Arrays of a single primitive type become a Heka field array, anything else
+// is preserved as a JSON string.
+static void push_array(lua_State *lua, flatten_cfg *cfg, const rj::Value &v)
+{
+  rj::SizeType size = v.Size();
+  int type = size ? field_type(v[0]) : 0;
+  for (rj::SizeType i = 1; type && i < size; ++i) {
+    if (field_type(v[i]) != type) type = 0;
+  }
+  if (!type) {
+    push_json_string(lua, cfg->mpa, v);
+    return;
+  }
+  lua_createtable(lua, static_cast<int>(size), 0);
+  for (rj::SizeType i = 0; i < size; ++i) {
+    push_primitive(lua, v[i]);
+    lua_rawseti(lua, -2, static_cast<int>(i + 1));
+  }
+}
+
+
+// The keys are built as Lua strings on the stack (prefix is the stack index
+// of the parent key, 0 for none) so no C++ object is live across a Lua call
+// that can raise an error.
+static void flatten(lua_State *lua, flatten_cfg *cfg, const rj::Value &v,
+                    int prefix, int depth)
+{
+  luaL_checkstack(lua, 4, "to_fields nesting is too deep");
+  for (rj::Value::ConstMemberIterator it = v.MemberBegin();
+       it != v.MemberEnd(); ++it) {
+    if (prefix) {
+      lua_pushvalue(lua, prefix);
+      lua_pushlstring(lua, cfg->delim, cfg->dlen);
+      lua_pushlstring(lua, it->name.GetString(), it->name.GetStringLength());
+      lua_concat(lua, 3);
+    } else {
+      lua_pushlstring(lua, it->name.GetString(), it->name.GetStringLength());
+    }
+    int key = lua_gettop(lua);
+
+    bool scrubbed = false;
+    if (cfg->scrub) {
+      lua_pushvalue(lua, key);
+      lua_rawget(lua, cfg->scrub);
+      scrubbed = !lua_isnil(lua, -1);
+      lua_pop(lua, 1);
+    }
+
+    if (!scrubbed) {
+      const rj::Value &mv = it->value;
+      switch (mv.GetType()) {
+      case rj::kNullType:
+        break;
+      case rj::kObjectType:
+        if (cfg->max_depth && depth >= cfg->max_depth) {
+          lua_pushvalue(lua, key);
+          push_json_string(lua, cfg->mpa, mv);
+          lua_rawset(lua, cfg->fields);
+        } else {
+          flatten(lua, cfg, mv, lua_objlen(lua, key) ? key : 0, depth + 1);
+        }
+        break;
+      case rj::kArrayType:
+        lua_pushvalue(lua, key);
+        push_array(lua, cfg, mv);
+        lua_rawset(lua, cfg->fields);
+        break;
+      default:
+        lua_pushvalue(lua, key);
+        push_primitive(lua, mv);
+        lua_rawset(lua, cfg->fields);
+        break;
+      }
+    }
+    lua_pop(lua, 1); // key
+  }
+}
+
+
+static int rjson_to_fields(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= 1 && n <= 3, 0, "invalid number of arguments");
+  rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
+  rj::Value *v = j->doc ? j->doc : j->val;
+  int idx = 2;
+  if (lua_type(lua, 2) == LUA_TLIGHTUSERDATA) {
+    v = static_cast<rj::Value *>(lua_touserdata(lua, 2));
+    if (j->refs->find(v) == j->refs->end()) {
+      return luaL_error(lua, "invalid value");
+    }
+    idx = 3;
+  }
+  if (!v->IsObject()) {
+    return luaL_error(lua, "to_fields() not allowed on a non object");
+  }
+  int t = lua_type(lua, idx);
+  if (t != LUA_TTABLE && t != LUA_TNONE && t != LUA_TNIL) {
+    return luaL_typerror(lua, idx, "table");
+  }
+
+  flatten_cfg cfg;
+  cfg.mpa = j->mpa;
+  cfg.delim = ".";
+  cfg.dlen = 1;
+  cfg.max_depth = 0;
+  cfg.scrub = 0;
+  int prefix = 0;
+  if (t == LUA_TTABLE) {
+    // the option values are left on the stack to anchor the strings
+    lua_getfield(lua, idx, "delimiter");
+    if (lua_type(lua, -1) == LUA_TSTRING) {
+      cfg.delim = lua_tolstring(lua, -1, &cfg.dlen);
+    }
+    lua_getfield(lua, idx, "max_depth");
+    luaL_argcheck(lua, lua_isnoneornil(lua, -1)
+                  || lua_type(lua, -1) == LUA_TNUMBER, idx,
+                  "max_depth must be a number");
+    lua_Number depth = lua_tonumber(lua, -1);
+    luaL_argcheck(lua, depth >= 0 && depth <= INT_MAX, idx,
+                  "max_depth must be >= 0");
+    cfg.max_depth = static_cast<int>(depth);
+    lua_getfield(lua, idx, "prefix");
+    if (lua_type(lua, -1) == LUA_TSTRING && lua_objlen(lua, -1) > 0) {
+      prefix = lua_gettop(lua);
+    }
+
+    lua_getfield(lua, idx, "scrub");
+    if (lua_type(lua, -1) == LUA_TTABLE) {
+      int len = static_cast<int>(lua_objlen(lua, -1));
+      lua_createtable(lua, 0, len);
+      for (int i = 1; i <= len; ++i) {
+        lua_rawgeti(lua, -2, i);
+        if (lua_type(lua, -1) == LUA_TSTRING) {
+          lua_pushboolean(lua, 1);
+          lua_rawset(lua, -3);
+        } else {
+          lua_pop(lua, 1);
+        }
+      }
+      cfg.scrub = lua_gettop(lua);
+    }
+
+    lua_getfield(lua, idx, "fields");
+    if (lua_type(lua, -1) != LUA_TTABLE) {
+      lua_pop(lua, 1);
+      lua_newtable(lua);
+    }
+  } else {
+    lua_newtable(lua);
+  }
+  cfg.fields = lua_gettop(lua);
+  flatten(lua, &cfg, *v, prefix, 1);
+  return 1;
+}
+
+
 #ifdef LUA_SANDBOX
 #ifdef HAVE_ZLIB
 bool ungzip(const char *s, size_t s_len, size_t max_len, rjson_buffer *b)
@@ -731,10 +1553,36 @@ public:
 #endif
   void Put(Ch c)
   {
+#ifdef RJSON_FAST_OUTPUT
+    // leave room for the terminator written by Flush
+    if (ob_->pos + 1 < ob_->size) {
+      ob_->buf[ob_->pos++] = c;
+      return;
+    }
+#endif
     const char *err = lsb_outputc(ob_, c);
     if (err) err_ = err;
   }
-  void Flush() { return; }
+
+  void PutN(const Ch *s, size_t len)
+  {
+    const char *err = lsb_outputs(ob_, s, len);
+    if (err) err_ = err;
+  }
+
+  // Grows the buffer ahead of a run of Put calls; a failure is not an error
+  // since the data may still fit, Put will report it if it does not.
+  void Reserve(size_t count)
+  {
+    if (ob_->size - ob_->pos <= count) {
+      lsb_expand_output_buffer(ob_, count + 1);
+    }
+  }
+
+  void Flush()
+  {
+    if (ob_->pos < ob_->size) ob_->buf[ob_->pos] = 0;
+  }
   const char* GetError() { return err_; }
 private:
   OutputBufferWrapper(const OutputBufferWrapper&);
@@ -743,6 +1591,105 @@ private:
   const char *err_;
 };
 
+#ifdef RJSON_FAST_OUTPUT
+namespace rapidjson {
+template<>
+inline void PutReserve(OutputBufferWrapper &stream, size_t count)
+{
+  stream.Reserve(count);
+}
+
+template<>
+inline void PutUnsafe(OutputBufferWrapper &stream, char c)
+{
+  stream.Put(c);
+}
+}
+#endif
+
+
+/**
+ * RapidJSON writer that copies unescaped string runs into the output buffer
+ * with a single memcpy instead of writing them a character at a time.
+ */
+class OutputBufferWriter : public rj::Writer<OutputBufferWrapper> {
+public:
+  OutputBufferWriter(OutputBufferWrapper &os) : rj::Writer<OutputBufferWrapper>(os) { }
+
+  bool String(const Ch *str, rj::SizeType length, bool copy = false)
+  {
+    (void)copy;
+    Prefix(rj::kStringType);
+    WriteEscapedString(str, length);
+    return true;
+  }
+
+  bool Key(const Ch *str, rj::SizeType length, bool copy = false)
+  {
+    return String(str, length, copy);
+  }
+
+#ifdef RJSON_FAST_NUMBERS
+  bool Double(double d)
+  {
+    // integral values produce the same output as Grisu2 ("42.0") without the
+    // cost of the floating point conversion
+    if (d != 0 && d > -9007199254740992.0 && d < 9007199254740992.0
+        && d == static_cast<double>(static_cast<int64_t>(d))) {
+      Prefix(rj::kNumberType);
+      char buf[24];
+      char *end = rj::internal::i64toa(static_cast<int64_t>(d), buf);
+      *end++ = '.';
+      *end++ = '0';
+      os_->PutN(buf, static_cast<size_t>(end - buf));
+      return true;
+    }
+    return rj::Writer<OutputBufferWrapper>::Double(d);
+  }
+#endif
+
+private:
+  OutputBufferWriter(const OutputBufferWriter&);
+  OutputBufferWriter& operator=(const OutputBufferWriter&);
+
+  void WriteEscapedString(const Ch *str, rj::SizeType length)
+  {
+    static const char hex[] = "0123456789ABCDEF";
+    static const char escape[256] = {
+#define Z16 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+      'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u', // 00
+      'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', // 10
+      0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                               // 20
+      Z16, Z16,                                                                       // 30~4F
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,                              // 50
+      Z16, Z16, Z16, Z16, Z16, Z16, Z16, Z16, Z16, Z16                                // 60~FF
+#undef Z16
+    };
+
+    os_->Reserve(length + 2);
+    os_->Put('"');
+    const Ch *run = str;
+    const Ch *end = str + length;
+    for (const Ch *p = str; p != end; ++p) {
+      unsigned char c = static_cast<unsigned char>(*p);
+      if (!escape[c]) continue;
+
+      if (p != run) os_->PutN(run, static_cast<size_t>(p - run));
+      run = p + 1;
+      if (escape[c] == 'u') {
+        const char seq[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+        os_->PutN(seq, sizeof(seq));
+      } else {
+        const char seq[2] = { '\\', escape[c] };
+        os_->PutN(seq, sizeof(seq));
+      }
+    }
+    if (end != run) os_->PutN(run, static_cast<size_t>(end - run));
+    os_->Put('"');
+  }
+};
+
+
 static int rjson_make_field(lua_State *lua)
 {
   rj::Value *v = check_value(lua);
@@ -779,8 +1726,13 @@ static int output_rjson(lua_State *lua)
     }
   }
   OutputBufferWrapper obw(ob);
-  rapidjson::Writer<OutputBufferWrapper> writer(obw);
+#ifdef RJSON_FAST_OUTPUT
+  OutputBufferWriter writer(obw);
+#else
+  rj::Writer<OutputBufferWrapper> writer(obw); // baseline for the benchmark
+#endif
   v->Accept(writer);
+  obw.Flush();
   return obw.GetError() == NULL ? 0 : 1;
 }
 
@@ -907,7 +1859,7 @@ static int rjson_parse_message(lua_State *lua)
   if (!json.s) return luaL_error(lua, "field not found");
 
   rjson *j = static_cast<rjson *>(lua_newuserdata(lua, sizeof*j));
-  init_rjson(j);
+  acquire_rjson(lua, j);
   luaL_getmetatable(lua, mozsvc_rjson);
   lua_setmetatable(lua, -2);
 
@@ -933,12 +1885,7 @@ static int rjson_dparse_message(lua_State *lua)
   int idx = 2;
 
   rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
-  delete(j->val);
-  j->val = NULL;
-  j->insitu.len = 0;
-  delete_owned_refs(j->refs);
-  j->refs->clear();
-  j->mpa->Clear();
+  reset_rjson(j);
 
   const lsb_heka_message *msg = NULL;
   if (lsb_heka_get_type(hsb) == 'i') {
@@ -986,6 +1933,20 @@ static const struct luaL_reg iterlib_m[] =
 };
 
 
+static const struct luaL_reg poollib_m[] =
+{
+  { "__gc", pool_gc },
+  { NULL, NULL }
+};
+
+
+static const struct luaL_reg streamlib_m[] =
+{
+  { "__gc", stream_gc },
+  { NULL, NULL }
+};
+
+
 static int rjson_version(lua_State *lua)
 {
   lua_pushstring(lua, DIST_VERSION);
@@ -997,6 +1958,9 @@ static const struct luaL_reg rjsonlib_f[] =
 {
   { "parse_schema", rjson_parse_schema },
   { "parse", rjson_parse },
+  { "parse_stream", rjson_parse_stream },
+  { "set_pool_limits", rjson_set_pool_limits },
+  { "pool_stats", rjson_pool_stats },
   { "version", rjson_version },
   { NULL, NULL }
 };
@@ -1013,6 +1977,11 @@ static const struct luaL_reg rjsonlib_m[] =
   { "size", rjson_size },
   { "remove", rjson_remove },
   { "remove_shallow", rjson_remove_shallow },
+  { "set", rjson_set },
+  { "add_member", rjson_add_member },
+  { "push_back", rjson_push_back },
+  { "rename", rjson_rename },
+  { "to_fields", rjson_to_fields },
   { "__gc", rjson_gc },
   { NULL, NULL }
 };
@@ -1037,6 +2006,33 @@ int luaopen_rjson(lua_State *lua)
   luaL_register(lua, NULL, iterlib_m);
   lua_pop(lua, 1);
 
+  luaL_newmetatable(lua, mozsvc_rjson_pool);
+  luaL_register(lua, NULL, poollib_m);
+  lua_pop(lua, 1);
+
+  lua_getfield(lua, LUA_REGISTRYINDEX, mozsvc_rjson_pool);
+  if (lua_isnil(lua, -1)) {
+    rjson_pool *p = static_cast<rjson_pool *>(lua_newuserdata(lua, sizeof*p));
+    p->items = NULL;
+    p->cnt = 0;
+    p->max_items = 0;
+    p->retained = 0;
+    p->max_retained = POOL_MAX_RETAINED;
+    p->closed = false;
+    luaL_getmetatable(lua, mozsvc_rjson_pool);
+    lua_setmetatable(lua, -2);
+    p->items = static_cast<rjson *>(malloc(sizeof(rjson) * POOL_MAX_DOCUMENTS));
+    if (p->items) p->max_items = POOL_MAX_DOCUMENTS;
+    lua_setfield(lua, LUA_REGISTRYINDEX, mozsvc_rjson_pool);
+  }
+  lua_pop(lua, 1);
+
+  luaL_newmetatable(lua, mozsvc_rjson_stream);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, streamlib_m);
+  lua_pop(lua, 1);
+
   luaL_newmetatable(lua, mozsvc_rjson);
   lua_pushvalue(lua, -1);
   lua_setfield(lua, -2, "__index");
@@ -8,6 +8,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <luasandbox/heka/sandbox.h>
 #include <luasandbox/test/mu_test.h>
@@ -43,6 +45,34 @@ static int iim(void *parent, const char *pb, size_t pb_len, double cp_numeric,
 }
 
 
+static char *injected = NULL;
+static size_t injected_len = 0;
+
+static int iim_capture(void *parent, const char *pb, size_t pb_len,
+                       double cp_numeric, const char *cp_string)
+{
+  (void)parent;
+  (void)cp_numeric;
+  (void)cp_string;
+  free(injected);
+  injected = malloc(pb_len);
+  if (!injected) return 1;
+  memcpy(injected, pb, pb_len);
+  injected_len = pb_len;
+  return 0;
+}
+
+
+static bool contains(const char *s, size_t s_len, const char *needle)
+{
+  size_t len = strlen(needle);
+  for (size_t i = 0; len <= s_len && i <= s_len - len; ++i) {
+    if (memcmp(s + i, needle, len) == 0) return true;
+  }
+  return false;
+}
+
+
 static char* test_rjson()
 {
   lsb_heka_sandbox *hsb;
@@ -72,10 +102,62 @@ static char* test_rjson_sandbox()
 }
 
 
+static char* test_make_field()
+{
+  const char *expected = "{\"s\":\"a\\\"b\\\\c\\n\\u0001\xc3\xa9\","
+      "\"d\":1.0,\"n\":-2.5,\"e\":1000.0,\"i\":3,"
+      "\"a\":[true,false,null],\"o\":{}}";
+
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_input(NULL, "test_make_field.lua", NULL,
+                              "max_message_size = 8196\n"
+                              TEST_MODULE_PATH,
+                              &logger, iim_capture);
+  mu_assert(hsb, "lsb_heka_create_input failed");
+  mu_assert(0 == lsb_heka_pm_input(hsb, 0, NULL, false), "err: %s",
+            lsb_heka_get_error(hsb));
+  mu_assert(injected && contains(injected, injected_len, expected),
+            "expected: %s", expected);
+  e = lsb_heka_destroy_sandbox(hsb);
+  return NULL;
+}
+
+
+static char* benchmark_make_field()
+{
+  int iter = 10000;
+
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_input(NULL, "benchmark_make_field.lua", NULL,
+                              "max_message_size = 256 * 1024\n"
+                              TEST_MODULE_PATH,
+                              &logger, iim);
+  mu_assert(hsb, "lsb_heka_create_input failed");
+
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    mu_assert(0 == lsb_heka_pm_input(hsb, 0, NULL, false), "err: %s",
+              lsb_heka_get_error(hsb));
+  }
+  t = clock() - t;
+  e = lsb_heka_destroy_sandbox(hsb);
+#ifdef RJSON_FAST_OUTPUT
+  const char *path = "buffered";
+#else
+  const char *path = "baseline";
+#endif
+  printf("benchmark_make_field (%s) %g seconds\n", path,
+         ((double)t) / CLOCKS_PER_SEC / iter);
+  return NULL;
+}
+
+
 static char* all_tests()
 {
   mu_run_test(test_rjson);
   mu_run_test(test_rjson_sandbox);
+  mu_run_test(test_make_field);
+  mu_run_test(benchmark_make_field);
   return NULL;
 }
 
@@ -90,6 +172,7 @@ int main()
   }
   printf("Tests run: %d\n", mu_tests_run);
   free(e);
+  free(injected);
 
   return result != 0;
 }
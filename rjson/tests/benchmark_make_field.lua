@@ -0,0 +1,23 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "rjson"
+require "string"
+require "table"
+
+-- build a ~100KB document with a mix of long strings, short keys and numbers
+local items = {}
+for i = 1, 1000 do
+    items[i] = string.format(
+        '{"id":%d,"name":"item %d","score":%d.5,"count":%d.0,"tags":["a","b\\tc"],"text":"%s"}',
+        i, i, i, i, string.rep("x", 32))
+end
+local json = '{"items":[' .. table.concat(items, ",") .. '],"payload":"' .. string.rep("y", 10000) .. '"}'
+assert(#json > 100 * 1024, #json)
+local doc = rjson.parse(json)
+
+function process_message()
+    inject_message({Fields = {doc = doc:make_field()}})
+    return 0
+end
@@ -3,7 +3,7 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 require "rjson"
-assert(rjson.version() == "1.1.0", rjson.version())
+assert(rjson.version() == "1.2.0", rjson.version())
 
 schema_json = [[{
     "type":"object",
@@ -271,3 +271,199 @@ ok, err = pcall(rjson.parse, json)
 assert(ok, err)
 ok, err = pcall(rjson.parse, json, true)
 assert(not ok, "UTF-8 validation failed")
+
+-- mutation
+doc = rjson.parse('{"a":1,"b":{"c":[1,2]},"d":"x"}')
+c = doc:find("b", "c")
+ok, err = pcall(doc.push_back, doc, "foo")
+assert(err == "push_back() not allowed on a non array", err)
+e = doc:push_back(c, {foo = "bar"})
+assert(doc:size(c) == 3)
+assert(doc:value(doc:find(e, "foo")) == "bar")
+doc:push_back(c, 2.5)
+assert(doc:value(doc:find(c, 3)) == 2.5)
+
+v = doc:set(doc:find("a"), {1, "two", true})
+assert(doc:type(v) == "array")
+assert(doc:size(doc:find("a")) == 3)
+assert(doc:value(doc:find("a", 1)) == "two")
+ok, err = pcall(doc.set, doc, doc:find("a"), {[1] = 1, [3] = 3})
+assert(err == "set() object keys must be strings", err)
+ok, err = pcall(doc.set, doc, doc:find("a"), 0/0)
+assert(err == "set() NaN and Inf are not valid JSON numbers", err)
+ok, err = pcall(doc.set, doc, doc:find("a"), function() end)
+assert(err == "set() unsupported type", err)
+ok, err = pcall(doc.set, doc, doc1:find(), 1)
+assert(err == "invalid value", err)
+
+m = doc:add_member("meta", {})
+assert(doc:type(m) == "object")
+doc:add_member(m, "n", 1)
+doc:add_member(m, "n", 2) -- replace
+assert(doc:size(m) == 1)
+assert(doc:value(doc:find("meta", "n")) == 2)
+doc:add_member("copy", doc:find("b")) -- deep copy within the document
+doc:set(doc:find("b", "c"), nil)
+assert(doc:type(doc:find("b", "c")) == "null")
+assert(doc:size(doc:find("copy", "c")) == 4)
+doc:add_member("other", rjson.parse('[9]'))
+assert(doc:value(doc:find("other", 0)) == 9)
+ok, err = pcall(doc.add_member, doc, doc:find("d"), "k", 1)
+assert(err == "add_member() not allowed on a non object", err)
+
+assert(doc:rename("d", "e"))
+assert(not doc:find("d"))
+assert(doc:value(doc:find("e")) == "x")
+assert(not doc:rename("missing", "e"))
+assert(doc:rename("e", "meta"))
+assert(doc:value(doc:find("meta")) == "x")
+
+doc:set({root = true})
+assert(doc:size() == 1)
+assert(doc:value(doc:find("root")) == true)
+
+-- streaming
+require "io"
+require "os"
+ndjson = '{"a":1}\n{"a":2} {"a":3}\n{"a":}\n[4]\n{"a":'
+results = {}
+for d, offset, err in rjson.parse_stream(ndjson) do
+    if d then
+        results[#results + 1] = {d:type() == "object" and d:value(d:find("a")) or d:size(), offset}
+    else
+        results[#results + 1] = {err, offset}
+    end
+end
+assert(#results == 5, #results)
+assert(results[1][1] == 1 and results[1][2] == 7)
+assert(results[2][1] == 2 and results[2][2] == 15)
+assert(results[3][1] == 3 and results[3][2] == 23)
+assert(results[4][1] == "failed to parse offset:29 Invalid value.", results[4][1])
+assert(results[4][2] == 31, results[4][2])
+assert(results[5][1] == 1 and results[5][2] == 34)
+
+-- a truncated line does not take the following line with it
+truncated = '{"a":1\n{"b":2}\n'
+results = {}
+for d, offset, err in rjson.parse_stream(truncated) do
+    results[#results + 1] = {d and d:value(d:find("b")), offset, err}
+end
+assert(#results == 2, #results)
+assert(results[1][1] == false and results[1][2] == 7, results[1][2])
+assert(results[1][3] == "failed to parse offset:7 Missing a comma or '}' after an object member.", results[1][3])
+assert(results[2][1] == 2 and results[2][2] == 14, results[2][2])
+
+cnt = 0
+for d, offset in rjson.parse_stream(ndjson, 15) do
+    cnt = cnt + 1
+    assert(d:value(d:find("a")) == 3)
+    assert(offset == 23)
+    break
+end
+assert(cnt == 1)
+
+ok, err = pcall(rjson.parse_stream, {})
+assert(not ok)
+ok, err = pcall(rjson.parse_stream, "", -1)
+assert(not ok)
+
+fh = assert(io.open("ndjson.tmp", "w"))
+fh:write(ndjson)
+fh:close()
+fh = assert(io.open("ndjson.tmp"))
+cnt = 0
+last = 0
+for d, offset in rjson.parse_stream(fh, 8) do
+    cnt = cnt + 1
+    last = offset
+end
+assert(cnt == 4, cnt)
+assert(last == 34, last)
+fh:close()
+
+fh = assert(io.open("ndjson.tmp", "w"))
+fh:write(truncated)
+fh:close()
+fh = assert(io.open("ndjson.tmp"))
+results = {}
+for d, offset in rjson.parse_stream(fh) do
+    results[#results + 1] = {d and d:value(d:find("b")), offset}
+end
+assert(#results == 2, #results)
+assert(results[1][1] == false and results[1][2] == 7, results[1][2])
+assert(results[2][1] == 2 and results[2][2] == 14, results[2][2])
+it = rjson.parse_stream(fh, 0)
+fh:close()
+ok, err = pcall(it)
+assert(err == "iterator has been invalidated", err)
+os.remove("ndjson.tmp")
+
+-- document pool: collectgarbage is not available in the Heka sandbox so the
+-- documents are finalized by allocating garbage until the pool is refilled
+local function fill_pool(n)
+    for i = 1, 1000 do
+        if rjson.pool_stats() == n then return end
+        for j = 1, 1000 do local t = {j} end
+    end
+    error("no document was returned to the pool")
+end
+doc, json, rdoc, nrdoc, rvalues, it = nil, nil, nil, nil, nil, nil
+rjson.set_pool_limits(1, 8 * 1024 * 1024)
+fill_pool(1)
+doc = rjson.parse('{"pooled":true}')
+cnt = rjson.pool_stats()
+assert(cnt == 0, "the pooled document was not reused")
+assert(doc:value(doc:find("pooled")) == true)
+doc = nil
+fill_pool(1)
+
+rjson.set_pool_limits(1, 1024 * 1024)
+cnt, bytes = rjson.pool_stats()
+assert(cnt <= 1, cnt)
+rjson.set_pool_limits(0, 0)
+cnt, bytes = rjson.pool_stats()
+assert(cnt == 0 and bytes == 0)
+doc = rjson.parse('{}')
+assert(doc:type() == "object")
+ok, err = pcall(rjson.set_pool_limits, -1, 0)
+assert(not ok)
+rjson.set_pool_limits(16, 8 * 1024 * 1024)
+
+-- to_fields
+doc = rjson.parse('{"a":1,"b":{"c":"x","d":{"e":true,"f":null}},"s":["a","b"],"m":[1,"a"],"secret":"s","o":{"secret":1}}')
+f = doc:to_fields()
+assert(f.a == 1)
+assert(f["b.c"] == "x")
+assert(f["b.d.e"] == true)
+assert(f["b.d.f"] == nil)
+assert(type(f.s) == "table" and f.s[1] == "a" and f.s[2] == "b")
+assert(f.m == '[1,"a"]', f.m)
+assert(f.secret == "s")
+
+f = doc:to_fields({delimiter = "_", max_depth = 2, scrub = {"secret", "o"}, prefix = "p"})
+assert(f.p_a == 1)
+assert(f.p_b_c == "x")
+assert(f.p_b_d == '{"e":true,"f":null}', f.p_b_d)
+assert(f.p_secret == "s") -- scrub keys include the prefix
+assert(f.p_o_secret == 1)
+
+f = doc:to_fields({delimiter = "::", max_depth = 3, scrub = {"b::d::e", 1}})
+assert(f["b::c"] == "x")
+assert(f["b::d::e"] == nil)
+assert(f.m == '[1,"a"]', f.m)
+
+fields = {existing = 1}
+f = doc:to_fields(doc:find("b"), {scrub = {"d"}, fields = fields})
+assert(f == fields)
+assert(f.existing == 1)
+assert(f.c == "x")
+assert(f["d.e"] == nil)
+
+ok, err = pcall(doc.to_fields, doc, doc:find("a"))
+assert(err == "to_fields() not allowed on a non object", err)
+ok, err = pcall(doc.to_fields, doc, "foo")
+assert(not ok)
+ok, err = pcall(doc.to_fields, doc, {max_depth = -1})
+assert(not ok and err:match("max_depth must be >= 0"), err)
+ok, err = pcall(doc.to_fields, doc, {max_depth = "2"})
+assert(not ok and err:match("max_depth must be a number"), err)
@@ -0,0 +1,12 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "rjson"
+
+local doc = rjson.parse('{"s":"a\\"b\\\\c\\n\\u0001\\u00e9","d":1.0,"n":-2.5,"e":1e3,"i":3,"a":[true,false,null],"o":{}}')
+
+function process_message()
+    inject_message({Fields = {doc = doc:make_field()}})
+    return 0
+end
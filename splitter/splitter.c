@@ -0,0 +1,354 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lua chunked record splitter implementation @file */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+static const char *mozsvc_splitter = "mozsvc.splitter";
+
+static const size_t default_chunk_size      = 64 * 1024;
+static const size_t default_max_record_size = 64 * 1024;
+
+typedef struct splitter
+{
+  char    *buf;
+  size_t  size;     // allocated buffer size
+  size_t  readpos;  // start of the unconsumed data
+  size_t  scanpos;  // delimiter search resume position
+  size_t  end;      // end of the buffered data
+  size_t  chunk_size;
+  size_t  max_record_size;
+  size_t  dlen;
+  bool    has_continuation;
+  bool    continuation[256];
+  char    delimiter[];
+} splitter;
+
+
+static splitter* check_splitter(lua_State *lua, int min_args, int max_args)
+{
+  splitter *sp = luaL_checkudata(lua, 1, mozsvc_splitter);
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= min_args && n <= max_args, 0,
+                "incorrect number of arguments");
+  return sp;
+}
+
+
+static size_t check_size_option(lua_State *lua, int idx, const char *key,
+                                size_t dflt)
+{
+  lua_getfield(lua, idx, key);
+  int t = lua_type(lua, -1);
+  if (t == LUA_TNIL) {
+    lua_pop(lua, 1);
+    return dflt;
+  }
+  lua_Number n = lua_tonumber(lua, -1);
+  if (t != LUA_TNUMBER || n < 1 || n > 0x7fffffff) {
+    luaL_error(lua, "%s must be a number 1-2147483647", key);
+  }
+  lua_pop(lua, 1);
+  return (size_t)n;
+}
+
+
+static int splitter_new(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n <= 2, 0, "incorrect number of arguments");
+  size_t dlen;
+  const char *delimiter = luaL_optlstring(lua, 1, "\n", &dlen);
+  luaL_argcheck(lua, dlen > 0, 1, "delimiter cannot be empty");
+
+  size_t chunk_size = default_chunk_size;
+  size_t max_record_size = default_max_record_size;
+  const char *continuation = NULL;
+  size_t clen = 0;
+  if (!lua_isnoneornil(lua, 2)) {
+    luaL_checktype(lua, 2, LUA_TTABLE);
+    chunk_size = check_size_option(lua, 2, "chunk_size", chunk_size);
+    max_record_size = check_size_option(lua, 2, "max_record_size",
+                                        max_record_size);
+    lua_getfield(lua, 2, "continuation");
+    if (!lua_isnil(lua, -1)) {
+      if (lua_type(lua, -1) != LUA_TSTRING) {
+        return luaL_error(lua, "continuation must be a string");
+      }
+      continuation = lua_tolstring(lua, -1, &clen);
+    }
+  }
+
+  splitter *sp = lua_newuserdata(lua, sizeof(splitter) + dlen);
+  sp->buf = NULL;
+  sp->size = 0;
+  sp->readpos = 0;
+  sp->scanpos = 0;
+  sp->end = 0;
+  sp->chunk_size = chunk_size;
+  sp->max_record_size = max_record_size;
+  sp->dlen = dlen;
+  memcpy(sp->delimiter, delimiter, dlen);
+  sp->has_continuation = clen > 0;
+  memset(sp->continuation, 0, sizeof(sp->continuation));
+  for (size_t i = 0; i < clen; ++i) {
+    sp->continuation[(unsigned char)continuation[i]] = true;
+  }
+
+  luaL_getmetatable(lua, mozsvc_splitter);
+  lua_setmetatable(lua, -2);
+  return 1;
+}
+
+
+static const char* find_delimiter(splitter *sp, const char *p,
+                                  const char *end)
+{
+  while ((size_t)(end - p) >= sp->dlen) {
+    p = memchr(p, sp->delimiter[0], end - p - sp->dlen + 1);
+    if (!p) return NULL;
+    if (sp->dlen == 1 || memcmp(p + 1, sp->delimiter + 1, sp->dlen - 1) == 0) {
+      return p;
+    }
+    ++p;
+  }
+  return NULL;
+}
+
+
+/**
+ * Locates the next complete record in the buffer.
+ *
+ * @param sp Splitter
+ * @param eof True if no more data will be appended (resolves a trailing
+ *            delimiter when continuation lines are enabled)
+ * @param rec Set to the start of the record
+ * @param len Set to the record length (excluding the delimiter)
+ *
+ * @return bool True if a record was found
+ */
+static bool scan_record(splitter *sp, bool eof, const char **rec, size_t *len)
+{
+  const char *start = sp->buf + sp->readpos;
+  const char *end = sp->buf + sp->end;
+  const char *p = sp->buf + sp->scanpos;
+  bool pending = false;
+
+  while ((p = find_delimiter(sp, p, end))) {
+    const char *next = p + sp->dlen;
+    if (sp->has_continuation) {
+      if (next == end && !eof) { // the next byte decides if the record ends
+        pending = true;
+        break;
+      }
+      if (next < end && sp->continuation[(unsigned char)*next]) {
+        p = next;
+        continue;
+      }
+    }
+    if ((size_t)(p - start) > sp->max_record_size) break;
+    *rec = start;
+    *len = p - start;
+    sp->readpos = sp->scanpos = next - sp->buf;
+    return true;
+  }
+
+  if (pending) {
+    sp->scanpos = p - sp->buf;
+  } else if (sp->end - sp->readpos >= sp->dlen) { // partial delimiter match
+    sp->scanpos = sp->end - sp->dlen + 1;
+  } else {
+    sp->scanpos = sp->readpos;
+  }
+
+  if (sp->end - sp->readpos >= sp->max_record_size) { // split the record
+    *rec = start;
+    *len = sp->max_record_size;
+    sp->readpos += sp->max_record_size;
+    sp->scanpos = sp->readpos;
+    return true;
+  }
+  return false;
+}
+
+
+static bool reserve(splitter *sp, size_t len)
+{
+  if (sp->readpos > 0) { // move the partial record to the front
+    size_t remaining = sp->end - sp->readpos;
+    memmove(sp->buf, sp->buf + sp->readpos, remaining);
+    sp->scanpos -= sp->readpos;
+    sp->end = remaining;
+    sp->readpos = 0;
+  }
+  if (sp->end + len <= sp->size) return true;
+
+  size_t size = sp->size ? sp->size * 2 : sp->chunk_size;
+  if (size < sp->end + len) size = sp->end + len;
+  char *buf = realloc(sp->buf, size);
+  if (!buf) return false;
+  sp->buf = buf;
+  sp->size = size;
+  return true;
+}
+
+
+static int splitter_find_record(lua_State *lua)
+{
+  splitter *sp = check_splitter(lua, 1, 2);
+  size_t consumed = sp->readpos;
+  size_t nread = 0;
+  const char *rec = NULL;
+  size_t len = 0;
+  bool found;
+
+  switch (lua_type(lua, 2)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    found = scan_record(sp, false, &rec, &len);
+    break;
+  case LUA_TSTRING:
+    {
+      const char *s = lua_tolstring(lua, 2, &nread);
+      if (nread > 0) {
+        if (!reserve(sp, nread)) {
+          return luaL_error(lua, "memory allocation failed");
+        }
+        consumed = sp->readpos;
+        memcpy(sp->buf + sp->end, s, nread);
+        sp->end += nread;
+      }
+      found = scan_record(sp, false, &rec, &len);
+    }
+    break;
+  default:
+    {
+      FILE **fh = luaL_checkudata(lua, 2, LUA_FILEHANDLE);
+      if (!*fh) {
+        return luaL_error(lua, "attempt to use a closed file");
+      }
+      found = scan_record(sp, false, &rec, &len);
+      if (!found) { // only read when the buffered data is exhausted
+        if (!reserve(sp, sp->chunk_size)) {
+          return luaL_error(lua, "memory allocation failed");
+        }
+        consumed = sp->readpos;
+        clearerr(*fh); // allow a tail to continue reading after EOF
+        nread = fread(sp->buf + sp->end, 1, sp->chunk_size, *fh);
+        if (ferror(*fh)) {
+          return luaL_error(lua, "read error: %s", strerror(errno));
+        }
+        sp->end += nread;
+        if (nread) found = scan_record(sp, false, &rec, &len);
+      }
+    }
+    break;
+  }
+
+  if (found) {
+    lua_pushlstring(lua, rec, len);
+  } else {
+    lua_pushnil(lua);
+  }
+  lua_pushnumber(lua, (lua_Number)(sp->readpos - consumed));
+  lua_pushnumber(lua, (lua_Number)nread);
+  return 3;
+}
+
+
+static int splitter_flush(lua_State *lua)
+{
+  splitter *sp = check_splitter(lua, 1, 1);
+  size_t consumed = sp->readpos;
+  const char *rec;
+  size_t len;
+  if (!scan_record(sp, true, &rec, &len)) {
+    if (sp->readpos == sp->end) {
+      lua_pushnil(lua);
+      lua_pushnumber(lua, 0);
+      return 2;
+    }
+    rec = sp->buf + sp->readpos;
+    len = sp->end - sp->readpos;
+    sp->readpos = sp->scanpos = sp->end;
+  }
+  lua_pushlstring(lua, rec, len);
+  lua_pushnumber(lua, (lua_Number)(sp->readpos - consumed));
+  return 2;
+}
+
+
+static int splitter_reset(lua_State *lua)
+{
+  splitter *sp = check_splitter(lua, 1, 1);
+  sp->readpos = 0;
+  sp->scanpos = 0;
+  sp->end = 0;
+  return 0;
+}
+
+
+static int splitter_buffered(lua_State *lua)
+{
+  splitter *sp = check_splitter(lua, 1, 1);
+  lua_pushnumber(lua, (lua_Number)(sp->end - sp->readpos));
+  return 1;
+}
+
+
+static int splitter_gc(lua_State *lua)
+{
+  splitter *sp = check_splitter(lua, 1, 1);
+  free(sp->buf);
+  sp->buf = NULL;
+  return 0;
+}
+
+
+static int splitter_version(lua_State *lua)
+{
+  lua_pushstring(lua, DIST_VERSION);
+  return 1;
+}
+
+
+static const struct luaL_reg splitterlib_f[] =
+{
+  { "new", splitter_new }
+  , { "version", splitter_version }
+  , { NULL, NULL }
+};
+
+
+static const struct luaL_reg splitterlib_m[] =
+{
+  { "find_record", splitter_find_record }
+  , { "flush", splitter_flush }
+  , { "reset", splitter_reset }
+  , { "buffered", splitter_buffered }
+  , { "__gc", splitter_gc }
+  , { NULL, NULL }
+};
+
+
+int luaopen_splitter(lua_State *lua)
+{
+  luaL_newmetatable(lua, mozsvc_splitter);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, splitterlib_m);
+  luaL_register(lua, "splitter", splitterlib_f);
+  return 1;
+}
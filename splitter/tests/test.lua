@@ -0,0 +1,108 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "splitter"
+require "string"
+assert(splitter.version() == "1.0.0", splitter.version())
+
+local errors = {
+    function() local sp = splitter.new("\n", {}, 1) end, -- new() incorrect # args
+    function() local sp = splitter.new("") end, -- empty delimiter
+    function() local sp = splitter.new("\n", true) end, -- invalid options
+    function() local sp = splitter.new("\n", {chunk_size = 0}) end, -- invalid chunk_size
+    function() local sp = splitter.new("\n", {max_record_size = "a"}) end, -- invalid max_record_size
+    function() local sp = splitter.new("\n", {continuation = 1}) end, -- invalid continuation
+    function()
+        local sp = splitter.new()
+        sp:find_record({}) -- invalid source
+    end,
+    function()
+        local sp = splitter.new()
+        sp:flush(1) --incorrect # args
+    end,
+}
+
+for i, v in ipairs(errors) do
+    local ok = pcall(v)
+    if ok then error(string.format("error test %d failed\n", i)) end
+end
+
+local function collect(sp, data)
+    local records = {}
+    local total = 0
+    local rec, consumed = sp:find_record(data)
+    while rec do
+        records[#records + 1] = rec
+        total = total + consumed
+        rec, consumed = sp:find_record()
+    end
+    return records, total + consumed
+end
+
+-- new line
+local sp = splitter.new()
+local r, consumed = collect(sp, "one\ntwo\nthr")
+assert(#r == 2 and r[1] == "one" and r[2] == "two", table.concat(r, ","))
+assert(consumed == 8, consumed)
+assert(sp:buffered() == 3, sp:buffered())
+r, consumed = collect(sp, "ee\n")
+assert(#r == 1 and r[1] == "three", r[1])
+assert(consumed == 6, consumed)
+
+-- multi-byte token split across appends
+sp = splitter.new("\r\n")
+r = collect(sp, "a\r")
+assert(#r == 0)
+r = collect(sp, "\nb\r\n")
+assert(#r == 2 and r[1] == "a" and r[2] == "b", table.concat(r, ","))
+
+-- multi-line records
+sp = splitter.new("\n", {continuation = " \t"})
+r = collect(sp, "error one\n at a\n\tat b\nerror two\n")
+assert(#r == 1 and r[1] == "error one\n at a\n\tat b", r[1])
+local rec, consumed = sp:flush()
+assert(rec == "error two" and consumed == 10, tostring(rec))
+assert(sp:flush() == nil)
+
+-- oversized records are split
+sp = splitter.new("\n", {max_record_size = 4})
+r = collect(sp, "abcdefg\n")
+assert(#r == 2 and r[1] == "abcd" and r[2] == "efg", table.concat(r, ","))
+
+-- reset
+sp = splitter.new()
+collect(sp, "partial")
+sp:reset()
+assert(sp:buffered() == 0)
+
+-- file handle
+local ok, io = pcall(require, "io")
+if ok and io.tmpfile then
+    local fh = io.tmpfile()
+    local lines = {}
+    for i = 1, 1000 do
+        lines[i] = string.format("line %d", i)
+    end
+    fh:write(table.concat(lines, "\n"))
+    fh:seek("set")
+
+    sp = splitter.new("\n", {chunk_size = 100})
+    local cnt, offset, reads = 0, 0, 0
+    while true do
+        local rec, consumed, read = sp:find_record(fh)
+        offset = offset + consumed
+        if rec then
+            cnt = cnt + 1
+            assert(rec == lines[cnt], rec)
+        end
+        if read > 0 then reads = reads + 1 end
+        if not rec and read == 0 then break end
+    end
+    local rec, consumed = sp:flush()
+    assert(rec == lines[1000], tostring(rec))
+    assert(cnt == 999, cnt)
+    assert(offset + consumed == fh:seek(), offset + consumed)
+    assert(reads > 1, reads)
+    fh:close()
+end